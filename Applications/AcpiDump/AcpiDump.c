@@ -12,6 +12,7 @@
 
 #include <Uefi.h>
 #include <Library/UefiLib.h>
+#include <Library/PrintLib.h>
 #include <Library/UefiBootServicesTableLib.h>
 #include <Library/UtilsLib.h>
 
@@ -21,18 +22,28 @@
 #include <Guid/Acpi.h>
 
 static RANGE_CHECK_CONTEXT RangeCheck;
+static FILE_SAVE_SESSION Session;
+static BUNDLE_WRITER Bundle;
+static CHAR16 *BundleName = NULL;
+
+static EFI_STATUS
+Usage (
+       IN CHAR16 *Name
+       )
+{
+  Print(L"Usage: %s [-b bundle] [where]\n", Name);
+  return EFI_INVALID_PARAMETER;
+}
 
 static
 EFI_STATUS
 TableSave (
-           IN EFI_HANDLE Handle,
-           IN CHAR16 *VolSubDir,
            IN EFI_ACPI_DESCRIPTION_HEADER *Table
            )
 {
   EFI_STATUS Status;
   static unsigned Index = 0;
-  CHAR16 Path[3 + 4 + 1 + 3 + 1];
+  CHAR16 Path[10 + 1 + 4 + 1 + 3 + 1];
 
   if (Table == NULL) {
     Print(L"<skipping empty SDT entry\n");
@@ -53,25 +64,17 @@ TableSave (
     return Status;
   }
 
-  Index = Index % 100;
-  Path[0] = '0' + Index / 10;
-  Path[1] = '0' + Index % 10;
-  Path[2] = '-';
-  Path[3] = ((CHAR8 *) &Table->Signature)[0];
-  Path[4] = ((CHAR8 *) &Table->Signature)[1];
-  Path[5] = ((CHAR8 *) &Table->Signature)[2];
-  Path[6] = ((CHAR8 *) &Table->Signature)[3];
-  Path[7] = L'.';
-  Path[8] = L'a';
-  Path[9] = L'm';
-  Path[10] = L'l';
-  Path[11] = L'\0';
-  Index++;
-
-  Status = FileSystemSave(Handle, VolSubDir, Path, Table, Table->Length);
+  UnicodeSPrint(Path, sizeof(Path), L"%02d-%.4a.aml",
+                Index++, &Table->Signature);
+
+  if (BundleName != NULL) {
+    Status = BundleAdd(&Bundle, Path, Table, Table->Length);
+  } else {
+    Status = FileSaveSessionSave(&Session, Path, Table, Table->Length);
+  }
   if (Status != EFI_SUCCESS) {
     //
-    // FileSystemSave already does sufficient logging. We only
+    // The session already does sufficient logging. We only
     // return failure if there was something wrong with the
     // table itself.
     //
@@ -99,6 +102,8 @@ UefiMain (
   EFI_ACPI_DESCRIPTION_HEADER *Xsdt;
   EFI_LOADED_IMAGE_PROTOCOL *ImageProtocol;
   EFI_ACPI_5_0_ROOT_SYSTEM_DESCRIPTION_POINTER *Rsdp;
+  GET_OPT_CONTEXT GetOptContext;
+  ACPI_VALIDATION Validation;
   CHAR16 *VolSubDir;
 
   EFI_GUID AcpiGuids[2] = {
@@ -108,8 +113,26 @@ UefiMain (
 
   VolSubDir = L".";
   Status = GetShellArgcArgv(ImageHandle, &Argc, &Argv);
-  if (Status == EFI_SUCCESS && Argc > 1) {
-    VolSubDir = Argv[1];
+  if (Status == EFI_SUCCESS) {
+    INIT_GET_OPT_CONTEXT(&GetOptContext);
+    while ((Status = GetOpt(Argc, Argv, L"b",
+                            &GetOptContext)) == EFI_SUCCESS) {
+      switch (GetOptContext.Opt) {
+      case L'b':
+        BundleName = GetOptContext.OptArg;
+        if (BundleName == NULL) {
+          return Usage(Argv[0]);
+        }
+        break;
+      default:
+        Print(L"Unknown option '%c'\n", GetOptContext.Opt);
+        return Usage(Argv[0]);
+      }
+    }
+
+    if (Argc > GetOptContext.OptIndex) {
+      VolSubDir = Argv[GetOptContext.OptIndex];
+    }
   }
 
   Status = InitRangeCheckContext(TRUE, TRUE, &RangeCheck);
@@ -118,7 +141,11 @@ UefiMain (
     return Status;
   }
 
-  Print(L"Dumping tables to '\\%s'\n", VolSubDir);
+  if (BundleName != NULL) {
+    Print(L"Dumping tables to '\\%s\\%s'\n", VolSubDir, BundleName);
+  } else {
+    Print(L"Dumping tables to '\\%s'\n", VolSubDir);
+  }
 
   Status = gBS->HandleProtocol (ImageHandle, &gEfiLoadedImageProtocolGuid,
                                 (void **) &ImageProtocol);
@@ -127,6 +154,23 @@ UefiMain (
     goto done;
   }
 
+  //
+  // Tables stay put, so they can be written asynchronously.
+  //
+  Status = FileSaveSessionOpen(ImageProtocol->DeviceHandle, VolSubDir, TRUE,
+                               &Session);
+  if (Status != EFI_SUCCESS) {
+    goto done;
+  }
+
+  if (BundleName != NULL) {
+    Status = BundleOpen(&Session, BundleName, &Bundle);
+    if (Status != EFI_SUCCESS) {
+      BundleName = NULL;
+      goto done;
+    }
+  }
+
   for (i = 0; i < 2; i++) {
     Rsdp = GetTable(&AcpiGuids[i]);
     if (Rsdp != NULL) {
@@ -139,6 +183,11 @@ UefiMain (
     goto done;
   }
 
+  if (AcpiValidate(&RangeCheck, Rsdp, &Validation) == EFI_SUCCESS) {
+    AcpiValidationPrint(&Validation, FALSE);
+    AcpiValidationFree(&Validation);
+  }
+
   if (Rsdp->Revision >= EFI_ACPI_2_0_ROOT_SYSTEM_DESCRIPTION_POINTER_REVISION) {
     Xsdt = (EFI_ACPI_DESCRIPTION_HEADER *) (UINTN) Rsdp->XsdtAddress;
   } else {
@@ -183,7 +232,7 @@ UefiMain (
       TableHeader = (EFI_ACPI_DESCRIPTION_HEADER *) (UINTN) *(UINT64 *) SdtTable;
     }
 
-    Status = TableSave(ImageProtocol->DeviceHandle, VolSubDir, TableHeader);
+    Status = TableSave(TableHeader);
 
     if (Status == EFI_SUCCESS &&
         TableHeader->Signature == EFI_ACPI_5_1_FIXED_ACPI_DESCRIPTION_TABLE_SIGNATURE) {
@@ -204,13 +253,13 @@ UefiMain (
       }
 
       if (DsdtHeader != NULL) {
-        TableSave(ImageProtocol->DeviceHandle, VolSubDir, DsdtHeader);
+        TableSave(DsdtHeader);
       } else {
         Print(L"No DSDT\n");
       }
 
       if (FacsHeader != NULL) {
-        TableSave(ImageProtocol->DeviceHandle, VolSubDir, FacsHeader);
+        TableSave(FacsHeader);
       } else {
         Print(L"No FACS\n");
       }
@@ -220,6 +269,10 @@ UefiMain (
   Print(L"All done!\n");
 
 done:
+  if (BundleName != NULL) {
+    BundleClose(&Bundle);
+  }
+  FileSaveSessionClose(&Session);
   CleanRangeCheckContext(&RangeCheck);
   return Status;
 }
@@ -146,6 +146,40 @@ LoadTables (
   Fs->Close (Dir);
 }
 
+//
+// Checks what got installed, the same way AcpiDump checks
+// the firmware tables.
+//
+VOID
+ValidateTables (
+                IN EFI_GUID *AcpiGuid
+                )
+{
+  VOID *Rsdp;
+  EFI_STATUS Status;
+  ACPI_VALIDATION Validation;
+  RANGE_CHECK_CONTEXT RangeCheck;
+
+  Rsdp = GetTable(AcpiGuid);
+  if (Rsdp == NULL) {
+    Print(L"No tables were installed\n");
+    return;
+  }
+
+  Status = InitRangeCheckContext(TRUE, TRUE, &RangeCheck);
+  if (EFI_ERROR(Status)) {
+    Print(L"Couldn't initialize range checking: %r\n", Status);
+    return;
+  }
+
+  if (AcpiValidate(&RangeCheck, Rsdp, &Validation) == EFI_SUCCESS) {
+    AcpiValidationPrint(&Validation, FALSE);
+    AcpiValidationFree(&Validation);
+  }
+
+  CleanRangeCheckContext(&RangeCheck);
+}
+
 EFI_STATUS
 EFIAPI
 UefiMain (
@@ -192,6 +226,7 @@ UefiMain (
   }
 
   LoadTables(ImageProtocol->DeviceHandle, VolSubDir, &AcpiPrivate);
+  ValidateTables(&AcpiGuids[0]);
 
   Print(L"All done!\n");
   return Status;
@@ -15,6 +15,7 @@
  */
 
 #include "AcpiSupport.h"
+#include <Library/UtilsLib.h>
 
 #define  OEM_ID           "LOADED"
 #define  OEM_TABLE_ID     "_LOADED_"
@@ -1115,13 +1116,8 @@ AcpiPlatformChecksum (
                       IN UINTN ChecksumOffset
                       )
 {
-  UINT8 Sum;
   UINT8 *Ptr;
 
-  Sum = 0;
-  //
-  // Initialize pointer
-  //
   Ptr = Buffer;
 
   //
@@ -1130,16 +1126,9 @@ AcpiPlatformChecksum (
   Ptr[ChecksumOffset] = 0;
 
   //
-  // add all content of buffer
-  //
-  while ((Size--) != 0) {
-    Sum = (UINT8) (Sum + (*Ptr++));
-  }
-  //
-  // set checksum
+  // set checksum, so that all content of buffer adds up to 0
   //
-  Ptr                 = Buffer;
-  Ptr[ChecksumOffset] = (UINT8) (0xff - Sum + 1);
+  Ptr[ChecksumOffset] = (UINT8) (0 - AcpiChecksum (Buffer, Size));
 
   return EFI_SUCCESS;
 }
@@ -19,6 +19,46 @@
 #include <Protocol/LoadedImage.h>
 #include <Guid/Fdt.h>
 
+static EFI_STATUS
+Usage (
+       IN CHAR16 *Name
+       )
+{
+  Print(L"Usage: %s [-b bundle] [where]\n", Name);
+  return EFI_INVALID_PARAMETER;
+}
+
+//
+// Saves the FDT as the only member of a bundle, for collecting
+// the same way as AcpiDump and PciRom output.
+//
+static EFI_STATUS
+BundleSave (
+            IN EFI_HANDLE Handle,
+            IN CHAR16 *VolSubDir,
+            IN CHAR16 *BundleName,
+            IN VOID *Fdt
+            )
+{
+  EFI_STATUS Status;
+  BUNDLE_WRITER Bundle;
+  FILE_SAVE_SESSION Session;
+
+  Status = FileSaveSessionOpen(Handle, VolSubDir, FALSE, &Session);
+  if (Status != EFI_SUCCESS) {
+    return Status;
+  }
+
+  Status = BundleOpen(&Session, BundleName, &Bundle);
+  if (Status == EFI_SUCCESS) {
+    BundleAdd(&Bundle, L"fdt.dtb", Fdt, fdt_totalsize(Fdt));
+    Status = BundleClose(&Bundle);
+  }
+
+  FileSaveSessionClose(&Session);
+  return Status;
+}
+
 EFI_STATUS
 EFIAPI
 UefiMain (
@@ -31,13 +71,34 @@ UefiMain (
   EFI_STATUS Status;
   EFI_LOADED_IMAGE_PROTOCOL *ImageProtocol;
   RANGE_CHECK_CONTEXT RangeCheck;
+  GET_OPT_CONTEXT GetOptContext;
+  CHAR16 *BundleName;
   CHAR16 *VolSubDir;
   VOID *Fdt;
 
   VolSubDir = L".";
+  BundleName = NULL;
   Status = GetShellArgcArgv(ImageHandle, &Argc, &Argv);
-  if (Status == EFI_SUCCESS && Argc > 1) {
-    VolSubDir = Argv[1];
+  if (Status == EFI_SUCCESS) {
+    INIT_GET_OPT_CONTEXT(&GetOptContext);
+    while ((Status = GetOpt(Argc, Argv, L"b",
+                            &GetOptContext)) == EFI_SUCCESS) {
+      switch (GetOptContext.Opt) {
+      case L'b':
+        BundleName = GetOptContext.OptArg;
+        if (BundleName == NULL) {
+          return Usage(Argv[0]);
+        }
+        break;
+      default:
+        Print(L"Unknown option '%c'\n", GetOptContext.Opt);
+        return Usage(Argv[0]);
+      }
+    }
+
+    if (Argc > GetOptContext.OptIndex) {
+      VolSubDir = Argv[GetOptContext.OptIndex];
+    }
   }
   Print(L"Dumping FDT to '\\%s'\n", VolSubDir);
 
@@ -74,8 +135,12 @@ UefiMain (
 
   Print(L"FDT 0x%x bytes\n", fdt_totalsize(Fdt));
 
-  FileSystemSave(ImageProtocol->DeviceHandle, VolSubDir,
-                 L"fdt.dtb", Fdt, fdt_totalsize(Fdt));
+  if (BundleName != NULL) {
+    BundleSave(ImageProtocol->DeviceHandle, VolSubDir, BundleName, Fdt);
+  } else {
+    FileSystemSave(ImageProtocol->DeviceHandle, VolSubDir,
+                   L"fdt.dtb", Fdt, fdt_totalsize(Fdt));
+  }
 
   Print(L"All done!\n");
 
@@ -30,6 +30,8 @@ UefiMain (
   EFI_STATUS Status;
   EFI_MEMORY_TYPE type;
   EFI_DXE_SERVICES *DS = NULL;
+  RANGE_CHECK_CONTEXT RangeCheck;
+  BOOLEAN Verify;
 
   EfiGetSystemConfigurationTable(&gEfiDxeServicesTableGuid, (VOID **) &DS);
   if (DS == NULL) {
@@ -69,6 +71,21 @@ UefiMain (
 
   DS->RemoveMemorySpace(RangeStart, RangeLength);
 
+  //
+  // Take the memory map snapshot used for verification before
+  // the range is added, so that setting it up can't allocate
+  // from the range. The add and the allocation are then applied
+  // to the snapshot, so verifying doesn't fetch the map again.
+  // The reservation is still made if this fails.
+  //
+  Status = InitRangeCheckContext(TRUE, TRUE, &RangeCheck);
+  if (Status != EFI_SUCCESS) {
+    Print(L"Warning: couldn't set up verification: %r\n", Status);
+    Verify = FALSE;
+  } else {
+    Verify = TRUE;
+  }
+
   //
   // This seems like the only reasonable way to ensure
   // that a range is added if it is absent. Adding
@@ -84,14 +101,26 @@ UefiMain (
   if (Status != EFI_SUCCESS) {
     Print(L"Warning: couldn't add reserved memory space 0x%lx-0x%lx: %r\n",
           RangeStart, RangeStart + RangeLength, Status);
+  } else if (Verify) {
+    SnapshotAddRange(RangeCheck.Snapshot, RangeStart,
+                     EFI_SIZE_TO_PAGES(RangeLength), EfiConventionalMemory,
+                     EFI_MEMORY_UC | EFI_MEMORY_RUNTIME);
   }
 
-  Status = gBS->AllocatePages(AllocateAddress, type,
-                              EFI_SIZE_TO_PAGES(RangeLength), &RangeStart);
+  if (Verify) {
+    Status = SnapshotAllocatePages(RangeCheck.Snapshot, AllocateAddress, type,
+                                   EFI_SIZE_TO_PAGES(RangeLength), &RangeStart);
+  } else {
+    Status = gBS->AllocatePages(AllocateAddress, type,
+                                EFI_SIZE_TO_PAGES(RangeLength), &RangeStart);
+  }
   if (Status != EFI_SUCCESS) {
     Print(L"Warning: couldn't allocate reserved memory space 0x%lx-0x%lx: %r\n",
           RangeStart, RangeStart + RangeLength, Status);
+  } else if (Verify) {
+    Status = RangeIsMapped(&RangeCheck, RangeStart, RangeLength);
   }
 
+  CleanRangeCheckContext(&RangeCheck);
   return Status;
 }
@@ -12,6 +12,7 @@
 
 #include <Uefi.h>
 #include <Library/UefiLib.h>
+#include <Library/PrintLib.h>
 #include <Library/UefiBootServicesTableLib.h>
 #include <Pi/PiDxeCis.h>
 #include <Library/UtilsLib.h>
@@ -22,13 +23,16 @@
 
 static CHAR16 *VolSubDir = NULL;
 static EFI_HANDLE DeviceHandle = NULL;
+static FILE_SAVE_SESSION Session;
+static BUNDLE_WRITER Bundle;
+static CHAR16 *BundleName = NULL;
 
 static EFI_STATUS
 Usage (
        IN CHAR16 *Name
        )
 {
-  Print(L"Usage: %s [-s where] seg bus dev func\n", Name);
+  Print(L"Usage: %s [-s where] [-b bundle] seg bus dev func\n", Name);
   return EFI_INVALID_PARAMETER;
 }
 
@@ -81,31 +85,21 @@ DumpImage (
 
   if (VolSubDir != NULL) {
     static unsigned Index = 0;
-    CHAR16 Path[3 + 4 + 1 + 3 + 1];
+    CHAR16 Path[10 + 1 + 4 + 1 + 3 + 1];
     /*
      * Okay, really save.
      */
-    Index = Index % 100;
-    Path[0] = '0' + Index / 10;
-    Path[1] = '0' + Index % 10;
-    Path[2] = '-';
-    Path[3] = Type[0];
-    Path[4] = Type[1];
-    Path[5] = Type[2];
-    Path[6] = Type[3];
-    Path[7] = L'.';
-    Path[8] = L'r';
-    Path[9] = L'o';
-    Path[10] = L'm';
-    Path[11] = L'\0';
-    Index++;
+    UnicodeSPrint(Path, sizeof(Path), L"%02d-%s.rom", Index++, Type);
     /*
-     * FileSystemSave does sufficient logging.
+     * The session does sufficient logging.
      */
-    Print(L"Saving %s\\%s\n", VolSubDir, Path);
-    FileSystemSave(DeviceHandle,
-                   VolSubDir, Path,
-                   RomHeader, Length);
+    if (BundleName != NULL) {
+      Print(L"Saving %s to %s\\%s\n", Path, VolSubDir, BundleName);
+      BundleAdd(&Bundle, Path, RomHeader, Length);
+    } else {
+      Print(L"Saving %s\\%s\n", VolSubDir, Path);
+      FileSaveSessionSave(&Session, Path, RomHeader, Length);
+    }
   }
 }
 
@@ -212,35 +206,46 @@ UefiMain (
   }
 
   INIT_GET_OPT_CONTEXT(&GetOptContext);
-  while ((Status = GetOpt(Argc, Argv, L"s",
+  while ((Status = GetOpt(Argc, Argv, L"sb",
                           &GetOptContext)) == EFI_SUCCESS) {
     switch (GetOptContext.Opt) {
-    case 's': {
-        EFI_LOADED_IMAGE_PROTOCOL *ImageProtocol;
-
-        VolSubDir = GetOptContext.OptArg;
-        if (VolSubDir == NULL) {
-          VolSubDir = L".";
-        }
-
-        Status = gBS->HandleProtocol(ImageHandle,
-                                     &gEfiLoadedImageProtocolGuid,
-                                     (void **) &ImageProtocol);
-        if (Status != EFI_SUCCESS) {
-          Print(L"Couldn't get loaded image device handle: %r\n",
-                Status);
-          return Status;
-        }
-
-        DeviceHandle = ImageProtocol->DeviceHandle;
-        break;
-    }
+    case 's':
+      VolSubDir = GetOptContext.OptArg;
+      if (VolSubDir == NULL) {
+        VolSubDir = L".";
+      }
+      break;
+    case 'b':
+      BundleName = GetOptContext.OptArg;
+      if (BundleName == NULL) {
+        return Usage(Argv[0]);
+      }
+
+      if (VolSubDir == NULL) {
+        VolSubDir = L".";
+      }
+      break;
     default:
       Print(L"Unknown option '%c'\n", GetOptContext.Opt);
       return Usage(Argv[0]);
     }
   }
 
+  if (VolSubDir != NULL) {
+    EFI_LOADED_IMAGE_PROTOCOL *ImageProtocol;
+
+    Status = gBS->HandleProtocol(ImageHandle,
+                                 &gEfiLoadedImageProtocolGuid,
+                                 (void **) &ImageProtocol);
+    if (Status != EFI_SUCCESS) {
+      Print(L"Couldn't get loaded image device handle: %r\n",
+            Status);
+      return Status;
+    }
+
+    DeviceHandle = ImageProtocol->DeviceHandle;
+  }
+
   if ((Argc - GetOptContext.OptIndex) < 4) {
     return Usage(Argv[0]);
   }
@@ -291,7 +296,29 @@ UefiMain (
           WantSeg, WantBus, WantDev, WantFunc);
     Status = EFI_NOT_FOUND;
   } else {
+    if (VolSubDir != NULL &&
+        FileSaveSessionOpen(DeviceHandle, VolSubDir, TRUE,
+                            &Session) != EFI_SUCCESS) {
+      /*
+       * FileSaveSessionOpen does sufficient logging.
+       */
+      VolSubDir = NULL;
+    }
+
+    if (VolSubDir != NULL && BundleName != NULL &&
+        BundleOpen(&Session, BundleName, &Bundle) != EFI_SUCCESS) {
+      FileSaveSessionClose(&Session);
+      VolSubDir = NULL;
+    }
+
     Status = AnalyzeROM(PciIo);
+
+    if (VolSubDir != NULL) {
+      if (BundleName != NULL) {
+        BundleClose(&Bundle);
+      }
+      FileSaveSessionClose(&Session);
+    }
   }
 
   gBS->FreePool(PciHandles);
@@ -11,19 +11,71 @@
  */
 
 #include <Uefi.h>
+#include <Library/BaseLib.h>
 #include <Library/UefiLib.h>
 #include <Library/UefiBootServicesTableLib.h>
 #include <Library/UtilsLib.h>
 
+STATIC CHAR16 *mMemoryTypes[] = {
+  L"Reserved",
+  L"LoaderCode",
+  L"LoaderData",
+  L"BS_Code",
+  L"BS_Data",
+  L"RT_Code",
+  L"RT_Data",
+  L"Available",
+  L"Unusable",
+  L"ACPI_Recl",
+  L"ACPI_NVS",
+  L"MMIO",
+  L"MMIO_Port",
+  L"PalCode",
+  L"Persistent",
+};
+
 EFI_STATUS
 Usage (
        IN CHAR16 *Name
        )
 {
   Print(L"Usage: %s [-q] range-start range-end\n", Name);
+  Print(L"       %s -m\n", Name);
   return EFI_INVALID_PARAMETER;
 }
 
+EFI_STATUS
+DumpMap (
+         VOID
+         )
+{
+  UINTN Index;
+  EFI_STATUS Status;
+  EFI_MEMORY_DESCRIPTOR *Next;
+  MEMORY_MAP_SNAPSHOT *Snapshot;
+
+  Status = GetMemoryMapSnapshot(&Snapshot);
+  if (EFI_ERROR(Status)) {
+    Print(L"Couldn't get the memory map: %r\n", Status);
+    return Status;
+  }
+
+  for (Next = Snapshot->Map, Index = 0;
+       Index < Snapshot->MapSize / Snapshot->DescriptorSize;
+       Index++, Next = NEXT_MEMORY_DESCRIPTOR(Next, Snapshot->DescriptorSize)) {
+    Print(L"%-10s 0x%016lx-0x%016lx 0x%016lx\n",
+          Next->Type < ARRAY_SIZE(mMemoryTypes) ?
+          mMemoryTypes[Next->Type] : L"Unknown",
+          Next->PhysicalStart,
+          Next->PhysicalStart - 1 + LShiftU64(Next->NumberOfPages,
+                                              EFI_PAGE_SHIFT),
+          Next->Attribute);
+  }
+
+  PutMemoryMapSnapshot(Snapshot);
+  return EFI_SUCCESS;
+}
+
 EFI_STATUS
 EFIAPI
 UefiMain (
@@ -34,6 +86,7 @@ UefiMain (
   UINTN Argc;
   CHAR16 **Argv;
   BOOLEAN Quiet;
+  BOOLEAN Dump;
   UINTN RangeStart;
   UINTN RangeLength;
   EFI_STATUS Status;
@@ -48,6 +101,7 @@ UefiMain (
   }
 
   Quiet = FALSE;
+  Dump = FALSE;
   INIT_GET_OPT_CONTEXT(&GetOptContext);
   while ((Status = GetOpt(Argc, Argv, NULL,
                           &GetOptContext)) == EFI_SUCCESS) {
@@ -55,12 +109,19 @@ UefiMain (
     case L'q':
       Quiet = TRUE;
       break;
+    case L'm':
+      Dump = TRUE;
+      break;
     default:
       Print(L"Unknown option '%c'\n", GetOptContext.Opt);
       return Usage(Argv[0]);
     }
   }
 
+  if (Dump) {
+    return DumpMap();
+  }
+
   if (Argc - GetOptContext.OptIndex < 2) {
     return Usage(Argv[0]);
   }
@@ -328,6 +328,28 @@ SetACPIVars (
   }
 }
 
+static
+VOID
+SetACPIValidVars (
+                  IN EFI_ACPI_5_0_ROOT_SYSTEM_DESCRIPTION_POINTER *Rsdp
+                  )
+{
+  CHAR16 Bad[sizeof("0x") + 16];
+  ACPI_VALIDATION Validation;
+
+  if (AcpiValidate(&RangeCheck, Rsdp, &Validation) != EFI_SUCCESS) {
+    return;
+  }
+
+  AcpiValidationPrint(&Validation, FALSE);
+
+  UnicodeSPrint(Bad, sizeof(Bad), L"0x%x", Validation.Bad);
+  ShellSetEnvironmentVariable(L"pvar-acpi-bad-tables", Bad, TRUE);
+  ShellSetEnvironmentVariable(L"pvar-acpi-valid",
+                              Validation.Bad == 0 ? L"True" : L"False", TRUE);
+  AcpiValidationFree(&Validation);
+}
+
 #ifdef WITH_FDT
 static VOID
 HandleFdt (
@@ -451,6 +473,7 @@ UefiMain (
   if (Rsdp != NULL) {
     Print(L"Parsing ACPI\n");
     SetACPIVars(Rsdp);
+    SetACPIValidVars(Rsdp);
   }
 
 #ifdef WITH_FDT
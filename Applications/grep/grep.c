@@ -258,6 +258,8 @@ add_fpattern(const char *pat, int mode)
 		    sizeof(struct epat));
 	}
 	fpattern[fpatterns].pat = grep_strdup(pat);
+	if ((fpattern[fpatterns].prog = fnmatch_compile(pat, 0)) == NULL)
+		err(2, NULL);
 	fpattern[fpatterns].mode = mode;
 	++fpatterns;
 }
@@ -276,6 +278,8 @@ add_dpattern(const char *pat, int mode)
 		    sizeof(struct epat));
 	}
 	dpattern[dpatterns].pat = grep_strdup(pat);
+	if ((dpattern[dpatterns].prog = fnmatch_compile(pat, 0)) == NULL)
+		err(2, NULL);
 	dpattern[dpatterns].mode = mode;
 	++dpatterns;
 }
@@ -289,15 +293,11 @@ read_patterns(const char *fn)
 	FILE *f;
 	char *line;
 	size_t len;
-	ssize_t rlen;
 
 	if ((f = fopen(fn, "r")) == NULL)
 		err(2, "%s", fn);
-	line = NULL;
-	len = 0;
-	while ((rlen = getline(&line, &len, f)) != -1)
-		add_pattern(line, *line == '\n' ? 0 : (size_t)rlen);
-	free(line);
+	while ((line = fgetline(f, &len)) != NULL)
+		add_pattern(line, *line == '\n' ? 0 : len);
 	if (ferror(f))
 		err(2, "%s", fn);
 	fclose(f);
@@ -94,6 +94,7 @@ struct str {
 
 struct epat {
 	char		*pat;
+	fnmatch_t	*prog;
 	int		 mode;
 };
 
@@ -73,8 +73,8 @@ file_matching(const char *fname)
 	fname_base = basename(fname_copy);
 
 	for (i = 0; i < fpatterns; ++i) {
-		if (fnmatch(fpattern[i].pat, fname, 0) == 0 ||
-		    fnmatch(fpattern[i].pat, fname_base, 0) == 0) {
+		if (fnmatch_exec(fpattern[i].prog, fname) == 0 ||
+		    fnmatch_exec(fpattern[i].prog, fname_base) == 0) {
 			if (fpattern[i].mode == EXCL_PAT) {
 				free(fname_copy);
 				return (false);
@@ -96,7 +96,7 @@ dir_matching(const char *dname)
 
 	for (i = 0; i < dpatterns; ++i) {
 		if (dname != NULL &&
-		    fnmatch(dname, dpattern[i].pat, 0) == 0) {
+		    fnmatch_exec(dpattern[i].prog, dname) == 0) {
 			if (dpattern[i].mode == EXCL_PAT)
 				return (false);
 			else
@@ -197,3 +197,93 @@ revsizecmp(const FTSENT *a, const FTSENT *b)
 	else
 		return (revnamecmp(a, b));
 }
+
+/*
+ * Sort keys, see fts_set_sortkey. Each is the leading part of the
+ * ordering implemented by the matching comparison function above, in
+ * the low KEY_BITS bits (the rest is left for mastercmp's classes).
+ * Entries with equal keys are ordered by the comparison function.
+ */
+#define	KEY_MASK	((1ULL << KEY_BITS) - 1)
+
+static unsigned long long
+nameprefix(const FTSENT *p)
+{
+	unsigned long long key;
+	size_t i;
+
+	/* strcmp compares as unsigned char. */
+	for (key = 0, i = 0; i < KEY_BITS / 8; i++) {
+		key <<= 8;
+		if (i < p->fts_namelen)
+			key |= (unsigned char)p->fts_name[i];
+	}
+	return (key);
+}
+
+static unsigned long long
+clampkey(long long v)
+{
+
+	if (v < 0)
+		return (0);
+	if ((unsigned long long)v > KEY_MASK)
+		return (KEY_MASK);
+	return ((unsigned long long)v);
+}
+
+unsigned long long
+namekey(const FTSENT *p)
+{
+
+	return (nameprefix(p));
+}
+
+unsigned long long
+revnamekey(const FTSENT *p)
+{
+
+	return (KEY_MASK - nameprefix(p));
+}
+
+unsigned long long
+modkey(const FTSENT *p)
+{
+
+	return (KEY_MASK - clampkey(p->fts_statp->st_mtime));
+}
+
+unsigned long long
+revmodkey(const FTSENT *p)
+{
+
+	return (clampkey(p->fts_statp->st_mtime));
+}
+
+unsigned long long
+acckey(const FTSENT *p)
+{
+
+	return (KEY_MASK - clampkey(p->fts_statp->st_atime));
+}
+
+unsigned long long
+revacckey(const FTSENT *p)
+{
+
+	return (clampkey(p->fts_statp->st_atime));
+}
+
+unsigned long long
+sizekey(const FTSENT *p)
+{
+
+	return (KEY_MASK - clampkey(p->fts_statp->st_size));
+}
+
+unsigned long long
+revsizekey(const FTSENT *p)
+{
+
+	return (clampkey(p->fts_statp->st_size));
+}
@@ -42,11 +42,23 @@ int	 revstatcmp(const FTSENT *, const FTSENT *);
 int	 sizecmp(const FTSENT *, const FTSENT *);
 int	 revsizecmp(const FTSENT *, const FTSENT *);
 
+#define	KEY_BITS	56
+unsigned long long	 acckey(const FTSENT *);
+unsigned long long	 revacckey(const FTSENT *);
+unsigned long long	 modkey(const FTSENT *);
+unsigned long long	 revmodkey(const FTSENT *);
+unsigned long long	 namekey(const FTSENT *);
+unsigned long long	 revnamekey(const FTSENT *);
+unsigned long long	 sizekey(const FTSENT *);
+unsigned long long	 revsizekey(const FTSENT *);
+
 int	 ls_main(int, char *[]);
 
 int	 printescaped(const char *);
 void	 printacol(DISPLAY *);
 void	 printcol(DISPLAY *);
+void	 printdirent(FTSENT *);
+void	 printdirend(void);
 void	 printlong(DISPLAY *);
 void	 printscol(DISPLAY *);
 void	 printstream(DISPLAY *);
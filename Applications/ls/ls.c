@@ -70,15 +70,20 @@ __RCSID("$NetBSD: ls.c,v 1.75.4.1 2017/04/21 16:50:42 bouyer Exp $");
 
 static void	 display(FTSENT *, FTSENT *);
 static int	 mastercmp(const struct FTSENT * const *, const struct FTSENT * const *);
+static unsigned long long masterkey(const FTSENT *);
+static void	 streamdir(FTSENT *, int);
 static void	 traverse(int, char **, int);
 
 static void (*printfcn)(DISPLAY *);
 static int (*sortfcn)(const FTSENT *, const FTSENT *);
+static unsigned long long (*keyfcn)(const FTSENT *);
 
 #define	BY_NAME 0
 #define	BY_SIZE 1
 #define	BY_TIME	2
 
+#define	ISDOT(a)	(a[0] == '.' && (!a[1] || (a[1] == '.' && !a[2])))
+
 long blocksize = S_BLKSIZE;	/* block size units */
 int termwidth = 80;		/* default terminal width */
 int sortkey = BY_NAME;
@@ -119,7 +124,7 @@ usage(void)
 {
 
 	(void)fprintf(stderr,
-	    "usage: %s [-1AaBbCcdFfghikLlMmnOoPpqRrSsTtuWwXx] [file ...]\n",
+	    "usage: %s [-1AaBbCcdFfghikLlMmnOoPpqRrSsTtUuWwXx] [file ...]\n",
 	    getprogname());
 	exit(EXIT_FAILURE);
 	/* NOTREACHED */
@@ -151,7 +156,7 @@ main(int argc, char *argv[])
 		f_listdot = 1;
 
 	fts_options = FTS_PHYSICAL;
-	while ((ch = getopt(argc, argv, "1AaBbCcdFfghikLlMmnOoPpqRrSsTtuWwXx"))
+	while ((ch = getopt(argc, argv, "1AaBbCcdFfghikLlMmnOoPpqRrSsTtUuWwXx"))
 	    != -1) {
 		switch (ch) {
 		/*
@@ -289,6 +294,10 @@ main(int argc, char *argv[])
 		case 't':
 			sortkey = BY_TIME;
 			break;
+		/* Like -f, but without -a. */
+		case 'U':
+			f_nosort = 1;
+			break;
 		case 'W':
 			f_whiteout = 1;
 			break;
@@ -355,39 +364,51 @@ main(int argc, char *argv[])
 		/* blocksize /= 512; */
 	/* } */
 
-	/* Select a sort function. */
+	/* Select a sort function and the matching sort key. */
 	if (f_reversesort) {
 		switch (sortkey) {
 		case BY_NAME:
 			sortfcn = revnamecmp;
+			keyfcn = revnamekey;
 			break;
 		case BY_SIZE:
 			sortfcn = revsizecmp;
+			keyfcn = revsizekey;
 			break;
 		case BY_TIME:
-			if (f_accesstime)
+			if (f_accesstime) {
 				sortfcn = revacccmp;
-			else if (f_statustime)
+				keyfcn = revacckey;
+			} else if (f_statustime) {
 				sortfcn = revstatcmp;
-			else /* Use modification time. */
+				keyfcn = revnamekey;	/* no ctime */
+			} else { /* Use modification time. */
 				sortfcn = revmodcmp;
+				keyfcn = revmodkey;
+			}
 			break;
 		}
 	} else {
 		switch (sortkey) {
 		case BY_NAME:
 			sortfcn = namecmp;
+			keyfcn = namekey;
 			break;
 		case BY_SIZE:
 			sortfcn = sizecmp;
+			keyfcn = sizekey;
 			break;
 		case BY_TIME:
-			if (f_accesstime)
+			if (f_accesstime) {
 				sortfcn = acccmp;
-			else if (f_statustime)
+				keyfcn = acckey;
+			} else if (f_statustime) {
 				sortfcn = statcmp;
-			else /* Use modification time. */
+				keyfcn = namekey;	/* no ctime */
+			} else { /* Use modification time. */
 				sortfcn = modcmp;
+				keyfcn = modkey;
+			}
 			break;
 		}
 	}
@@ -430,6 +451,8 @@ traverse(int argc, char *argv[], int options)
 	if ((ftsp =
 	    fts_open(argv, options, f_nosort ? NULL : mastercmp)) == NULL)
 		err(EXIT_FAILURE, NULL);
+	if (!f_nosort)
+		fts_set_sortkey(ftsp, masterkey);
 
 	display(NULL, fts_children(ftsp, 0));
 	if (f_listdir) {
@@ -472,6 +495,18 @@ traverse(int argc, char *argv[], int options)
 				}
 			}
 
+			/*
+			 * Unsorted listings are streamed straight from
+			 * readdir, instead of building the entire list
+			 * with fts_children first.
+			 */
+			if (f_nosort) {
+				streamdir(p, options);
+				if (!f_recursive)
+					(void)fts_set(ftsp, p, FTS_SKIP);
+				break;
+			}
+
 			chp = fts_children(ftsp, ch_options);
 			display(p, chp);
 
@@ -700,6 +735,74 @@ display(FTSENT *p, FTSENT *list)
 			free(cur->fts_pointer);
 }
 
+/*
+ * Streamdir() lists the directory p in readdir order, printing each
+ * entry as soon as it is read. Only one entry is held in memory at a
+ * time, so huge directories neither stall nor exhaust memory. With -R,
+ * fts still builds the child list of p to descend into it.
+ */
+static void
+streamdir(FTSENT *p, int options)
+{
+	struct {
+		FTSENT ent;
+		struct stat sb;
+		char name[MAXPATHLEN];
+	} e;
+	char path[MAXPATHLEN];
+	struct dirent *dp;
+	DIR *dirp;
+	size_t len;
+	int needstats;
+
+	if ((dirp = opendir(p->fts_accpath)) == NULL) {
+		warn("%s", p->fts_name);
+		rval = EXIT_FAILURE;
+		return;
+	}
+
+	needstats = f_longform || f_size || f_type || f_typedir;
+	memset(&e, 0, sizeof(e));
+	e.ent.fts_name = e.name;
+	e.ent.fts_accpath = path;
+	e.ent.fts_path = p->fts_path;
+	e.ent.fts_statp = &e.sb;
+	e.ent.fts_parent = p;
+	e.ent.fts_level = p->fts_level + 1;
+
+	while ((dp = readdir(dirp)) != NULL) {
+		/*
+		 * d_name is wide, and non-ASCII is shown as '?'.
+		 */
+		for (len = 0; dp->d_name[len] != 0 &&
+		    len < sizeof(e.name) - 1; len++)
+			e.name[len] = dp->d_name[len] < 0x80 ?
+			    (char)dp->d_name[len] : '?';
+		e.name[len] = '\0';
+		e.ent.fts_namelen = len;
+
+		if (!(options & FTS_SEEDOT) && ISDOT(e.name))
+			continue;
+		if (e.name[0] == '.' && !f_listdot)
+			continue;
+
+		if (needstats) {
+			(void)snprintf(path, sizeof(path), "%s/%s",
+			    p->fts_accpath, e.name);
+			if (stat(path, &e.sb)) {
+				warn("%s", e.name);
+				rval = EXIT_FAILURE;
+				continue;
+			}
+		}
+
+		printdirent(&e.ent);
+		output = 1;
+	}
+	printdirend();
+	(void)closedir(dirp);
+}
+
 /*
  * Ordering for mastercmp:
  * If ordering the argv (fts_level = FTS_ROOTLEVEL) return non-directories
@@ -736,3 +839,23 @@ mastercmp(const struct FTSENT * const *a, const struct FTSENT * const *b)
 	}
 	return (sortfcn(*a, *b));
 }
+
+/*
+ * Sort key for mastercmp: the classes mastercmp orders by come first,
+ * followed by the key for sortfcn. FTS_ERR entries compare equal to
+ * everything, so any key will do. FTS_NS entries are ordered by name,
+ * which mastercmp takes care of, as they all have the same key.
+ */
+static unsigned long long
+masterkey(const FTSENT *p)
+{
+
+	if (p->fts_info == FTS_ERR)
+		return (0);
+	if (p->fts_info == FTS_NS)
+		return (2ULL << KEY_BITS);
+	if (p->fts_info == FTS_D && !f_listdir &&
+	    p->fts_level == FTS_ROOTLEVEL)
+		return ((1ULL << KEY_BITS) | keyfcn(p));
+	return (keyfcn(p));
+}
@@ -39,15 +39,19 @@
 extern long blocksize;		/* block size units */
 
 extern int f_accesstime;	/* use time of last access */
+extern int f_column;		/* columnated format */
+extern int f_columnacross;	/* columnated format, sorted across */
 extern int f_flags;		/* show flags associated with a file */
 extern int f_grouponly;		/* long listing without owner */
 extern int f_humanize;		/* humanize size field */
 extern int f_commas;        /* separate size field with commas */
 /* extern int f_inode;		/\* print inode *\/ */
 extern int f_longform;		/* long listing format */
+extern int f_numericonly;	/* don't convert uid/gid to name */
 /* extern int f_octal;		/\* print octal escapes for nongraphic characters *\/ */
 /* extern int f_octal_escape;	/\* like f_octal but use C escapes if possible *\/ */
 extern int f_sectime;		/* print the real time for all files */
+extern int f_stream;		/* stream format */
 extern int f_size;		/* list size in short listing */
 extern int f_statustime;	/* use time of last mode change */
 extern int f_type;		/* add type character for non-regular files */
@@ -73,6 +73,7 @@ __RCSID("$NetBSD: print.c,v 1.51.2.2 2014/08/19 23:45:11 tls Exp $");
 extern int termwidth;
 
 static int	printaname(FTSENT *, int, int);
+static void	printlongent(DISPLAY *, FTSENT *);
 /* static void	printlink(FTSENT *); */
 static void	printtime(time_t);
 static void	printtotal(DISPLAY *dp);
@@ -131,10 +132,7 @@ printscol(DISPLAY *dp)
 void
 printlong(DISPLAY *dp)
 {
-	struct stat *sp;
 	FTSENT *p;
-	NAMES *np;
-	char buf[20], szbuf[5];
 
 	now = time(NULL);
 
@@ -144,71 +142,81 @@ printlong(DISPLAY *dp)
 	for (p = dp->list; p; p = p->fts_link) {
 		if (IS_NOPRINT(p))
 			continue;
-		sp = p->fts_statp;
-		/* if (f_inode) */
-		/* 	(void)printf("%*"PRIu64" ", dp->s_inode, sp->st_ino); */
-		if (f_size) {
-			if (f_humanize) {
-				if ((humanize_number(szbuf, sizeof(szbuf),
-				    sp->st_physsize,
-				    "", HN_AUTOSCALE,
-				    (HN_DECIMAL | HN_B | HN_NOSPACE))) == -1)
-					err(1, "humanize_number");
-				(void)printf("%*s ", dp->s_block, szbuf);
-			} else {
-                                int blocks = howmany(sp->st_physsize, S_BLKSIZE);
-
-				(void)printf(f_commas ? "%'*llu " : "%*llu ",
-				    dp->s_block,
-                                    (unsigned long long)howmany(blocks,
-				    blocksize));
-			}
+		printlongent(dp, p);
+	}
+}
+
+static void
+printlongent(DISPLAY *dp, FTSENT *p)
+{
+	struct stat *sp;
+	NAMES *np;
+	char buf[20], szbuf[5];
+
+	sp = p->fts_statp;
+	/* if (f_inode) */
+	/* 	(void)printf("%*"PRIu64" ", dp->s_inode, sp->st_ino); */
+	if (f_size) {
+		if (f_humanize) {
+			if ((humanize_number(szbuf, sizeof(szbuf),
+			    sp->st_physsize,
+			    "", HN_AUTOSCALE,
+			    (HN_DECIMAL | HN_B | HN_NOSPACE))) == -1)
+				err(1, "humanize_number");
+			(void)printf("%*s ", dp->s_block, szbuf);
+		} else {
+                        int blocks = howmany(sp->st_physsize, S_BLKSIZE);
+
+			(void)printf(f_commas ? "%'*llu " : "%*llu ",
+			    dp->s_block,
+                            (unsigned long long)howmany(blocks,
+			    blocksize));
 		}
-		(void)strmode(sp->st_mode, buf);
-		np = p->fts_pointer;
-		(void)printf("%s %*lu ", buf, dp->s_nlink,
-                             (unsigned long) /* sp->st_nlink */ 1);
-		if (!f_grouponly)
-			(void)printf("%-*s  ", dp->s_user, np->user);
-		(void)printf("%-*s  ", dp->s_group, np->group);
-		/* if (f_flags) */
-		/* 	(void)printf("%-*s ", dp->s_flags, np->flags); */
-		if (S_ISCHR(sp->st_mode) || S_ISBLK(sp->st_mode))
-			(void)printf("%*lld, %*lld ",
-			    dp->s_major, (long long) 0 /* major(sp->st_rdev) */,
-			    dp->s_minor, (long long) 0 /* minor(sp->st_rdev) */);
-		else {
-			if (f_humanize) {
-				if ((humanize_number(szbuf, sizeof(szbuf),
-				    sp->st_size, "", HN_AUTOSCALE,
-				    (HN_DECIMAL | HN_B | HN_NOSPACE))) == -1)
-					err(1, "humanize_number");
-				(void)printf("%*s ", dp->s_size, szbuf);
-			} else {
-				(void)printf(f_commas ? "%'*llu " : "%*llu ", 
-				    dp->s_size, (unsigned long long)
-				    sp->st_size);
-			}
-                }
-		if (f_accesstime)
-			printtime(sp->st_atime);
-		/* else if (f_statustime) */
-		/* 	printtime(sp->st_ctime); */
-		else
-			printtime(sp->st_mtime);
-		/* if (f_octal || f_octal_escape) */
-		/* 	(void)safe_printpath(p); */
-		/* else if (f_nonprint) */
-		/* 	(void)printescapedpath(p); */
-		/* else */
-			(void)printpath(p);
-
-		if (f_type || (f_typedir && S_ISDIR(sp->st_mode)))
-			(void)printtype(sp->st_mode);
-		/* if (S_ISLNK(sp->st_mode)) */
-		/* 	printlink(p); */
-		(void)putchar('\n');
 	}
+	(void)strmode(sp->st_mode, buf);
+	np = p->fts_pointer;
+	(void)printf("%s %*lu ", buf, dp->s_nlink,
+                     (unsigned long) /* sp->st_nlink */ 1);
+	if (!f_grouponly)
+		(void)printf("%-*s  ", dp->s_user, np->user);
+	(void)printf("%-*s  ", dp->s_group, np->group);
+	/* if (f_flags) */
+	/* 	(void)printf("%-*s ", dp->s_flags, np->flags); */
+	if (S_ISCHR(sp->st_mode) || S_ISBLK(sp->st_mode))
+		(void)printf("%*lld, %*lld ",
+		    dp->s_major, (long long) 0 /* major(sp->st_rdev) */,
+		    dp->s_minor, (long long) 0 /* minor(sp->st_rdev) */);
+	else {
+		if (f_humanize) {
+			if ((humanize_number(szbuf, sizeof(szbuf),
+			    sp->st_size, "", HN_AUTOSCALE,
+			    (HN_DECIMAL | HN_B | HN_NOSPACE))) == -1)
+				err(1, "humanize_number");
+			(void)printf("%*s ", dp->s_size, szbuf);
+		} else {
+			(void)printf(f_commas ? "%'*llu " : "%*llu ", 
+			    dp->s_size, (unsigned long long)
+			    sp->st_size);
+		}
+        }
+	if (f_accesstime)
+		printtime(sp->st_atime);
+	/* else if (f_statustime) */
+	/* 	printtime(sp->st_ctime); */
+	else
+		printtime(sp->st_mtime);
+	/* if (f_octal || f_octal_escape) */
+	/* 	(void)safe_printpath(p); */
+	/* else if (f_nonprint) */
+	/* 	(void)printescapedpath(p); */
+	/* else */
+		(void)printpath(p);
+
+	if (f_type || (f_typedir && S_ISDIR(sp->st_mode)))
+		(void)printtype(sp->st_mode);
+	/* if (S_ISLNK(sp->st_mode)) */
+	/* 	printlink(p); */
+	(void)putchar('\n');
 }
 
 void
@@ -363,6 +371,102 @@ printstream(DISPLAY *dp)
 	(void)putchar('\n');
 }
 
+/*
+ * Streaming (-f, -U) output. Entries are printed one at a time, as
+ * readdir returns them, so there is no pass over the directory to
+ * compute field widths, and no "total" line. Fixed widths are used
+ * instead, wide enough for anything FAT can hold. Columnated output
+ * is always across, with long names taking up several columns.
+ */
+#define	STREAM_BLOCK	8
+#define	STREAM_SIZE	10
+#define	STREAM_NAME	15
+
+static DISPLAY	sdisp;
+static NAMES	snames;
+static int	scol;
+
+static void
+printstreaminit(void)
+{
+	static char none[] = "none", zero[] = "0";
+
+	sdisp.s_block = f_humanize ? 4 : STREAM_BLOCK;
+	sdisp.s_size = f_humanize ? 4 : STREAM_SIZE;
+	if (f_commas) {
+		sdisp.s_block += (sdisp.s_block - 1) / 3;
+		sdisp.s_size += (sdisp.s_size - 1) / 3;
+	}
+	sdisp.s_nlink = 1;
+	snames.user = snames.group = f_numericonly ? zero : none;
+	sdisp.s_user = sdisp.s_group = strlen(snames.user);
+	sdisp.s_major = sdisp.s_minor = 1;
+	sdisp.maxlen = STREAM_NAME;
+	now = time(NULL);
+}
+
+void
+printdirent(FTSENT *p)
+{
+	int chcnt, colwidth, extwidth;
+
+	if (sdisp.maxlen == 0)
+		printstreaminit();
+
+	extwidth = 0;
+	if (f_size)
+		extwidth += (f_humanize ? sdisp.s_size : sdisp.s_block) + 1;
+	if (f_type || f_typedir)
+		extwidth += 1;
+
+	if (f_longform) {
+		p->fts_pointer = &snames;
+		printlongent(&sdisp, p);
+		p->fts_pointer = NULL;
+	} else if (f_stream) {
+		if (scol > 0) {
+			(void)putchar(','), scol++;
+			if (scol + 1 + extwidth + (int)p->fts_namelen >=
+			    termwidth)
+				(void)putchar('\n'), scol = 0;
+			else
+				(void)putchar(' '), scol++;
+		}
+		scol += printaname(p, sdisp.s_inode,
+		    f_humanize ? sdisp.s_size : sdisp.s_block);
+	} else if (f_column || f_columnacross) {
+		colwidth = sdisp.maxlen + extwidth + 1;
+		if (scol > 0 &&
+		    scol + extwidth + (int)p->fts_namelen >= termwidth)
+			(void)putchar('\n'), scol = 0;
+		chcnt = printaname(p, sdisp.s_inode,
+		    f_humanize ? sdisp.s_size : sdisp.s_block);
+		scol += chcnt;
+		/*
+		 * Pad to the next column, with at least one blank even when
+		 * a long name (maxlen is capped) ends right on a boundary.
+		 */
+		do
+			(void)putchar(' '), scol++;
+		while (++chcnt % colwidth && scol < termwidth);
+	} else {
+		(void)printaname(p, sdisp.s_inode,
+		    f_humanize ? sdisp.s_size : sdisp.s_block);
+		(void)putchar('\n');
+	}
+}
+
+/*
+ * Terminate the last line of streaming output, if necessary.
+ */
+void
+printdirend(void)
+{
+	if (scol > 0)
+		(void)putchar('\n');
+	scol = 0;
+}
+
 /*
  * print [inode] [size] name
  * return # of characters printed, no trailing characters.
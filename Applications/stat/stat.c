@@ -55,6 +55,7 @@ __RCSID("$NetBSD: stat.c,v 1.38 2013/01/03 13:28:41 dsl Exp $");
 #include <ctype.h>
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
 /* #include <grp.h> */
 #include <limits.h>
 /* #include <pwd.h> */
@@ -188,8 +189,8 @@ __RCSID("$NetBSD: stat.c,v 1.38 2013/01/03 13:28:41 dsl Exp $");
 #define LOW_PIECE	'L'
 
 #define	SHOW_realpath	'R'
-/* #define SHOW_st_dev	'd' */
-/* #define SHOW_st_ino	'i' */
+#define SHOW_st_dev	'd'
+#define SHOW_st_ino	'i'
 #define SHOW_st_mode	'p'
 /* #define SHOW_st_nlink	'l' */
 /* #define SHOW_st_uid	'u' */
@@ -209,9 +210,25 @@ __RCSID("$NetBSD: stat.c,v 1.38 2013/01/03 13:28:41 dsl Exp $");
 #define SHOW_filename	'N'
 /* #define SHOW_sizerdev	'Z' */
 
+/*
+ * A format string is parsed once into a list of these.
+ */
+struct fmtop {
+	int		kind;
+#define	OP_END		0
+#define	OP_LITERAL	1	/* sub, len: text to copy */
+#define	OP_NUMBER	2	/* %@ */
+#define	OP_FIELD	3	/* sub, len: whole %... spec */
+	const char	*sub;
+	int		len;
+	int		flags, size, prec, ofmt, hilo, what;
+};
+
 static void	usage(const char *) __dead;
+static struct fmtop *compile(const char *);
 static void	output(const struct stat *, const char *,
-	    const char *, int, int, int);
+	    const struct fmtop *, int, int, int);
+static int	batch(const struct fmtop *, int, int, int);
 static int	format1(const struct stat *,	/* stat info */
 	    const char *,		/* the file name */
 	    const char *, int,		/* the format string itself */
@@ -222,16 +239,11 @@ static int	format1(const struct stat *,	/* stat info */
 static const char *timefmt;
 static int linkfail;
 
-#define addchar(s, c, nl) \
-	do { \
-		(void)fputc((c), (s)); \
-		(*nl) = ((c) == '\n'); \
-	} while (0/*CONSTCOND*/)
-
 int
 main(int argc, char *argv[])
 {
 	struct stat st;
+	struct fmtop *ops;
 	int ch, rc, errs, am_readlink;
 	int lsF, fmtchar, usestat, fn, nonl, quiet;
 	const char *statfmt, *options, *synopsis;
@@ -353,6 +365,14 @@ main(int argc, char *argv[])
 	if (timefmt == NULL)
 		timefmt = TIME_FORMAT;
 
+	ops = compile(statfmt);
+
+	/*
+	 * A lone "-" reads the paths to stat from stdin, one per line.
+	 */
+	if (argc == 1 && strcmp(argv[0], "-") == 0)
+		return (batch(ops, usestat, nonl, quiet));
+
 	errs = 0;
 	do {
 		if (argc == 0)
@@ -379,8 +399,10 @@ main(int argc, char *argv[])
 				    argc == 0 ? "(stdin)" : argv[0],
 				    usestat ? "stat" : "lstat");
 		}
-		else
-			output(&st, argv[0], statfmt, fn, nonl, quiet);
+		else {
+			output(&st, argv[0], ops, fn, nonl, quiet);
+			(void)fflush(stdout);
+		}
 
 		argv++;
 		argc--;
@@ -398,32 +420,114 @@ usage(const char *synopsis)
 	exit(1);
 }
 
+/*
+ * Stats the paths read from stdin. Files are looked up relative to
+ * their parent directory, which is kept open for as long as
+ * consecutive paths share it, so a sorted list of paths is cheap
+ * (see fstatat in LibUefi).
+ */
+static int
+batch(const struct fmtop *ops, int usestat, int nonl, int quiet)
+{
+	struct stat st;
+	char *line, *dir, *name, *sep;
+	size_t linesz, dirlen;
+	ssize_t len;
+	int dfd, errs, fn, rc;
+
+	line = dir = NULL;
+	linesz = 0;
+	dirlen = 0;
+	dfd = -1;
+	errs = 0;
+	fn = 1;
+
+	while ((len = getline(&line, &linesz, stdin)) != -1) {
+		while (len > 0 &&
+		    (line[len - 1] == '\n' || line[len - 1] == '\r'))
+			line[--len] = '\0';
+		if (len == 0)
+			continue;
+
+		/*
+		 * Split into parent directory and name. "fs0:" and
+		 * "/" are kept as-is, other trailing separators go.
+		 */
+		for (sep = NULL, name = line; *name != '\0'; name++)
+			if (*name == '/' || *name == '\\' || *name == ':')
+				sep = name;
+		if (sep == NULL || sep[1] == '\0') {
+			name = NULL;
+		} else {
+			name = sep + 1;
+			len = sep - line;
+			if (*sep == ':' || len == 0)
+				len++;
+
+			if (dir == NULL || (size_t)len != dirlen ||
+			    strncmp(dir, line, len) != 0) {
+				if (dfd != -1)
+					(void)close(dfd);
+				free(dir);
+				if ((dir = malloc(len + 1)) == NULL)
+					err(1, NULL);
+				memcpy(dir, line, len);
+				dir[len] = '\0';
+				dirlen = len;
+				dfd = open(dir, O_RDONLY, 0);
+			}
+		}
+
+		if (name != NULL && dfd != -1)
+			rc = fstatat(dfd, name, &st, 0);
+		else
+			rc = stat(line, &st);
+
+		if (rc == -1) {
+			errs = 1;
+			if (!quiet)
+				warn("%s: %s", line,
+				    usestat ? "stat" : "lstat");
+		} else
+			output(&st, line, ops, fn, nonl, quiet);
+		fn++;
+	}
+
+	if (dfd != -1)
+		(void)close(dfd);
+	free(dir);
+	free(line);
+	(void)fflush(stdout);
+	return (errs);
+}
+
 /*
  * Parses a format string.
  */
-static void
-output(const struct stat *st, const char *file,
-    const char *statfmt, int fn, int nonl, int quiet)
+static struct fmtop *
+compile(const char *statfmt)
 {
+	struct fmtop *ops, *op;
 	int flags, size, prec, ofmt, hilo, what;
-	/*
-	 * buf size is enough for an item of length PATH_MAX,
-	 * multiplied by 4 for vis encoding, plus 4 for symlink
-	 * " -> " prefix, plus 1 for \0 terminator.
-	 */
-	char buf[PATH_MAX * 4 + 4 + 1];
 	const char *subfmt;
-	int nl, t, i;
 
-	nl = 1;
+	/* Every op consumes at least one character. */
+	if ((ops = calloc(strlen(statfmt) + 1, sizeof(*ops))) == NULL)
+		err(1, NULL);
+
+	op = ops;
 	while (*statfmt != '\0') {
 
 		/*
 		 * Non-format characters go straight out.
 		 */
 		if (*statfmt != FMT_MAGIC) {
-			addchar(stdout, *statfmt, &nl);
-			statfmt++;
+			op->kind = OP_LITERAL;
+			op->sub = statfmt;
+			while (*statfmt != '\0' && *statfmt != FMT_MAGIC)
+				statfmt++;
+			op->len = statfmt - op->sub;
+			op++;
 			continue;
 		}
 
@@ -439,27 +543,32 @@ output(const struct stat *st, const char *file,
 		 */
 		switch (*statfmt) {
 		case SIMPLE_NEWLINE:
-			addchar(stdout, '\n', &nl);
+			op->kind = OP_LITERAL;
+			op->sub = "\n";
+			op->len = 1;
+			op++;
 			statfmt++;
 			continue;
 		case SIMPLE_TAB:
-			addchar(stdout, '\t', &nl);
+			op->kind = OP_LITERAL;
+			op->sub = "\t";
+			op->len = 1;
+			op++;
 			statfmt++;
 			continue;
 		case SIMPLE_PERCENT:
-			addchar(stdout, '%', &nl);
+			op->kind = OP_LITERAL;
+			op->sub = "%";
+			op->len = 1;
+			op++;
 			statfmt++;
 			continue;
-		case SIMPLE_NUMBER: {
-			char num[12], *p;
-
-			snprintf(num, sizeof(num), "%d", fn);
-			for (p = &num[0]; *p; p++)
-				addchar(stdout, *p, &nl);
+		case SIMPLE_NUMBER:
+			op->kind = OP_NUMBER;
+			op++;
 			statfmt++;
 			continue;
 		}
-		}
 
 		/*
 		 * This must be an actual format string.  Format strings are
@@ -550,8 +659,8 @@ output(const struct stat *st, const char *file,
 
 		switch (*statfmt) {
 			fmtcase(what, SHOW_realpath);
-			/* fmtcase(what, SHOW_st_dev); */
-			/* fmtcase(what, SHOW_st_ino); */
+			fmtcase(what, SHOW_st_dev);
+			fmtcase(what, SHOW_st_ino);
 			fmtcase(what, SHOW_st_mode);
 			/* fmtcase(what, SHOW_st_nlink); */
 			/* fmtcase(what, SHOW_st_uid); */
@@ -576,15 +685,16 @@ output(const struct stat *st, const char *file,
 #undef fmtcasef
 #undef fmtcase
 
-		t = format1(st,
-		     file,
-		     subfmt, statfmt - subfmt,
-		     buf, sizeof(buf),
-		     flags, size, prec, ofmt, hilo, what, quiet);
-
-		for (i = 0; i < t && i < (int)(sizeof(buf) - 1); i++)
-			addchar(stdout, buf[i], &nl);
-
+		op->kind = OP_FIELD;
+		op->sub = subfmt;
+		op->len = statfmt - subfmt;
+		op->flags = flags;
+		op->size = size;
+		op->prec = prec;
+		op->ofmt = ofmt;
+		op->hilo = hilo;
+		op->what = what;
+		op++;
 		continue;
 
 	badfmt:
@@ -592,9 +702,55 @@ output(const struct stat *st, const char *file,
 		    (int)(statfmt - subfmt + 1), subfmt);
 	}
 
+	op->kind = OP_END;
+	return (ops);
+}
+
+/*
+ * Runs a compiled format.
+ */
+static void
+output(const struct stat *st, const char *file,
+    const struct fmtop *op, int fn, int nonl, int quiet)
+{
+	/*
+	 * buf size is enough for an item of length PATH_MAX,
+	 * multiplied by 4 for vis encoding, plus 4 for symlink
+	 * " -> " prefix, plus 1 for \0 terminator.
+	 */
+	char buf[PATH_MAX * 4 + 4 + 1];
+	int nl, t;
+
+	nl = 1;
+	for (; op->kind != OP_END; op++) {
+		switch (op->kind) {
+		case OP_LITERAL:
+			(void)fwrite(op->sub, 1, op->len, stdout);
+			nl = op->sub[op->len - 1] == '\n';
+			continue;
+		case OP_NUMBER:
+			t = snprintf(buf, sizeof(buf), "%d", fn);
+			break;
+		default:
+			t = format1(st,
+			     file,
+			     op->sub, op->len,
+			     buf, sizeof(buf),
+			     op->flags, op->size, op->prec, op->ofmt,
+			     op->hilo, op->what, quiet);
+			break;
+		}
+
+		if (t > (int)(sizeof(buf) - 1))
+			t = sizeof(buf) - 1;
+		if (t > 0) {
+			(void)fwrite(buf, 1, t, stdout);
+			nl = buf[t - 1] == '\n';
+		}
+	}
+
 	if (!nl && !nonl)
 		(void)fputc('\n', stdout);
-	(void)fflush(stdout);
 }
 
 /*
@@ -637,45 +793,26 @@ format1(const struct stat *st,
 	 * specified output format (symlink output only).
 	 */
 	switch (what) {
-/* 	case SHOW_st_dev: */
-/* 	case SHOW_st_rdev: */
-/* 		small = (sizeof(st->st_dev) == 4); */
-/* 		data = (what == SHOW_st_dev) ? st->st_dev : st->st_rdev; */
-/* #if HAVE_DEVNAME */
-/* 		sdata = (what == SHOW_st_dev) ? */
-/* 		    devname(st->st_dev, S_IFBLK) : */
-/* 		    devname(st->st_rdev,  */
-/* 			S_ISCHR(st->st_mode) ? S_IFCHR : */
-/* 			S_ISBLK(st->st_mode) ? S_IFBLK : */
-/* 			0U); */
-/* 		if (sdata == NULL) */
-/* 			sdata = "???"; */
-/* #endif /\* HAVE_DEVNAME *\/ */
-/* 		if (hilo == HIGH_PIECE) { */
-/* 			data = major(data); */
-/* 			hilo = 0; */
-/* 		} */
-/* 		else if (hilo == LOW_PIECE) { */
-/* 			data = minor((unsigned)data); */
-/* 			hilo = 0; */
-/* 		} */
-/* 		formats = FMTF_DECIMAL | FMTF_OCTAL | FMTF_UNSIGNED | FMTF_HEX | */
-/* #if HAVE_DEVNAME */
-/* 		    FMTF_STRING; */
-/* #else /\* HAVE_DEVNAME *\/ */
-/* 		    0; */
-/* #endif /\* HAVE_DEVNAME *\/ */
-/* 		if (ofmt == 0) */
-/* 			ofmt = FMTF_UNSIGNED; */
-/* 		break; */
-/* 	case SHOW_st_ino: */
-/* 		small = (sizeof(st->st_ino) == 4); */
-/* 		data = st->st_ino; */
-/* 		sdata = NULL; */
-/* 		formats = FMTF_DECIMAL | FMTF_OCTAL | FMTF_UNSIGNED | FMTF_HEX; */
-/* 		if (ofmt == 0) */
-/* 			ofmt = FMTF_UNSIGNED; */
-/* 		break; */
+	/*
+	 * No devname(), major() or minor() here: st_dev is a hash of the
+	 * file system device path, see LibUefi stat().
+	 */
+	case SHOW_st_dev:
+		small = (sizeof(st->st_dev) == 4);
+		data = st->st_dev;
+		sdata = NULL;
+		formats = FMTF_DECIMAL | FMTF_OCTAL | FMTF_UNSIGNED | FMTF_HEX;
+		if (ofmt == 0)
+			ofmt = FMTF_UNSIGNED;
+		break;
+	case SHOW_st_ino:
+		small = (sizeof(st->st_ino) == 4);
+		data = st->st_ino;
+		sdata = NULL;
+		formats = FMTF_DECIMAL | FMTF_OCTAL | FMTF_UNSIGNED | FMTF_HEX;
+		if (ofmt == 0)
+			ofmt = FMTF_UNSIGNED;
+		break;
 	case SHOW_st_mode:
 		small = (sizeof(st->st_mode) == 4);
 		data = st->st_mode;
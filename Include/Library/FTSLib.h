@@ -66,7 +66,7 @@ typedef struct {
 } FTS;
 
 typedef struct FTSENT {
-  /* struct FTSENT *fts_cycle;      /\* cycle node *\/ */
+  struct FTSENT *fts_cycle;      /* cycle node (NULL if not an ancestor) */
   struct FTSENT *fts_parent;     /* parent directory */
   struct FTSENT *fts_link;       /* next file in directory */
   long long fts_number;           /* local numeric value */
@@ -80,10 +80,10 @@ typedef struct FTSENT {
   size_t fts_namelen;             /* strlen(fts_name) */
 
   /*
-   * UEFI has no concept of these.
+   * Synthesized by stat(), see LibUefi. UEFI has no link counts.
    */
-  /* ino_t fts_ino;                  /\* inode *\/ */
-  /* dev_t fts_dev;                  /\* device *\/ */
+  ino_t fts_ino;                  /* inode */
+  dev_t fts_dev;                  /* device */
   /* nlink_t fts_nlink;              /\* link count *\/ */
 
 #define FTS_ROOTPARENTLEVEL     -1
@@ -136,6 +136,7 @@ FTS     *fts_open(char * const *, int,
 FTSENT  *fts_read(FTS *);
 int      fts_set(FTS *, FTSENT *, int);
 void     fts_set_clientptr(FTS *, void *);
+void     fts_set_sortkey(FTS *, unsigned long long (*)(const FTSENT *));
 __END_DECLS
 
 #endif /* !_FTS_LIB_H_ */
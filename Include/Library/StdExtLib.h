@@ -71,11 +71,13 @@
 #ifndef _STD_EXT_LIB_H_
 #define _STD_EXT_LIB_H_
 
+#include <stddef.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <inttypes.h>
 #include <string.h>
 #include <stdio.h>
+#include <sys/ioccom.h>
 
 /*
  * StdLib/Include/sys/stat.h defines this incorrectly. Sigh.
@@ -148,6 +150,17 @@ getdelim(char **buf, size_t *bufsiz, int delimiter, FILE *fp);
 ssize_t
 getline(char **buf, size_t *bufsiz, FILE *fp);
 
+/*
+ * Zero-copy getdelim/getline: the line (not NUL-terminated) is
+ * returned in place in the stdio buffer where possible, and is valid
+ * until the next I/O on fp or the next call.
+ */
+char *
+fgetdelim(FILE *fp, size_t *lenp, int delimiter);
+
+char *
+fgetline(FILE *fp, size_t *lenp);
+
 #define FNM_NOMATCH 1 /* Match failed. */
 #define FNM_NOSYS   2 /* Function not implemented. */
 #define FNM_NORES   3 /* Out of resources */
@@ -160,4 +173,65 @@ getline(char **buf, size_t *bufsiz, FILE *fp);
 
 int fnmatch(const char *, const char *, int);
 
+/*
+ * A pattern compiled once for matching many strings, with the
+ * same result as fnmatch() in time linear in the string.
+ */
+typedef struct fnmatch_prog fnmatch_t;
+
+fnmatch_t *fnmatch_compile(const char *, int);
+int fnmatch_exec(const fnmatch_t *, const char *);
+void fnmatch_free(fnmatch_t *);
+
+/*
+ * UCS-2 <-> Latin-1, '?' for anything that doesn't fit a byte.
+ * buffer_widen may be done in place (src == dest).
+ */
+void buffer_narrow(const wchar_t *src, char *dest, size_t count);
+void buffer_widen(const char *src, wchar_t *dest, size_t count);
+
+/*
+ * Implemented by LibUefi.
+ */
+#ifndef AT_FDCWD
+#define AT_FDCWD -100
+#endif
+
+int fstatat(int fd, const char *path, struct stat *buf, int flag);
+
+struct iovec;
+
+ssize_t pread(int fd, void *buf, size_t nbyte, off_t offset);
+ssize_t pwrite(int fd, const void *buf, size_t nbyte, off_t offset);
+ssize_t preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+
+/*
+ * mmap is emulated by reading the file into memory, see
+ * Library/StdLibUefi/SysCalls.c.
+ */
+#ifndef MAP_FAILED
+#define PROT_NONE   0x00
+#define PROT_READ   0x01
+#define PROT_WRITE  0x02
+
+#define MAP_SHARED  0x0001
+#define MAP_PRIVATE 0x0002
+
+#define MAP_FAILED  ((void *) -1)
+#endif
+
+void *mmap(void *addr, size_t len, int prot, int flags, int fd, off_t offset);
+int munmap(void *addr, size_t len);
+
+/*
+ * Console (daConsole) ioctl, returns 1 if the stream is the actual
+ * console and 0 if the Shell redirected it to a file or a pipe.
+ */
+#define CONIOCISCON _IO('c', 1)
+
+/*
+ * Returns -1 with ENOSYS unless LibUefi is built with STDLIB_TRACE.
+ */
+int trace_dump(const char *path);
+
 #endif /* _STD_EXT_LIB_H_ */
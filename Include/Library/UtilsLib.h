@@ -14,6 +14,7 @@
 #define _UTILS_LIB_H_
 
 #include <Uefi.h>
+#include <Protocol/SimpleFileSystem.h>
 
 typedef struct GET_OPT_CONTEXT {
   CHAR16 Opt;
@@ -42,6 +43,107 @@ FileSystemSave (
                 IN UINTN TableSize
                 );
 
+#define FILE_SAVE_CHUNK_SIZE SIZE_1MB
+
+typedef struct FILE_SAVE_SESSION {
+  CHAR16 *VolSubDir;
+  EFI_FILE_PROTOCOL *Fs;
+  EFI_FILE_PROTOCOL *Dir;
+  UINTN ChunkSize;
+  BOOLEAN Async;
+  //
+  // The file being saved.
+  //
+  EFI_FILE_PROTOCOL *File;
+  EFI_STATUS FileStatus;
+  CHAR16 Path[64];
+  UINT64 Size;
+  BOOLEAN Pending;
+  UINTN PendingSize;
+  EFI_FILE_IO_TOKEN Token;
+} FILE_SAVE_SESSION;
+
+EFI_STATUS
+FileSaveSessionOpen (
+                     IN EFI_HANDLE Handle,
+                     IN CHAR16 *VolSubDir,
+                     IN BOOLEAN Async,
+                     OUT FILE_SAVE_SESSION *Session
+                     );
+
+EFI_STATUS
+FileSaveSessionBegin (
+                      IN OUT FILE_SAVE_SESSION *Session,
+                      IN CHAR16 *Path
+                      );
+
+EFI_STATUS
+FileSaveSessionAppend (
+                       IN OUT FILE_SAVE_SESSION *Session,
+                       IN VOID *Buffer,
+                       IN UINTN Size
+                       );
+
+EFI_STATUS
+FileSaveSessionEnd (
+                    IN OUT FILE_SAVE_SESSION *Session
+                    );
+
+EFI_STATUS
+FileSaveSessionSave (
+                     IN OUT FILE_SAVE_SESSION *Session,
+                     IN CHAR16 *Path,
+                     IN VOID *Buffer,
+                     IN UINTN Size
+                     );
+
+EFI_STATUS
+FileSaveSessionClose (
+                      IN OUT FILE_SAVE_SESSION *Session
+                      );
+
+#define BUNDLE_NAME_MAX 64
+
+typedef struct BUNDLE_ENTRY {
+  CHAR8 Name[BUNDLE_NAME_MAX];
+  UINT64 Offset;
+  UINT64 Size;
+} BUNDLE_ENTRY;
+
+//
+// Saves many files as one cpio (newc) archive, with a TOC member
+// at the end, written as one stream through a file save session.
+//
+typedef struct BUNDLE_WRITER {
+  FILE_SAVE_SESSION *Session;
+  UINT64 Offset;
+  UINTN Members;
+  UINTN Count;
+  UINTN Entries;
+  BUNDLE_ENTRY *Toc;
+  CHAR8 Header[2][128 + BUNDLE_NAME_MAX];
+} BUNDLE_WRITER;
+
+EFI_STATUS
+BundleOpen (
+            IN OUT FILE_SAVE_SESSION *Session,
+            IN CHAR16 *Path,
+            OUT BUNDLE_WRITER *Bundle
+            );
+
+EFI_STATUS
+BundleAdd (
+           IN OUT BUNDLE_WRITER *Bundle,
+           IN CHAR16 *Name,
+           IN VOID *Buffer,
+           IN UINTN Size
+           );
+
+EFI_STATUS
+BundleClose (
+             IN OUT BUNDLE_WRITER *Bundle
+             );
+
 VOID *
 GetTable (
           IN EFI_GUID *Guid
@@ -57,15 +159,79 @@ StriCmp (
          IN CONST CHAR16 *SecondString
          );
 
-typedef struct RANGE_CHECK_CONTEXT {
-  BOOLEAN Enabled;
-  BOOLEAN WarnIfNotFound;
+//
+// A sorted copy of the memory map, shared by all users in the
+// image and only fetched again when the MapKey changes. Generation
+// changes every time the contents do.
+//
+typedef struct MEMORY_MAP_SNAPSHOT {
+  BOOLEAN Valid;
+  UINTN Generation;
+  UINTN MapKey;
   UINTN MapSize;
   UINTN MapPages;
   UINTN DescriptorSize;
+  UINT32 DescriptorVersion;
   EFI_MEMORY_DESCRIPTOR *Map;
+  UINTN ScratchPages;
+  EFI_MEMORY_DESCRIPTOR *Scratch;
+} MEMORY_MAP_SNAPSHOT;
+
+EFI_STATUS
+GetMemoryMapSnapshot (
+                      OUT MEMORY_MAP_SNAPSHOT **Snapshot
+                      );
+
+VOID
+PutMemoryMapSnapshot (
+                      IN MEMORY_MAP_SNAPSHOT *Snapshot
+                      );
+
+EFI_STATUS
+RevalidateMemoryMapSnapshot (
+                             IN OUT MEMORY_MAP_SNAPSHOT *Snapshot
+                             );
+
+VOID
+SnapshotAddRange (
+                  IN OUT MEMORY_MAP_SNAPSHOT *Snapshot,
+                  IN EFI_PHYSICAL_ADDRESS Start,
+                  IN UINTN Pages,
+                  IN EFI_MEMORY_TYPE MemoryType,
+                  IN UINT64 Attribute
+                  );
+
+EFI_STATUS
+SnapshotAllocatePages (
+                       IN OUT MEMORY_MAP_SNAPSHOT *Snapshot,
+                       IN EFI_ALLOCATE_TYPE Type,
+                       IN EFI_MEMORY_TYPE MemoryType,
+                       IN UINTN Pages,
+                       IN OUT EFI_PHYSICAL_ADDRESS *Memory
+                       );
+
+typedef struct RANGE_CHECK_CONTEXT {
+  BOOLEAN Enabled;
+  BOOLEAN WarnIfNotFound;
+  MEMORY_MAP_SNAPSHOT *Snapshot;
+  //
+  // The map coalesced into sorted, disjoint [Start, Last]
+  // intervals, for binary search, as of snapshot Generation.
+  //
+  UINTN Generation;
+  UINTN IntervalEntries;
+  UINTN IntervalCount;
+  UINTN IntervalHint;
+  EFI_PHYSICAL_ADDRESS *IntervalStart;
+  EFI_PHYSICAL_ADDRESS *IntervalLast;
 } RANGE_CHECK_CONTEXT;
 
+typedef struct RANGE_CHECK_RANGE {
+  UINTN Start;
+  UINTN Length;
+  EFI_STATUS Status;
+} RANGE_CHECK_RANGE;
+
 EFI_STATUS
 InitRangeCheckContext (
                        IN BOOLEAN Enabled,
@@ -85,6 +251,60 @@ RangeIsMapped (
                IN UINTN RangeLength
                );
 
+EFI_STATUS
+RangesAreMapped (
+                 IN OUT RANGE_CHECK_CONTEXT *Context,
+                 IN OUT RANGE_CHECK_RANGE *Ranges,
+                 IN UINTN Count
+                 );
+
+UINT8
+AcpiChecksum (
+              IN CONST VOID *Buffer,
+              IN UINTN Size
+              );
+
+#define ACPI_TABLE_UNMAPPED     BIT0
+#define ACPI_TABLE_BAD_LENGTH   BIT1
+#define ACPI_TABLE_BAD_CHECKSUM BIT2
+
+typedef struct ACPI_TABLE_CHECK {
+  UINTN Address;
+  UINT32 Signature;
+  UINT32 Length;
+  UINTN Problems;
+} ACPI_TABLE_CHECK;
+
+//
+// The result of validating all tables reachable from the RSDP.
+// Tables[0] is the RSDP, Tables[1] the XSDT or RSDT.
+//
+typedef struct ACPI_VALIDATION {
+  UINTN Count;
+  UINTN Bad;
+  UINT64 Bytes;
+  UINTN Entries;
+  ACPI_TABLE_CHECK *Tables;
+} ACPI_VALIDATION;
+
+EFI_STATUS
+AcpiValidate (
+              IN OUT RANGE_CHECK_CONTEXT *RangeCheck,
+              IN VOID *Rsdp,
+              OUT ACPI_VALIDATION *Validation
+              );
+
+VOID
+AcpiValidationPrint (
+                     IN ACPI_VALIDATION *Validation,
+                     IN BOOLEAN Verbose
+                     );
+
+VOID
+AcpiValidationFree (
+                    IN OUT ACPI_VALIDATION *Validation
+                    );
+
 CHAR16 *
 StrDuplicate (
               IN CONST CHAR16 *Src
@@ -43,6 +43,7 @@
 
 #include <Library/FTSLib.h>
 #include <Library/BaseLib.h>
+#include <Library/StdExtLib.h>
 
 #define NAMLEN(dp) ((size_t)(StrLen((dp)->d_name)))
 
@@ -57,8 +58,10 @@ static size_t	 fts_maxarglen(char * const *);
 static void	 fts_padjust(FTS *, FTSENT *);
 static int	 fts_palloc(FTS *, size_t);
 static FTSENT	*fts_sort(FTS *, FTSENT *, size_t);
+static int	 fts_keysort(FTS *, FTSENT *, size_t);
 static int	 fts_stat(FTS *, FTSENT *, int);
 static int	 fts_safe_changedir(FTS *, FTSENT *, int, char *);
+static FTSENT	*fts_visit(FTS *, FTSENT *);
 /* static int	 fts_ufslinks(FTS *, const FTSENT *); */
 
 #define	ISDOT(a)	(a[0] == '.' && (!a[1] || (a[1] == '.' && !a[2])))
@@ -83,8 +86,36 @@ static int	 fts_safe_changedir(FTS *, FTSENT *, int, char *);
 struct _fts_private {
 	FTS		ftsp_fts;
 	/* dev_t		ftsp_dev; */
+	struct fts_devino *ftsp_seen;	/* visited directories */
+	size_t		ftsp_nseen;	/* entries used in ftsp_seen */
+	size_t		ftsp_seensz;	/* ftsp_seen size, power of 2 */
+	unsigned long long (*ftsp_key)(const FTSENT *); /* sort key */
+	struct fts_key	*ftsp_keys;	/* key sort scratch, 2 * ftsp_nkeys */
+	size_t		ftsp_nkeys;	/* entries in each ftsp_keys half */
 };
 
+/*
+ * Precomputed sort key, see fts_set_sortkey.
+ */
+struct fts_key {
+	unsigned long long key;
+	FTSENT		*p;
+};
+
+#define	FTS_KEYSORT_MIN	32		/* below this qsort is just as good */
+
+/*
+ * Open-addressed set of (dev, ino) pairs of every directory visited
+ * in pre-order. A zero pair is an empty slot, and is never inserted,
+ * since that's what stat() leaves behind for files it can't identify.
+ */
+struct fts_devino {
+	dev_t		dev;
+	ino_t		ino;
+};
+
+#define	FTS_SEEN_INIT	64
+
 /*
  * UEFI dummy implementation, fchdir won't be really used anywhere.
  */
@@ -238,7 +269,7 @@ fts_load(FTS *sp, FTSENT *p)
 		p->fts_namelen = len;
 	}
 	p->fts_accpath = p->fts_path = sp->fts_path;
-	/* sp->fts_dev = p->fts_dev; */
+	sp->fts_dev = p->fts_dev;
 }
 
 int
@@ -267,6 +298,8 @@ fts_close(FTS *sp)
 	if (sp->fts_array)
 		free(sp->fts_array);
 	free(sp->fts_path);
+	free(((struct _fts_private *)sp)->ftsp_seen);
+	free(((struct _fts_private *)sp)->ftsp_keys);
 
 	/* Return to original directory, save errno if necessary. */
 	if (!ISSET(FTS_NOCHDIR)) {
@@ -337,14 +370,16 @@ fts_read(FTS *sp)
 			} else
 				p->fts_flags |= FTS_SYMFOLLOW;
 		}
+		if (fts_visit(sp, p) == NULL)
+			goto next;
 		return (p);
 	}
 
 	/* Directory in pre-order. */
 	if (p->fts_info == FTS_D) {
 		/* If skipped or crossed mount point, do post-order visit. */
-		if (instr == FTS_SKIP /* || */
-		    /* (ISSET(FTS_XDEV) && p->fts_dev != sp->fts_dev) */) {
+		if (instr == FTS_SKIP ||
+		    (ISSET(FTS_XDEV) && p->fts_dev != sp->fts_dev)) {
 			if (p->fts_flags & FTS_SYMFOLLOW)
 				(void)close(p->fts_symfd);
 			if (sp->fts_child) {
@@ -408,6 +443,8 @@ next:	tmp = p;
 				return (NULL);
 			}
 			fts_load(sp, p);
+			if (fts_visit(sp, p) == NULL)
+				goto next;
 			return (sp->fts_cur = p);
 		}
 
@@ -434,6 +471,8 @@ next:	tmp = p;
 name:		t = sp->fts_path + NAPPEND(p->fts_parent);
 		*t++ = '/';
 		memmove(t, p->fts_name, p->fts_namelen + 1);
+		if (fts_visit(sp, p) == NULL)
+			goto next;
 		return (sp->fts_cur = p);
 	}
 
@@ -597,6 +636,24 @@ fts_set_clientptr(FTS *sp, void *clientptr)
 	sp->fts_clientptr = clientptr;
 }
 
+/*
+ * UEFI extension. Sorting large directories via qsort(3) calls the
+ * comparison function O(n log n) times, which is slow when it has to
+ * chase fts_statp and compare names. If a key function is set, it is
+ * called once per entry, the (unsigned) keys are radix sorted, and the
+ * comparison function is only used to order entries with equal keys.
+ *
+ * The key must be consistent with the comparison function: if
+ * key(a) < key(b), compar(a, b) must be negative. A key prefix (e.g.
+ * the first few bytes of the name) is fine.
+ */
+void
+fts_set_sortkey(FTS *sp, unsigned long long (*key)(const FTSENT *))
+{
+
+	((struct _fts_private *)sp)->ftsp_key = key;
+}
+
 /*
  * This is the tricky part -- do not casually change *anything* in here.  The
  * idea is to build the linked list of entries that are used by fts_children
@@ -863,9 +920,6 @@ mem1:				saved_errno = errno;
 static int
 fts_stat(FTS *sp, FTSENT *p, int follow)
 {
-	/* FTSENT *t; */
-	/* dev_t dev; */
-	/* ino_t ino; */
 	struct stat *sbp, sb;
 	int saved_errno;
 
@@ -913,28 +967,20 @@ err:		memset(sbp, 0, sizeof(struct stat));
 		 * is set to FTS_D.
 		 */
 		/*
-		 * UEFI as no concept of dev, ino or nlink...so cycle detection
-		 * is not possible either.
+		 * UEFI has no concept of dev, ino or nlink, but LibUefi
+		 * stat() synthesizes the first two.
 		 */
-		/* dev = p->fts_dev = sbp->st_dev; */
-		/* ino = p->fts_ino = sbp->st_ino; */
+		p->fts_dev = sbp->st_dev;
+		p->fts_ino = sbp->st_ino;
 		/* p->fts_nlink = sbp->st_nlink; */
 
 		if (ISDOT(p->fts_name))
 			return (FTS_DOT);
 
 		/*
-		 * Cycle detection is done by brute force when the directory
-		 * is first encountered.  If the tree gets deep enough or the
-		 * number of symbolic links to directories is high enough,
-		 * something faster might be worthwhile.
+		 * Cycle (and revisit) detection is done by fts_visit, when
+		 * the directory is returned in pre-order.
 		 */
-		/* for (t = p->fts_parent; */
-		/*     t->fts_level >= FTS_ROOTLEVEL; t = t->fts_parent) */
-		/* 	if (ino == t->fts_ino && dev == t->fts_dev) { */
-		/* 		p->fts_cycle = t; */
-		/* 		return (FTS_DC); */
-		/* 	} */
 		return (FTS_D);
 	}
 	/* if (S_ISLNK(sbp->st_mode)) */
@@ -979,15 +1025,87 @@ fts_sort(FTS *sp, FTSENT *head, size_t nitems)
 			return (head);
 		}
 	}
-	for (ap = sp->fts_array, p = head; p; p = p->fts_link)
-		*ap++ = p;
-	qsort(sp->fts_array, nitems, sizeof(FTSENT *), fts_compar);
+	if (fts_keysort(sp, head, nitems)) {
+		for (ap = sp->fts_array, p = head; p; p = p->fts_link)
+			*ap++ = p;
+		qsort(sp->fts_array, nitems, sizeof(FTSENT *), fts_compar);
+	}
 	for (head = *(ap = sp->fts_array); --nitems; ++ap)
 		ap[0]->fts_link = ap[1];
 	ap[0]->fts_link = NULL;
 	return (head);
 }
 
+/*
+ * Fill fts_array in key order, falling back to fts_compar for runs
+ * of equal keys. Returns non-zero if fts_sort should just qsort.
+ */
+static int
+fts_keysort(FTS *sp, FTSENT *head, size_t nitems)
+{
+	struct _fts_private *priv = (struct _fts_private *)sp;
+	struct fts_key *src, *dst, *tmp;
+	FTSENT *p;
+	size_t count[256];
+	size_t i, j, pos, c;
+	int shift;
+
+	if (priv->ftsp_key == NULL || nitems < FTS_KEYSORT_MIN)
+		return (1);
+
+	if (nitems > priv->ftsp_nkeys) {
+		free(priv->ftsp_keys);
+		priv->ftsp_nkeys = sp->fts_nitems;
+		if ((priv->ftsp_keys = malloc(2 * priv->ftsp_nkeys *
+		    sizeof(struct fts_key))) == NULL) {
+			priv->ftsp_nkeys = 0;
+			return (1);
+		}
+	}
+
+	src = priv->ftsp_keys;
+	dst = src + priv->ftsp_nkeys;
+	for (i = 0, p = head; p; p = p->fts_link, i++) {
+		src[i].key = priv->ftsp_key(p);
+		src[i].p = p;
+	}
+
+	/*
+	 * LSD radix sort, a byte at a time. Being stable, it keeps equal
+	 * keys in directory order. Bytes that are the same for all keys
+	 * (e.g. the high bytes of sizes) are skipped.
+	 */
+	for (shift = 0; shift < 64; shift += 8) {
+		memset(count, 0, sizeof(count));
+		for (i = 0; i < nitems; i++)
+			count[(src[i].key >> shift) & 0xff]++;
+		if (count[(src[0].key >> shift) & 0xff] == nitems)
+			continue;
+		for (i = 0, pos = 0; i < 256; i++) {
+			c = count[i];
+			count[i] = pos;
+			pos += c;
+		}
+		for (i = 0; i < nitems; i++)
+			dst[count[(src[i].key >> shift) & 0xff]++] = src[i];
+		tmp = src;
+		src = dst;
+		dst = tmp;
+	}
+
+	for (i = 0; i < nitems; i++)
+		sp->fts_array[i] = src[i].p;
+
+	for (i = 0; i < nitems; i = j) {
+		for (j = i + 1; j < nitems && src[j].key == src[i].key; j++)
+			;
+		if (j - i > 1)
+			qsort(sp->fts_array + i, j - i, sizeof(FTSENT *),
+			    fts_compar);
+	}
+	return (0);
+}
+
 static FTSENT *
 fts_alloc(FTS *sp, void *nameb, size_t namelen, int wide)
 {
@@ -1023,7 +1141,7 @@ fts_alloc(FTS *sp, void *nameb, size_t namelen, int wide)
 
 	/* Copy the name and guarantee NUL termination. */
         if (wide) {
-          UnicodeStrToAsciiStrS(nameb, p->fts_name, namelen);
+          buffer_narrow(nameb, p->fts_name, namelen);
         } else {
           memcpy(p->fts_name, nameb, namelen);
         }
@@ -1036,6 +1154,9 @@ fts_alloc(FTS *sp, void *nameb, size_t namelen, int wide)
 	p->fts_number = 0;
 	p->fts_pointer = NULL;
 	p->fts_fts = sp;
+	p->fts_cycle = NULL;
+	p->fts_dev = 0;
+	p->fts_ino = 0;
 	return (p);
 }
 
@@ -1127,7 +1248,8 @@ fts_safe_changedir(FTS *sp, FTSENT *p, int fd, char *path)
 		goto bail;
 	}
         /*
-         * st_dev and st_ino don't exist in StdLib dirent (i.e. EFI_FILE_INFO).
+         * Unreachable with FTS_NOCHDIR. Also, fstat() doesn't
+         * synthesize st_dev and st_ino, only stat() does.
          */
 	/* if (p->fts_dev != sb.st_dev || p->fts_ino != sb.st_ino) { */
 	/* 	errno = ENOENT;		/\* disinformation *\/ */
@@ -1154,3 +1276,94 @@ bail:
 /*    *\/ */
 /*   return 0; */
 /* } */
+
+static size_t
+fts_devino_hash(dev_t dev, ino_t ino)
+{
+	unsigned long long h;
+
+	h = (unsigned long long)ino ^
+	    ((unsigned long long)dev * 0x9e3779b97f4a7c15ULL);
+	return ((size_t)(h ^ (h >> 32)));
+}
+
+/*
+ * Insert (dev, ino) into the visited set. Returns 1 if already
+ * present, 0 if inserted (or if out of memory, in which case the
+ * walk simply goes on without revisit detection for this entry).
+ */
+static int
+fts_seen(struct _fts_private *priv, dev_t dev, ino_t ino)
+{
+	struct fts_devino *old, *e;
+	size_t i, mask, oldsz;
+
+	if (priv->ftsp_seen == NULL ||
+	    (priv->ftsp_nseen + 1) * 4 > priv->ftsp_seensz * 3) {
+		old = priv->ftsp_seen;
+		oldsz = priv->ftsp_seensz;
+		priv->ftsp_seensz = oldsz ? oldsz * 2 : FTS_SEEN_INIT;
+		priv->ftsp_seen = calloc(priv->ftsp_seensz, sizeof(*e));
+		if (priv->ftsp_seen == NULL) {
+			priv->ftsp_seen = old;
+			priv->ftsp_seensz = oldsz;
+			if (old == NULL ||
+			    priv->ftsp_nseen + 1 >= priv->ftsp_seensz)
+				return (0);
+		} else {
+			priv->ftsp_nseen = 0;
+			for (i = 0; i < oldsz; i++)
+				if (old[i].dev != 0 || old[i].ino != 0)
+					(void)fts_seen(priv, old[i].dev,
+					    old[i].ino);
+			free(old);
+		}
+	}
+
+	mask = priv->ftsp_seensz - 1;
+	for (i = fts_devino_hash(dev, ino) & mask;; i = (i + 1) & mask) {
+		e = &priv->ftsp_seen[i];
+		if (e->dev == dev && e->ino == ino)
+			return (1);
+		if (e->dev == 0 && e->ino == 0)
+			break;
+	}
+	e->dev = dev;
+	e->ino = ino;
+	priv->ftsp_nseen++;
+	return (0);
+}
+
+/*
+ * Called on every directory about to be returned in pre-order. The
+ * original brute force walk up the parents only catches true cycles,
+ * while the aliased Shell mappings (fs0: vs blk0:, or the same volume
+ * given twice on the command line) revisit directories that are not
+ * ancestors. A true cycle is reported as FTS_DC with fts_cycle pointing
+ * to the ancestor, as before. A plain revisit is not an error, so NULL
+ * is returned and the caller skips the entry without reporting it.
+ */
+static FTSENT *
+fts_visit(FTS *sp, FTSENT *p)
+{
+	FTSENT *t;
+
+	if (p->fts_info != FTS_D ||
+	    (p->fts_dev == 0 && p->fts_ino == 0))
+		return (p);
+
+	if (!fts_seen((struct _fts_private *)sp, p->fts_dev, p->fts_ino))
+		return (p);
+
+	for (t = p->fts_parent;
+	    t->fts_level >= FTS_ROOTLEVEL; t = t->fts_parent)
+		if (p->fts_ino == t->fts_ino && p->fts_dev == t->fts_dev) {
+			p->fts_cycle = t;
+			p->fts_info = FTS_DC;
+			return (p);
+		}
+
+	if (p->fts_flags & FTS_SYMFOLLOW)
+		(void)close(p->fts_symfd);
+	return (NULL);
+}
@@ -51,6 +51,8 @@ __RCSID("$NetBSD: fnmatch.c,v 1.26 2014/10/12 22:32:33 christos Exp $");
 #include <assert.h>
 #include <ctype.h>
 /* #include <fnmatch.h> */
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <Library/StdExtLib.h>
@@ -222,3 +224,233 @@ fnmatch(const char *pattern, const char *string, int flags)
 {
 	return fnmatchx(pattern, string, flags, 64);
 }
+
+/*
+ * Compiled patterns.
+ *
+ * The pattern is turned into a sequence of atoms (a literal, '?' or a
+ * bracket expression), with '*' becoming a self-loop on the state
+ * before the next atom. The string is then run through that NFA with
+ * all states as bits of a word (Shift-And), one table lookup per
+ * character, so matching is linear in the string regardless of the
+ * number of stars. Patterns with more atoms than fit in the word fall
+ * back to fnmatch().
+ */
+
+#define	FNM_MAXATOMS	63
+
+struct fnmatch_prog {
+	int		flags;
+	uint64_t	accept;			/* The final state */
+	uint64_t	loop;			/* States with a '*' loop */
+	uint64_t	slash;			/* Atoms that are a literal '/' */
+	uint64_t	nolead;			/* '?' atoms, under FNM_PERIOD */
+	uint64_t	noleadloop;		/* '*' states, under FNM_PERIOD */
+	uint64_t	mask[256];		/* Atoms matching each character */
+	char		*pattern;		/* For the fallback, or NULL */
+};
+
+/*
+ * Find the end of the bracket expression at pattern (just past the
+ * '['), parsing it the way rangematch does. Returns NULL if it is
+ * unterminated, or (void *)-1 if it contains a '/', in which case the
+ * '[' is an ordinary character.
+ */
+static const char *
+rangeend(const char *pattern, int flags)
+{
+	int need;
+	char c;
+
+	if (*pattern == '!' || *pattern == '^')
+		++pattern;
+
+	for (need = 1; (c = *pattern++) != ']' || need;) {
+		need = 0;
+		if (c == '/')
+			return (void *)-1;
+		if (c == '\\' && !(flags & FNM_NOESCAPE))
+			c = *pattern++;
+		if (c == EOS)
+			return NULL;
+		if (*pattern == '-' && pattern[1] != EOS && pattern[1] != ']') {
+			pattern += 2;
+			if (pattern[-1] == '\\' && !(flags & FNM_NOESCAPE))
+				c = *pattern++;
+			else
+				c = pattern[-1];
+			if (c == EOS)
+				return NULL;
+		}
+	}
+	return pattern;
+}
+
+/*
+ * Parse the atom at pattern into set, indexed by folded character.
+ * Returns the pattern past the atom, and the character in *literal
+ * if it only matches one, or -1.
+ */
+static const char *
+compile_atom(const char *pattern, int flags, unsigned char *set, int *literal)
+{
+	const char *end;
+	char c;
+	int t;
+
+	memset(set, 0, 256);
+	*literal = -1;
+
+	c = FOLDCASE(*pattern++, flags);
+	switch (c) {
+	case '?':
+		memset(set, 1, 256);
+		return pattern;
+	case '[':
+		end = rangeend(pattern, flags);
+		if (end == NULL) {
+			/* Unterminated, can never match. */
+			return pattern + strlen(pattern);
+		}
+		if (end != (void *)-1) {
+			for (t = 1; t < 256; t++)
+				if (rangematch(pattern, t, flags) != NULL)
+					set[t] = 1;
+			return end;
+		}
+		/* Not a bracket expression after all. */
+		break;
+	case '\\':
+		if (!(flags & FNM_NOESCAPE) && *pattern != EOS)
+			c = FOLDCASE(*pattern++, flags);
+		break;
+	default:
+		break;
+	}
+
+	set[(unsigned char)c] = 1;
+	*literal = (unsigned char)c;
+	return pattern;
+}
+
+/*
+ * Compile pattern for matching with fnmatch_exec, with the same
+ * semantics as fnmatch(pattern, string, flags).
+ *
+ * Returns NULL if out of memory.
+ */
+fnmatch_t *
+fnmatch_compile(const char *pattern, int flags)
+{
+	fnmatch_t *prog;
+	const char *start;
+	unsigned char set[256];
+	uint64_t bit;
+	int atoms, literal, period, t;
+
+	_DIAGASSERT(pattern != NULL);
+
+	if ((prog = calloc(1, sizeof(*prog))) == NULL)
+		return NULL;
+	prog->flags = flags;
+	period = flags & FNM_PERIOD;
+
+	for (start = pattern, atoms = 0, bit = 1; *pattern != EOS;) {
+		if (*pattern == '*') {
+			while (*pattern == '*')
+				pattern++;
+			prog->loop |= bit;
+			if (period)
+				prog->noleadloop |= bit;
+
+			/*
+			 * fnmatch() stops checking for leading periods
+			 * past a star it has to recurse for.
+			 */
+			if (*pattern != EOS &&
+			    !(*pattern == '/' && (flags & FNM_PATHNAME)))
+				period = 0;
+			continue;
+		}
+
+		if (atoms == FNM_MAXATOMS) {
+			if ((prog->pattern = strdup(start)) == NULL) {
+				free(prog);
+				return NULL;
+			}
+			break;
+		}
+
+		bit <<= 1;
+		atoms++;
+		if (*pattern == '?' && period)
+			prog->nolead |= bit;
+		pattern = compile_atom(pattern, flags, set, &literal);
+		for (t = 0; t < 256; t++)
+			if (set[FOLDCASE(t, flags)])
+				prog->mask[t] |= bit;
+		if (literal == '/')
+			prog->slash |= bit;
+	}
+
+	prog->accept = bit;
+	return prog;
+}
+
+/*
+ * Match string against a compiled pattern.
+ *
+ * Returns 0 on a match, FNM_NOMATCH otherwise.
+ */
+int
+fnmatch_exec(const fnmatch_t *prog, const char *string)
+{
+	const unsigned char *s;
+	uint64_t d, m, loop;
+	int flags;
+
+	_DIAGASSERT(prog != NULL);
+	_DIAGASSERT(string != NULL);
+
+	flags = prog->flags;
+	if (prog->pattern != NULL)
+		return fnmatch(prog->pattern, string, flags);
+
+	/* Bit 0 is the state with nothing matched yet. */
+	d = 1;
+	for (s = (const unsigned char *)string; *s != EOS; s++) {
+		if ((flags & FNM_LEADING_DIR) && *s == '/' &&
+		    (d & prog->accept) != 0)
+			return 0;
+
+		m = prog->mask[*s];
+		loop = prog->loop;
+		if (*s == '.' && (flags & FNM_PERIOD) &&
+		    (s == (const unsigned char *)string ||
+		    ((flags & FNM_PATHNAME) && s[-1] == '/'))) {
+			/* A leading period isn't matched by '?' or '*'. */
+			d &= ~prog->noleadloop;
+			m &= ~prog->nolead;
+		} else if (*s == '/' && (flags & FNM_PATHNAME)) {
+			/* A slash only matches a slash. */
+			m &= prog->slash;
+			loop = 0;
+		}
+
+		d = ((d << 1) & m) | (d & loop);
+		if (d == 0)
+			return FNM_NOMATCH;
+	}
+
+	return (d & prog->accept) != 0 ? 0 : FNM_NOMATCH;
+}
+
+void
+fnmatch_free(fnmatch_t *prog)
+{
+
+	if (prog != NULL) {
+		free(prog->pattern);
+		free(prog);
+	}
+}
@@ -43,50 +43,125 @@
 #include <errno.h>
 #include <string.h>
 #endif
+#include <stdint.h>
 
 #include <Library/StdExtLib.h>
 
-ssize_t
-getdelim(char **buf, size_t *bufsiz, int delimiter, FILE *fp)
+/*
+ * The lines are found in the stdio buffer itself: the buffer is scanned
+ * for the delimiter a word at a time and copied out in one go, instead
+ * of a character at a time through fgetc. This relies on StdLib's stdio
+ * being NetBSD's, i.e. on _p/_r and __srget.
+ */
+
+#define ONES	((uintptr_t) -1 / 0xFF)
+#define HIGHS	(ONES * 0x80)
+#define HASZERO(w) (((w) - ONES) & ~(w) & HIGHS)
+
+static const unsigned char *
+scan_delim(const unsigned char *p, int delimiter, size_t n)
 {
-	char *ptr, *eptr;
+	const uintptr_t *w;
+	uintptr_t mask, x;
+	unsigned char c = (unsigned char)delimiter;
 
+	for (; n != 0 && ((uintptr_t)p & (sizeof(uintptr_t) - 1)) != 0; p++, n--)
+		if (*p == c)
+			return p;
 
-	if (*buf == NULL || *bufsiz == 0) {
-		*bufsiz = BUFSIZ;
-		if ((*buf = malloc(*bufsiz)) == NULL)
-			return -1;
+	mask = ONES * c;
+	for (w = (const uintptr_t *)p; n >= sizeof(uintptr_t);
+	    w++, n -= sizeof(uintptr_t)) {
+		x = *w ^ mask;
+		if (HASZERO(x))
+			break;
 	}
 
-	for (ptr = *buf, eptr = *buf + *bufsiz;;) {
-		int c = fgetc(fp);
-		if (c == -1) {
-			if (feof(fp)) {
-				ssize_t diff = (ssize_t)(ptr - *buf);
-				if (diff != 0) {
-					*ptr = '\0';
-					return diff;
-				}
-			}
+	for (p = (const unsigned char *)w; n != 0; p++, n--)
+		if (*p == c)
+			return p;
+
+	return NULL;
+}
+
+/*
+ * Make sure there is something in the stdio buffer, returning
+ * -1 at EOF or on error.
+ */
+static int
+fill(FILE *fp)
+{
+
+	if (fp->_r > 0)
+		return 0;
+	if (__srget(fp) == EOF)
+		return -1;
+	/* __srget consumed the first character, put it back. */
+	fp->_p--;
+	fp->_r++;
+	return 0;
+}
+
+/*
+ * Take up to n bytes (through the delimiter, if found) out of the
+ * stdio buffer. Returns the number taken, and sets *found if the
+ * delimiter was among them.
+ */
+static size_t
+take(FILE *fp, int delimiter, int *found)
+{
+	const unsigned char *d;
+
+	d = scan_delim(fp->_p, delimiter, (size_t)fp->_r);
+	*found = d != NULL;
+	return d != NULL ? (size_t)(d - fp->_p) + 1 : (size_t)fp->_r;
+}
+
+static int
+grow(char **buf, size_t *bufsiz, size_t need)
+{
+	char *nbuf;
+	size_t nbufsiz;
+
+	if (need <= *bufsiz)
+		return 0;
+	for (nbufsiz = *bufsiz ? *bufsiz : BUFSIZ; nbufsiz < need;
+	    nbufsiz *= 2)
+		continue;
+	if ((nbuf = realloc(*buf, nbufsiz)) == NULL)
+		return -1;
+	*buf = nbuf;
+	*bufsiz = nbufsiz;
+	return 0;
+}
+
+ssize_t
+getdelim(char **buf, size_t *bufsiz, int delimiter, FILE *fp)
+{
+	size_t off, n;
+	int found;
+
+	if (*buf == NULL)
+		*bufsiz = 0;
+
+	for (off = 0, found = 0; !found;) {
+		if (fill(fp) == -1) {
+			if (off != 0 && feof(fp))
+				break;
 			return -1;
 		}
-		*ptr++ = c;
-		if (c == delimiter) {
-			*ptr = '\0';
-			return ptr - *buf;
-		}
-		if (ptr + 2 >= eptr) {
-			char *nbuf;
-			size_t nbufsiz = *bufsiz * 2;
-			ssize_t d = ptr - *buf;
-			if ((nbuf = realloc(*buf, nbufsiz)) == NULL)
-				return -1;
-			*buf = nbuf;
-			*bufsiz = nbufsiz;
-			eptr = nbuf + nbufsiz;
-			ptr = nbuf + d;
-		}
+		n = take(fp, delimiter, &found);
+		/* Room for the NUL */
+		if (grow(buf, bufsiz, off + n + 1) == -1)
+			return -1;
+		memcpy(*buf + off, fp->_p, n);
+		fp->_p += n;
+		fp->_r -= (int)n;
+		off += n;
 	}
+
+	(*buf)[off] = '\0';
+	return (ssize_t)off;
 }
 
 ssize_t
@@ -95,6 +170,73 @@ getline(char **buf, size_t *bufsiz, FILE *fp)
 	return getdelim(buf, bufsiz, '\n', fp);
 }
 
+/*
+ * Like getdelim, but without copying where possible. Returns a pointer
+ * to the line, including the delimiter unless at EOF, and its length
+ * in *lenp. The line is not NUL-terminated. If it is entirely in the
+ * stdio buffer, the pointer is into that buffer, otherwise into a
+ * scratch buffer shared by all streams. Either way it is only valid
+ * until the next I/O on fp or the next fgetdelim/fgetline call.
+ *
+ * Returns NULL at EOF or on error.
+ */
+static char *scratch;
+static size_t scratchsiz;
+
+char *
+fgetdelim(FILE *fp, size_t *lenp, int delimiter)
+{
+	char *line;
+	size_t off, n;
+	int found;
+
+	if (fill(fp) == -1)
+		return NULL;
+
+	n = take(fp, delimiter, &found);
+	if (found) {
+		line = (char *)fp->_p;
+		fp->_p += n;
+		fp->_r -= (int)n;
+		*lenp = n;
+		return line;
+	}
+
+	/* Straddles the buffer boundary. */
+	for (off = 0; !found;) {
+		if (grow(&scratch, &scratchsiz, off + n) == -1)
+			return NULL;
+		memcpy(scratch + off, fp->_p, n);
+		fp->_p += n;
+		fp->_r -= (int)n;
+		off += n;
+
+		if (fill(fp) == -1) {
+			if (!feof(fp))
+				return NULL;
+			break;
+		}
+		n = take(fp, delimiter, &found);
+		if (found) {
+			if (grow(&scratch, &scratchsiz, off + n) == -1)
+				return NULL;
+			memcpy(scratch + off, fp->_p, n);
+			fp->_p += n;
+			fp->_r -= (int)n;
+			off += n;
+		}
+	}
+
+	*lenp = off;
+	return scratch;
+}
+
+char *
+fgetline(FILE *fp, size_t *lenp)
+{
+	return fgetdelim(fp, lenp, '\n');
+}
+
 #endif
 
 /* #ifdef TEST */
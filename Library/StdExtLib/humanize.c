@@ -27,38 +27,133 @@
  * SUCH DAMAGE.
  */
 
-#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
 #include <Library/StdExtLib.h>
 
+#define MAXSCALE 7
+
+/*
+ * Powers of the divisor, and their bit lengths, so that the scale
+ * can be found from the leading zero count and a comparison or two
+ * instead of dividing until the number fits.
+ */
+static const uint64_t pow1024[MAXSCALE] = {
+  1ULL, 1ULL << 10, 1ULL << 20, 1ULL << 30, 1ULL << 40, 1ULL << 50, 1ULL << 60
+};
+
+static const uint64_t pow1000[MAXSCALE] = {
+  1ULL, 1000ULL, 1000000ULL, 1000000000ULL, 1000000000000ULL,
+  1000000000000000ULL, 1000000000000000000ULL
+};
+
+static const unsigned char bits1024[MAXSCALE] = { 1, 11, 21, 31, 41, 51, 61 };
+static const unsigned char bits1000[MAXSCALE] = { 1, 10, 20, 30, 40, 50, 60 };
+
+static const char prefixes1024[MAXSCALE] = { 'B', 'K', 'M', 'G', 'T', 'P', 'E' };
+static const char prefixes1000[MAXSCALE] = { 'B', 'k', 'M', 'G', 'T', 'P', 'E' };
+
+static unsigned
+bitlen(uint64_t v)
+{
+  unsigned n = 0;
+
+  if (v >= (1ULL << 32)) { v >>= 32; n += 32; }
+  if (v >= (1ULL << 16)) { v >>= 16; n += 16; }
+  if (v >= (1ULL << 8))  { v >>= 8;  n += 8; }
+  if (v >= (1ULL << 4))  { v >>= 4;  n += 4; }
+  if (v >= (1ULL << 2))  { v >>= 2;  n += 2; }
+  if (v >= (1ULL << 1))  { v >>= 1;  n += 1; }
+  return n + (unsigned) v;
+}
+
+/*
+ * Smallest scale at which bytes / divisor^scale < limit.
+ */
+static size_t
+findscale(uint64_t bytes, uint64_t limit,
+          const uint64_t *pow, const unsigned char *bits)
+{
+  unsigned lb, ll;
+  size_t i;
+
+  lb = bitlen(bytes);
+  ll = bitlen(limit);
+  if (lb <= ll) {
+    i = 0;
+  } else {
+    /*
+     * Below this, bytes has more bits than limit * divisor^i
+     * can have, so the answer is never smaller.
+     */
+    i = (lb - ll) / 10;
+    if (i >= MAXSCALE) {
+      return MAXSCALE;
+    }
+  }
+
+  /*
+   * limit * divisor^i has at least ll + bits[i] - 1 bits. If that's
+   * more than 63 it's bigger than bytes, and it might not fit.
+   */
+  while (i < MAXSCALE && ll + bits[i] <= 64 && bytes >= limit * pow[i]) {
+    i++;
+  }
+
+  return i;
+}
+
+/*
+ * Append n bytes of s at *pos, as much as fits in len with a
+ * terminating NUL. *pos keeps counting past the end, like snprintf.
+ */
+static void
+put(char *buf, size_t len, size_t *pos, const char *s, size_t n)
+{
+  size_t room;
+
+  if (*pos + 1 < len) {
+    room = len - 1 - *pos;
+    memcpy(buf + *pos, s, n < room ? n : room);
+  }
+  *pos += n;
+}
+
 int
 humanize_number(char *buf, size_t len, int64_t bytes,
                 const char *suffix, int scale, int flags)
 {
-  const char *prefixes, *sep;
-  int b, s1, s2, sign, r = 0;
-  int64_t divisor, max, post = 1;
-  size_t i, baselen, maxscale;
-  int     getscale = 0;
+  const uint64_t *pow;
+  const unsigned char *bits;
+  const char *prefixes;
+  char num[24], *p;
+  uint64_t value, limit;
+  int64_t post = 1;
+  size_t i, baselen, pos, digits;
+  int b, sign, getscale = 0;
+  static const uint64_t pow10[] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+    10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+    100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+    100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+    100000000000000000ULL, 1000000000000000000ULL
+  };
 
   _DIAGASSERT(scale >= 0);
 
   if (flags & HN_DIVISOR_1000) {
     /* SI for decimal multiplies */
-    divisor = 1000;
-    if (flags & HN_B)
-      prefixes = "B\0k\0M\0G\0T\0P\0E";
-    else
-      prefixes = "\0\0k\0M\0G\0T\0P\0E";
+    pow = pow1000;
+    bits = bits1000;
+    prefixes = prefixes1000;
   } else {
     /*
      * binary multiplies
      * XXX IEC 60027-2 recommends Ki, Mi, Gi...
      */
-    divisor = 1024;
-    if (flags & HN_B)
-      prefixes = "B\0K\0M\0G\0T\0P\0E";
-    else
-      prefixes = "\0\0K\0M\0G\0T\0P\0E";
+    pow = pow1024;
+    bits = bits1024;
+    prefixes = prefixes1024;
   }
 
   if (scale & HN_GETSCALE)
@@ -70,10 +165,7 @@ humanize_number(char *buf, size_t len, int64_t bytes,
   if ((!getscale) && (buf == NULL))
     return (-1);
 
-#define SCALE2PREFIX(scale) (&prefixes[(scale) << 1])
-  maxscale = 7;
-
-  if ((size_t)scale >= maxscale &&
+  if ((size_t)scale >= MAXSCALE &&
       (scale & (HN_AUTOSCALE | HN_GETSCALE)) == 0)
     return (-1);
 
@@ -102,65 +194,75 @@ humanize_number(char *buf, size_t len, int64_t bytes,
       baselen += 2;
     }
   }
-  if (flags & HN_NOSPACE)
-    sep = "";
-  else {
-    sep = " ";
+  if (!(flags & HN_NOSPACE))
     baselen++;
-  }
-  if (suffix != NULL)
-    baselen += strlen(suffix);
+  baselen += strlen(suffix);
 
   /* Check if enough room for `x y' + suffix + `\0' */
   if (len < baselen + 1)
     return (-1);
 
+  value = (uint64_t) bytes;
   if (scale & (HN_AUTOSCALE | HN_GETSCALE)) {
-    /* See if there is additional columns can be used. */
-    for (max = 100, i = len - baselen; i-- > 0;)
-      max *= 10;
-
     /*
-     * Divide the number until it fits the given column.
-     * If there will be an overflow by the rounding below,
-     * divide once more.
+     * Use the additional columns, if any, and go up a scale
+     * if there will be an overflow by the rounding below.
      */
-    for (i = 0; bytes >= max - 50 && i < maxscale; i++)
-      bytes /= divisor;
+    if (len - baselen + 2 < __arraycount(pow10)) {
+      limit = pow10[len - baselen + 2] - 50;
+      i = findscale(value, limit, pow, bits);
+    } else
+      i = 0;
   } else
-    for (i = 0; i < (size_t)scale && i < maxscale; i++)
-      bytes /= divisor;
-  bytes *= post;
+    i = (size_t)scale;
+  if (i >= MAXSCALE)
+    i = MAXSCALE - 1;
+
+  if (pow == pow1024)
+    value >>= 10 * i;
+  else
+    value /= pow[i];
+  value *= post;
 
   /* If a value <= 9.9 after rounding and ... */
-  if (bytes < 995 && i > 0 && flags & HN_DECIMAL) {
+  if (value < 995 && i > 0 && flags & HN_DECIMAL) {
     /* baselen + \0 + .N */
     if (len < baselen + 1 + 2)
       return (-1);
-    b = ((int)bytes + 5) / 10;
-    s1 = b / 10;
-    s2 = b % 10;
-    if (suffix != NULL)
-      r = snprintf(buf, len, "%d.%d%s%s%s",
-                   sign * s1, s2,
-                   sep, SCALE2PREFIX(i), suffix);
-    else
-      r = snprintf(buf, len, "%d.%d%s%s",
-                   sign * s1, s2,
-                   sep, SCALE2PREFIX(i));
+    b = ((int)value + 5) / 10;
+    p = num;
+    /* Like "%d", a zero integer part loses the sign. */
+    if (sign < 0 && b >= 10)
+      *p++ = '-';
+    *p++ = '0' + b / 10;
+    *p++ = '.';
+    *p++ = '0' + b % 10;
+    digits = p - num;
+    p = num;
   } else {
-    if (suffix != NULL)
-      r = snprintf(buf, len, "%lld%s%s%s",
-                   (long long) (sign * ((bytes + 50) / 100)),
-                   sep, SCALE2PREFIX(i), suffix);
-    else
-      r = snprintf(buf, len, "%lld%s%s",
-                   (long long) (sign * ((bytes + 50) / 100)),
-                   sep, SCALE2PREFIX(i));
+    value = (value + 50) / 100;
+    p = num + sizeof(num);
+    do {
+      *--p = '0' + value % 10;
+      value /= 10;
+    } while (value != 0);
+    if (sign < 0 && *p != '0')
+      *--p = '-';
+    digits = num + sizeof(num) - p;
   }
 
+  pos = 0;
+  put(buf, len, &pos, p, digits);
+  if (!(flags & HN_NOSPACE))
+    put(buf, len, &pos, " ", 1);
+  if (i > 0 || (flags & HN_B))
+    put(buf, len, &pos, &prefixes[i], 1);
+  put(buf, len, &pos, suffix, strlen(suffix));
+  if (len > 0)
+    buf[pos < len ? pos : len - 1] = '\0';
+
   if (getscale)
     return (int)i;
   else
-    return (r);
+    return (int)pos;
 }
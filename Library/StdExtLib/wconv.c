@@ -0,0 +1,143 @@
+/*
+ * Copyright (C) 2017 Andrei Evgenievich Warkentin
+ *
+ * This program and the accompanying materials
+ * are licensed and made available under the terms and conditions of the BSD License
+ * which accompanies this distribution.  The full text of the license may be found at
+ * http://opensource.org/licenses/bsd-license.php
+ *
+ * THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+ */
+
+/*
+ * UCS-2 <-> Latin-1 buffer conversion, as done for every character going
+ * through the console and for every name coming out of readdir.
+ *
+ * Works four characters at a time in a 64-bit word: four UCS-2 code
+ * units are one little-endian uint64_t, four Latin-1 bytes one uint32_t.
+ * UEFI is always little-endian. Without SSE/NEON intrinsics available to
+ * all toolchains edk2 supports, this is the portable equivalent of the
+ * pack/unpack instructions, and needs no per-character branches.
+ *
+ * The wide side is always word aligned. The narrow side is accessed
+ * unaligned on IA32/X64 and must be aligned as well everywhere else,
+ * otherwise the plain loop is used.
+ */
+
+#include <sys/cdefs.h>
+#include <stdint.h>
+#include <wchar.h>
+
+#include <Library/StdExtLib.h>
+
+#if defined(MDE_CPU_IA32) || defined(MDE_CPU_X64)
+#define NARROW_OK(p)	1
+#else
+#define NARROW_OK(p)	((((uintptr_t) (p)) & (sizeof(uint32_t) - 1)) == 0)
+#endif
+
+#define WIDE_ALIGNED(p)	((((uintptr_t) (p)) & (sizeof(uint64_t) - 1)) == 0)
+
+#define LANES_LO	0x00FF00FF00FF00FFULL
+#define LANES_ONE	0x0001000100010001ULL
+#define LANES_SUB	0x003F003F003F003FULL	/* '?' in every lane */
+
+/*
+ * Four UCS-2 code units to four Latin-1 bytes, anything above 0xFF
+ * becoming '?'.
+ */
+static inline uint32_t
+pack4(uint64_t w)
+{
+	uint64_t hi;
+	uint64_t bad;
+
+	/*
+	 * Per lane: the high byte, moved down, plus 0xFF carries into
+	 * bit 8 exactly when the high byte is non-zero. The sum never
+	 * exceeds 0x1FE, so lanes don't spill into each other.
+	 */
+	hi = (w >> 8) & LANES_LO;
+	bad = (((hi + LANES_LO) >> 8) & LANES_ONE) * 0xFF;
+	w = ((w & LANES_LO) & ~bad) | (LANES_SUB & bad);
+
+	w = (w | (w >> 8)) & 0x0000FFFF0000FFFFULL;
+	w = (w | (w >> 16)) & 0x00000000FFFFFFFFULL;
+	return (uint32_t) w;
+}
+
+/*
+ * Four Latin-1 bytes to four UCS-2 code units.
+ */
+static inline uint64_t
+unpack4(uint32_t n)
+{
+	uint64_t w;
+
+	w = n;
+	w = (w | (w << 16)) & 0x0000FFFF0000FFFFULL;
+	w = (w | (w << 8)) & LANES_LO;
+	return w;
+}
+
+/*
+ * Narrow count wide characters from src into dest, replacing
+ * those that don't fit in a byte with '?'. dest may be the same
+ * as src.
+ */
+void
+buffer_narrow(const wchar_t *src, char *dest, size_t count)
+{
+	unsigned char *d = (unsigned char *) dest;
+
+	while (count != 0 && !WIDE_ALIGNED(src)) {
+		*d++ = *src > 0xFF ? '?' : (unsigned char) *src;
+		src++;
+		count--;
+	}
+
+	if (NARROW_OK(d)) {
+		for (; count >= 4; count -= 4) {
+			*(uint32_t *) d = pack4(*(const uint64_t *) src);
+			src += 4;
+			d += 4;
+		}
+	}
+
+	while (count != 0) {
+		*d++ = *src > 0xFF ? '?' : (unsigned char) *src;
+		src++;
+		count--;
+	}
+}
+
+/*
+ * Widen count bytes from src into dest. Works back to front, so
+ * dest may be the same as src, allowing a buffer to be widened
+ * in place.
+ */
+void
+buffer_widen(const char *src, wchar_t *dest, size_t count)
+{
+	const unsigned char *s = (const unsigned char *) src + count;
+	wchar_t *d = dest + count;
+
+	while (count != 0 && !WIDE_ALIGNED(d)) {
+		*--d = *--s;
+		count--;
+	}
+
+	if (NARROW_OK(s)) {
+		for (; count >= 4; count -= 4) {
+			s -= 4;
+			d -= 4;
+			*(uint64_t *) d = unpack4(*(const uint32_t *) s);
+		}
+	}
+
+	while (count != 0) {
+		*--d = *--s;
+		count--;
+	}
+}
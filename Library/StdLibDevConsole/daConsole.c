@@ -22,6 +22,7 @@
 **/
 #include  <Uefi.h>
 #include  <Library/BaseLib.h>
+#include  <Library/BaseMemoryLib.h>
 #include  <Library/MemoryAllocationLib.h>
 #include  <Library/UefiBootServicesTableLib.h>
 #include  <Library/DebugLib.h>
@@ -44,6 +45,8 @@
 #include  <Device/IIO.h>
 #include  <MainData.h>
 
+#include  <Library/StdExtLib.h>
+
 #define DEVCON_NUM          6
 
 #define DEVCON_STDIN        0
@@ -94,6 +97,191 @@ static cIIO          *IIO;
 static BOOLEAN        TtyCooked;
 static BOOLEAN        TtyEcho;
 
+/*
+  Read-ahead for redirected input. A ShellReadFile costs about the
+  same for one character as for a few thousand, so the file or pipe
+  is read in large chunks. stdin: and nstdin: use the same Shell
+  handle and so share the buffer.
+*/
+#define DEVCON_READAHEAD    8192
+
+static struct {
+  SHELL_FILE_HANDLE Handle;
+  UINTN             Head;
+  UINTN             Tail;
+  UINT8             Data[DEVCON_READAHEAD];
+} ReadAhead;
+
+/**
+  Drop any read-ahead data, e.g. after the file position is changed.
+
+  @param[in]  Handle    Handle that the read-ahead buffer is for.
+**/
+static void
+ReadAheadReset(
+  IN SHELL_FILE_HANDLE Handle
+  )
+{
+  ReadAhead.Handle = Handle;
+  ReadAhead.Head = 0;
+  ReadAhead.Tail = 0;
+}
+
+/**
+  Read bytes through the read-ahead buffer.
+
+  @param[in]      Handle    Handle to read from.
+  @param[in,out]  Size      Bytes wanted on input, bytes read on output.
+                            0 on output means end of file.
+  @param[out]     Buffer    Buffer to read into.
+
+  @return   Status of the ShellReadFile, if one was needed.
+**/
+static EFI_STATUS
+ReadAheadGet(
+  IN     SHELL_FILE_HANDLE  Handle,
+  IN OUT UINTN             *Size,
+  OUT    UINT8             *Buffer
+  )
+{
+  EFI_STATUS  Status;
+  UINTN       Fill;
+
+  if (ReadAhead.Handle != Handle) {
+    ReadAheadReset(Handle);
+  }
+
+  if (ReadAhead.Head == ReadAhead.Tail) {
+    Fill = sizeof(ReadAhead.Data);
+    Status = ShellReadFile(Handle, &Fill, ReadAhead.Data);
+    if (EFI_ERROR(Status)) {
+      *Size = 0;
+      return Status;
+    }
+    ReadAhead.Head = 0;
+    ReadAhead.Tail = Fill;
+  }
+
+  *Size = MIN(*Size, ReadAhead.Tail - ReadAhead.Head);
+  CopyMem(Buffer, ReadAhead.Data + ReadAhead.Head, *Size);
+  ReadAhead.Head += *Size;
+  return EFI_SUCCESS;
+}
+
+/*
+  Write combining for the console. Each OutputString goes through the
+  whole firmware text pipeline (glyph rendering, the serial terminal),
+  so console output is collected here and handed over in larger pieces.
+
+  Pending output is flushed when the buffer fills up or has collected
+  DEVCON_COALESCE_LINES lines, before anything that reads or moves the
+  cursor or reads the console, on close and fo_flush (e.g. tcdrain()),
+  and otherwise by a timer, so a prompt without a newline still shows up.
+*/
+#define DEVCON_COALESCE         2048
+#define DEVCON_COALESCE_LINES   16
+#define DEVCON_COALESCE_DELAY   (20 * 10000)    // 20ms, in 100ns units
+
+static struct {
+  EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL *Proto;
+  EFI_EVENT                        Timer;
+  UINTN                            Length;
+  UINTN                            Lines;
+  CHAR16                           Data[DEVCON_COALESCE + 1];
+} Coalesce;
+
+/**
+  Output anything collected by ConCoalesce.
+
+  @return   Status of the OutputString, if one was needed.
+**/
+static EFI_STATUS
+ConCoalesceFlush(
+  VOID
+  )
+{
+  EFI_STATUS  Status;
+  EFI_TPL     OldTpl;
+
+  Status = EFI_SUCCESS;
+  OldTpl = gBS->RaiseTPL(TPL_CALLBACK);
+  if (Coalesce.Length != 0) {
+    Coalesce.Data[Coalesce.Length] = 0;
+    Status = Coalesce.Proto->OutputString(Coalesce.Proto, Coalesce.Data);
+    Coalesce.Length = 0;
+    Coalesce.Lines = 0;
+  }
+  gBS->RestoreTPL(OldTpl);
+
+  return Status;
+}
+
+static VOID
+EFIAPI
+ConCoalesceNotify(
+  IN EFI_EVENT  Event,
+  IN VOID       *Context
+  )
+{
+  (VOID) ConCoalesceFlush();
+}
+
+/**
+  Queue a NUL-terminated string for output to the console.
+
+  @param[in]  Proto     Console to write to.
+  @param[in]  String    String to write.
+  @param[in]  Length    Number of characters in String.
+
+  @return   Status of the OutputString, if one was needed.
+**/
+static EFI_STATUS
+ConCoalesce(
+  IN EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL *Proto,
+  IN CONST CHAR16                    *String,
+  IN UINTN                            Length
+  )
+{
+  EFI_STATUS  Status;
+  EFI_TPL     OldTpl;
+  UINTN       Index;
+
+  if (Coalesce.Timer == NULL) {
+    return Proto->OutputString(Proto, (CHAR16 *) String);
+  }
+
+  Status = EFI_SUCCESS;
+  OldTpl = gBS->RaiseTPL(TPL_CALLBACK);
+  if ((Coalesce.Length != 0 && Coalesce.Proto != Proto) ||
+      (Coalesce.Length + Length > DEVCON_COALESCE)) {
+    Status = ConCoalesceFlush();
+  }
+
+  if (!EFI_ERROR(Status)) {
+    if (Length > DEVCON_COALESCE) {
+      Status = Proto->OutputString(Proto, (CHAR16 *) String);
+    } else {
+      if (Coalesce.Length == 0) {
+        gBS->SetTimer(Coalesce.Timer, TimerRelative, DEVCON_COALESCE_DELAY);
+      }
+      Coalesce.Proto = Proto;
+      CopyMem(Coalesce.Data + Coalesce.Length, String, Length * sizeof(CHAR16));
+      Coalesce.Length += Length;
+      for (Index = 0; Index < Length; Index++) {
+        if (String[Index] == CHAR_LINEFEED) {
+          Coalesce.Lines++;
+        }
+      }
+      if (Coalesce.Lines >= DEVCON_COALESCE_LINES) {
+        Status = ConCoalesceFlush();
+      }
+    }
+  }
+  gBS->RestoreTPL(OldTpl);
+
+  return Status;
+}
+
 /**
   Remove the unicode file tag from the begining of the file buffer.
 
@@ -118,6 +306,7 @@ RemoveFileTag(
   if (CharBuffer != EFI_UNICODE_BYTE_ORDER_MARK) {
     ShellSetFilePosition(Handle, 0);
   }
+  ReadAheadReset(Handle);
 }
 
 /** Position the console cursor to the coordinates specified by Position.
@@ -161,6 +350,9 @@ da_ConSeek(
   if (ShellHandleTypes[Stream->InstanceNum] != SH_HNDL_CON) {
     EFIerrno = ShellSetFilePosition(ShellHandles[Stream->InstanceNum],
                                     Position);
+    if (DEVCON_IS_IN(Stream->InstanceNum)) {
+      ReadAheadReset(ShellHandles[Stream->InstanceNum]);
+    }
   } else {
     EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL *Proto;
     XY_OFFSET                       CursorPos;
@@ -168,6 +360,7 @@ da_ConSeek(
     Proto = (EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL *)Stream->Dev;
     CursorPos.Offset = Position;
 
+    (VOID) ConCoalesceFlush();
     EFIerrno = Proto->SetCursorPosition(Proto,
                                         (INTN)CursorPos.XYpos.Column,
                                         (INTN)CursorPos.XYpos.Row);
@@ -257,9 +450,12 @@ da_ConWrite(
     if(Position != NULL) {
       CursorPos.Offset = *Position;
 
-      Status = Proto->SetCursorPosition(Proto,
-                                        (INTN)CursorPos.XYpos.Column,
-                                        (INTN)CursorPos.XYpos.Row);
+      Status = ConCoalesceFlush();
+      if(!RETURN_ERROR(Status)) {
+        Status = Proto->SetCursorPosition(Proto,
+                                          (INTN)CursorPos.XYpos.Column,
+                                          (INTN)CursorPos.XYpos.Row);
+      }
     }
 
     if(!RETURN_ERROR(Status)) {
@@ -268,7 +464,7 @@ da_ConWrite(
        * Danger, retarded interface doesn't take size, string better
        * be terminated and printable.
        */
-      Status = Proto->OutputString( Proto, (CHAR16 *)Buffer);
+      Status = ConCoalesce(Proto, (CHAR16 *)Buffer, BufferSize);
     }
   }
 
@@ -289,6 +485,69 @@ da_ConWrite(
   return NumChar;
 }
 
+/**
+   Read elements from redirected input.
+
+   If wide, elements are wchar_t. Else they are chars, which are
+   widened to wchar_t in Buffer. A trailing odd byte of wide input
+   is returned as a character of its own.
+
+    @param[in]      Stream        Input stream, which is not the console.
+    @param[out]     Buffer        Buffer in which to place the characters.
+    @param[in]      Max           Maximum number of characters to read.
+    @param[out]     Count         Number of characters read.
+
+    @retval    EFI_END_OF_FILE    No more data is available.
+    @retval    EFI_SUCCESS        *Count characters were placed in Buffer.
+    @retval    other              The ShellReadFile failed.
+**/
+static
+EFI_STATUS
+da_ConBulkRead (
+  IN      ConInstance        *Stream,
+     OUT  wchar_t            *Buffer,
+  IN      UINTN               Max,
+     OUT  UINTN              *Count
+)
+{
+  SHELL_FILE_HANDLE                 Handle;
+  EFI_STATUS                        Status;
+  UINT8                            *Bytes;
+  UINTN                             Want;
+  UINTN                             Got;
+  UINTN                             Size;
+
+  Handle = ShellHandles[Stream->InstanceNum];
+  Bytes  = (UINT8 *) Buffer;
+  Want   = DEVCON_IS_WIDE(Stream->InstanceNum) ? Max * sizeof(wchar_t) : Max;
+  Got    = 0;
+  Status = EFI_SUCCESS;
+
+  while (Got < Want) {
+    Size = Want - Got;
+    Status = ReadAheadGet(Handle, &Size, Bytes + Got);
+    if (EFI_ERROR(Status) || Size == 0) {
+      break;
+    }
+    Got += Size;
+  }
+
+  if (DEVCON_IS_WIDE(Stream->InstanceNum)) {
+    if ((Got % sizeof(wchar_t)) != 0) {
+      Bytes[Got++] = 0;
+    }
+    *Count = Got / sizeof(wchar_t);
+  } else {
+    buffer_widen((const char *) Bytes, Buffer, Got);
+    *Count = Got;
+  }
+
+  if (*Count != 0) {
+    return EFI_SUCCESS;
+  }
+  return EFI_ERROR(Status) ? Status : EFI_END_OF_FILE;
+}
+
 /**
    Read a single element from the console input device.
 
@@ -319,20 +578,9 @@ da_ConRawRead (
   ASSERT(DEVCON_IS_IN(Stream->InstanceNum));
 
   if (ShellHandleTypes[Stream->InstanceNum] != SH_HNDL_CON) {
-    UINT64 Pos;
-    ssize_t BufSize = DEVCON_IS_WIDE(Stream->InstanceNum) ?
-      sizeof(wchar_t) : sizeof(char);
-
-    ShellGetFilePosition(ShellHandles[Stream->InstanceNum], &Pos);
-    *Character = 0;
-    Status = ShellReadFile(ShellHandles[Stream->InstanceNum],
-                           (UINTN *) &BufSize, Character);
-    // DEBUG((EFI_D_ERROR, "read 0x%x bytes\n", BufSize));
-    if (BufSize == 0) {
-      Status = EFI_END_OF_FILE;
-    }
+    UINTN Count;
 
-    return Status;
+    return da_ConBulkRead(Stream, Character, 1, &Count);
   } else {
     wchar_t                           RetChar;
     EFI_INPUT_KEY                     Key = {0,0};
@@ -340,6 +588,9 @@ da_ConRawRead (
 
     ASSERT(DEVCON_IS_WIDE(Stream->InstanceNum));
 
+    // Whatever was written should be visible before reading.
+    (VOID) ConCoalesceFlush();
+
     if(Stream->UnGetKey == CHAR_NULL) {
       Status = Proto->ReadKeyStroke(Proto, &Key);
     } else {
@@ -379,9 +630,11 @@ da_ConRawRead (
 
 /**
 
-   Read a single element from the console input device.
+   Read elements from the console input device.
 
-   If wide, element is a wchar_t. Else a char.
+   Elements are always returned as wchar_t, narrow input being widened.
+   The console returns a single element. Redirected input returns as
+   many as fit in Buffer.
 
     @param[in]      filp          Pointer to file descriptor for this file.
     @param[in]      offset        Ignored.
@@ -390,7 +643,8 @@ da_ConRawRead (
 
     @retval    -1   An error has occurred.  Reason in errno and EFIerrno.
     @retval    -1   No data is available.  errno is set to EAGAIN
-    @retval     1   One wide character has been placed in Buffer
+    @retval     0   End of file.
+    @retval    >0   The number of wide characters placed in Buffer
 **/
 static
 ssize_t
@@ -430,9 +684,21 @@ da_ConRead(
   if (ShellHandleTypes[Stream->InstanceNum] != SH_HNDL_CON) {
     /*
      * ShellLib file interfaces have no notion of waiting on data.
-     * Data is either available, or da_ConRawRead returns EFI_END_OF_FILE.
+     * Data is either available, or we're at EFI_END_OF_FILE.
      */
-    BlockingMode = FALSE;
+    UINTN Count;
+
+    Status = da_ConBulkRead(Stream, (wchar_t *) Buffer,
+                            BufferSize / sizeof(wchar_t), &Count);
+    if (Status == EFI_SUCCESS) {
+      return (ssize_t) Count;
+    } else if (Status == EFI_END_OF_FILE) {
+      return 0;
+    }
+
+    errno = EIO;
+    EFIerrno = Status;
+    return -1;
   }
 
   do {
@@ -450,11 +716,7 @@ da_ConRead(
 
   switch (Status) {
   case EFI_SUCCESS:
-    if (DEVCON_IS_WIDE(Stream->InstanceNum)) {
-      *((wchar_t *)Buffer) = RetChar;
-    } else {
-      *((char *)Buffer) = RetChar;
-    }
+    *((wchar_t *)Buffer) = RetChar;
     return 1;
   case EFI_NOT_READY:
     errno = EAGAIN;
@@ -540,6 +802,7 @@ da_ConStat(
       UINTN                               ModeCol;
       UINTN                               ModeRow;
 
+      (VOID) ConCoalesceFlush();
       Proto = (EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL *)Stream->Dev;
       CursorPos.XYpos.Column  = (UINT32)Proto->Mode->CursorColumn;
       CursorPos.XYpos.Row     = (UINT32)Proto->Mode->CursorRow;
@@ -561,10 +824,12 @@ da_ConStat(
 
 /** Console-specific helper for the ioctl system call.
 
-    The console device does not directly participate in ioctl operations.
-    This function completes the device abstraction and returns an error value
-    to indicate that the function is not supported for this device.
+    The only request is CONIOCISCON, which lets IIO tell the actual console
+    from a stream the Shell redirected, as the termios state it keeps is
+    shared by all the streams.
 
+    @retval    1    CONIOCISCON: the stream is the console.
+    @retval    0    CONIOCISCON: the stream is redirected.
     @retval   -1    Function is not supported for this device.
 **/
 static
@@ -576,6 +841,13 @@ da_ConIoctl(
   va_list             argp
   )
 {
+  ConInstance        *Stream;
+
+  Stream = BASE_CR(filp->f_ops, ConInstance, Abstraction);
+  if ((cmd == CONIOCISCON) && (Stream->Cookie == CON_COOKIE)) {
+    return ShellHandleTypes[Stream->InstanceNum] == SH_HNDL_CON ? 1 : 0;
+  }
+
   errno   = ENODEV;
   return  -1;
 }
@@ -743,6 +1015,7 @@ da_ConFlush(
       (void) da_ConWrite(filp, NULL, NumProc, gMD->UString);
       OutBuf->Flush(OutBuf, UNICODE_STRING_MAX);
     }
+    (void) ConCoalesceFlush();
   }
 
   return 0;
@@ -904,6 +1177,15 @@ __Cons_construct(
     return Status;
   }
 
+  /*
+   * Without the timer, nothing would bound how long output can sit
+   * in the coalescing buffer, so it's only used if the timer is.
+   */
+  if (EFI_ERROR(gBS->CreateEvent(EVT_TIMER | EVT_NOTIFY_SIGNAL, TPL_CALLBACK,
+                                 ConCoalesceNotify, NULL, &Coalesce.Timer))) {
+    Coalesce.Timer = NULL;
+  }
+
   Termio = &IIO->Termio;
   Termio->c_cc[VERASE]  = 0x08;   // ^H Backspace
   Termio->c_cc[VKILL]   = 0x15;   // ^U
@@ -1000,6 +1282,12 @@ __Cons_deconstruct(
 {
   int   i;
 
+  if (Coalesce.Timer != NULL) {
+    (void) ConCoalesceFlush();
+    gBS->CloseEvent(Coalesce.Timer);
+    Coalesce.Timer = NULL;
+  }
+
   for(i = 0; i < DEVCON_NUM; ++i) {
     if(ConNode[i] != NULL) {
       FreePool(ConNode[i]);
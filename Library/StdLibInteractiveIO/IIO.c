@@ -28,6 +28,8 @@
 #include  "IIOutilities.h"
 #include  "IIOechoCtrl.h"
 
+#include  <Library/StdExtLib.h>
+
 #include <Library/DebugLib.h>
 
 // Instrumentation used for debugging
@@ -44,23 +46,6 @@
   #define R_INSTRUMENT  (void)
 #endif  // IIO_C_DEBUG
 
-static void
-buffer_narrow(const wchar_t *src, char *dest, size_t count)
-{
-  size_t i;
-
-  for (i = 0; i < count; i++) {
-    if (*src > 0xFF) {
-      *dest = '?';
-    } else {
-      *dest = *src;
-    }
-
-    src++;
-    dest++;
-  }
-}
-
 /** Read from an Interactive IO device.
 
   NOTE: If _S_IWTTY is set, the internal buffer contains WIDE characters.
@@ -100,6 +85,21 @@ IIO_Read(
   }
 
   Flags = This->Termio.c_lflag;
+  if(((Flags & ICANON) == 0) && This->InBuf->IsEmpty(This->InBuf)) {
+    /*
+     * Raw fast path. Nothing is buffered and nothing needs line
+     * editing, so read straight from the device, which for redirected
+     * input returns as much as is asked for.
+     */
+    NumRead = filp->f_ops->fo_read(filp, &filp->f_offset,
+                                   MIN(UNICODE_STRING_MAX - 1, BufferSize) *
+                                   sizeof(wchar_t), gMD->UString2);
+    if (NumRead > 0) {
+      buffer_narrow((const wchar_t *)gMD->UString2, (char *) Buffer, NumRead);
+    }
+    return NumRead;
+  }
+
   if(Flags & ICANON) {
     NumRead = IIO_CanonRead(filp);
   }
@@ -137,6 +137,63 @@ IIO_Read(
   return NumRead;
 }
 
+/** Write without output processing.
+
+    Used for redirected output, and for the console when OPOST is off.
+    There is nothing for IIO_WriteOne to do then, so the bytes go straight
+    to the device, widened in chunks for wide devices and verbatim otherwise.
+
+    @param[in]      filp      Pointer to a file descriptor structure.
+    @param[in]      buf       Pointer to the narrow buffer to be output.
+    @param[in]      N         Number of bytes in buf.
+
+    @retval   >=0     Number of bytes consumed from buf.
+    @retval    -1     Nothing could be written.  Reason is in errno.
+**/
+static
+ssize_t
+IIO_WriteRaw(
+  struct __filedes *filp,
+  const char *buf,
+  ssize_t N
+  )
+{
+  ssize_t     NumConsumed;
+  ssize_t     Chunk;
+  ssize_t     Written;
+
+  /*
+   * Output to the console that IIO_WriteOne doesn't see moves the cursor
+   * behind the shadow's back. Redirected output doesn't move it at all.
+   */
+  if(IIO_IsConsole(filp)) {
+    IIO_EndOutput(NULL);
+  }
+
+  if((filp->f_iflags & _S_IWTTY) == 0) {
+    return filp->f_ops->fo_write(filp, NULL, N, buf);
+  }
+
+  NumConsumed = 0;
+  while(NumConsumed < N) {
+    Chunk = MIN(N - NumConsumed, UNICODE_STRING_MAX - 1);
+    buffer_widen(buf + NumConsumed, gMD->UString, Chunk);
+    gMD->UString[Chunk] = 0;
+
+    Written = filp->f_ops->fo_write(filp, NULL, Chunk, gMD->UString);
+    if(Written < 0) {
+      return NumConsumed != 0 ? NumConsumed : -1;
+    }
+
+    NumConsumed += Written;
+    if(Written < Chunk) {
+      break;
+    }
+  }
+
+  return NumConsumed;
+}
+
 /** Handle write to a Terminal (Interactive) device.
 
     Processes characters from buffer buf and writes them to the Terminal device
@@ -176,24 +233,11 @@ IIO_Write(
   cFIFO      *OutBuf;
   ssize_t     NumConsumed;
   size_t      CharLen;
-  UINTN       MaxColumn;
-  UINTN       MaxRow;
   wchar_t     OutChar;
   int         OutMode;
 
   NumConsumed = -1;
 
-  /*
-   * Determine what the current screen size is. Also validates the output device.
-   *
-   * andreiw: even if we're redirecting via a Shell SHELL_FILE_HANDLE object,
-   * we still want to use the "real" ConOut sizing info.
-   */
-  OutMode = IIO_GetOutputSize(filp->MyFD, &MaxColumn, &MaxRow);
-  if (OutMode < 0) {
-    return -1;
-  }
-
   This = filp->devdata;
   if (This == NULL) {
     errno = EINVAL;
@@ -206,14 +250,29 @@ IIO_Write(
     OutBuf = This->OutBuf;
   }
 
-  /*  Set the maximum screen dimensions. */
-  This->MaxColumn = MaxColumn;
-  This->MaxRow    = MaxRow;
+  /*
+   * Without output processing, and nothing left over from a previous
+   * write, skip the cursor queries and per-character work entirely.
+   * Termio is shared by all streams, and O_TTY_INIT on one that is the
+   * console turns OPOST on for all of them, so whether this stream is
+   * redirected has to come from the device.
+   */
+  if((!IIO_IsConsole(filp) || ((This->Termio.c_oflag & OPOST) == 0)) &&
+     OutBuf->IsEmpty(OutBuf)) {
+    return IIO_WriteRaw(filp, buf, N);
+  }
 
-  /*  Record where the cursor is at the beginning of the Output operation. */
-  (void)IIO_GetCursorPosition(filp->MyFD, &This->InitialXY.Column, &This->InitialXY.Row);
-  This->CurrentXY.Column  = This->InitialXY.Column;
-  This->CurrentXY.Row     = This->InitialXY.Row;
+  /*
+   * Determine what the current screen size is and where the cursor is at
+   * the beginning of the Output operation. Also validates the output device.
+   *
+   * andreiw: even if we're redirecting via a Shell SHELL_FILE_HANDLE object,
+   * we still want to use the "real" ConOut sizing info.
+   */
+  OutMode = IIO_BeginOutput(filp, This);
+  if (OutMode < 0) {
+    return -1;
+  }
 
   NumConsumed = 0;
   while(NumConsumed < N) {
@@ -226,10 +285,18 @@ IIO_Write(
         break;
       }
 
+      IIO_EndOutput(NULL);
       return -1; // Ummm?
     }
   }
 
+  /*
+   * IIO_WriteOne only tracks the cursor with OPOST, and what it tracked
+   * is only where the console cursor went if this is the console.
+   */
+  IIO_EndOutput(((This->Termio.c_oflag & OPOST) && IIO_IsConsole(filp)) ?
+                This : NULL);
+
   // At this point, the characters to write are in OutBuf
   CharLen = OutBuf->Copy(OutBuf, gMD->UString, UNICODE_STRING_MAX-1);
 
@@ -329,6 +396,7 @@ IIO_Echo(
     }
 
     (void)OutBuf->Flush(OutBuf, NumWritten);
+    IIO_EndOutput(NULL);
   }
 
   if(EChar == IIO_ECHO_KILL) {
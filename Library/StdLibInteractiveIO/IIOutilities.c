@@ -20,12 +20,32 @@
 
 #include  <assert.h>
 #include  <errno.h>
+#include  <stdarg.h>
 #include  <sys/syslimits.h>
 #include  <sys/termios.h>
 #include  <Device/IIO.h>
 #include  <MainData.h>
 #include  "IIOutilities.h"
 
+#include  <Library/StdExtLib.h>
+
+/*
+ * Shadow of the console geometry and of where IIO's output leaves the
+ * cursor. Shared by all IIO instances writing to the same ConOut, so
+ * that stdout and stderr keep each other's position. Lets IIO_Write
+ * skip QueryMode and the cursor read, which means flushing any output
+ * daConsole is holding back, on every call.
+ */
+static struct {
+  EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL    *Proto;
+  INT32                               Mode;     // Mode->Mode the geometry is for
+  UINTN                               MaxColumn;
+  UINTN                               MaxRow;
+  BOOLEAN                             CursorValid;
+  CURSOR_XY                           Cursor;   // Where our output leaves the cursor
+  CURSOR_XY                           Synced;   // Device cursor when last checked
+} Shadow;
+
 /** Get the low-level UEFI protocol associated with an open file.
 
     @param[in]    fd    File descriptor for an open file.
@@ -142,6 +162,8 @@ IIO_GetCursorPosition (
        ((pStdOut->Oflags & O_ACCMODE) != 0))      // and it is open for output
     {
       // fd is for a TTY or "Interactive IO" device
+      // The device may be holding back output, which would move the cursor.
+      (void) pStdOut->f_ops->fo_flush(pStdOut);
       *Column  = Proto->Mode->CursorColumn;
       *Row     = Proto->Mode->CursorRow;
       if(Proto->Mode->CursorVisible) {
@@ -189,8 +211,16 @@ IIO_SetCursorPosition (
       if(Status == EFI_SUCCESS) {
         This->CurrentXY.Column  = CursorXY->Column;
         This->CurrentXY.Row     = CursorXY->Row;
+        if(Proto == Shadow.Proto) {
+          Shadow.Cursor       = This->CurrentXY;
+          Shadow.Synced       = This->CurrentXY;
+          Shadow.CursorValid  = TRUE;
+        }
         RetVal = 0;
       }
+      else {
+        Shadow.CursorValid = FALSE;
+      }
     }
   }
   return RetVal;
@@ -250,6 +280,136 @@ IIO_GetOutputSize (
   return RetVal;
 }
 
+/** Set up an IIO instance for output, from the shadow state where possible.
+
+    Sets MaxColumn and MaxRow to the screen size and InitialXY and CurrentXY
+    to where the output will start.
+
+    The geometry is queried again only if the device or its mode changed.
+    The cursor is read back from the device only if it is neither where the
+    last output left it, nor where it was before that output, the latter
+    being the case while daConsole holds the output back. Anything else
+    means somebody else moved the cursor.
+
+    @param[in]    filp    Pointer to the output device's file descriptor structure.
+    @param[in]    This    Pointer to the IIO instance.
+
+    @retval   <0    An error occurred.  The reason is in errno and EFIerrno.
+    @retval   >=0   Current output mode
+**/
+int
+EFIAPI
+IIO_BeginOutput (
+  struct __filedes *filp,
+  cIIO             *This
+  )
+{
+  EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL    *Proto;
+  UINTN                               MaxColumn;
+  UINTN                               MaxRow;
+  UINT32                              Column;
+  UINT32                              Row;
+  int                                 OutMode;
+
+  Proto = (EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL *)IIO_GetDeviceProto(filp->MyFD, NULL);
+  if((Proto == NULL) || (Proto != Shadow.Proto) ||
+     (Proto->Mode->Mode != Shadow.Mode)) {
+    OutMode = IIO_GetOutputSize(filp->MyFD, &MaxColumn, &MaxRow);
+    if(OutMode < 0) {
+      Shadow.Proto = NULL;
+      return OutMode;
+    }
+
+    Shadow.Proto        = Proto;
+    Shadow.Mode         = OutMode;
+    Shadow.MaxColumn    = MaxColumn;
+    Shadow.MaxRow       = MaxRow;
+    Shadow.CursorValid  = FALSE;
+  }
+
+  This->MaxColumn = Shadow.MaxColumn;
+  This->MaxRow    = Shadow.MaxRow;
+
+  if(Shadow.CursorValid) {
+    Column  = Proto->Mode->CursorColumn;
+    Row     = Proto->Mode->CursorRow;
+    if((Column == Shadow.Cursor.Column) && (Row == Shadow.Cursor.Row)) {
+      Shadow.Synced = Shadow.Cursor;
+    }
+    else if((Column != Shadow.Synced.Column) || (Row != Shadow.Synced.Row)) {
+      Shadow.CursorValid = FALSE;
+    }
+  }
+
+  if(!Shadow.CursorValid) {
+    if(IIO_GetCursorPosition(filp->MyFD, &Shadow.Cursor.Column, &Shadow.Cursor.Row) >= 0) {
+      Shadow.Synced       = Shadow.Cursor;
+      Shadow.CursorValid  = TRUE;
+    }
+  }
+
+  This->InitialXY = Shadow.Cursor;
+  This->CurrentXY = Shadow.Cursor;
+  return Shadow.Mode;
+}
+
+/** Record where an output operation left the cursor.
+
+    @param[in]    This    Pointer to the IIO instance, or NULL if the output
+                          went around IIO_WriteOne and the cursor position
+                          is not known.
+**/
+void
+EFIAPI
+IIO_EndOutput (
+  cIIO             *This
+  )
+{
+  if(This != NULL) {
+    Shadow.Cursor = This->CurrentXY;
+  }
+  else {
+    Shadow.CursorValid = FALSE;
+  }
+}
+
+/*  Issues an ioctl straight to the device, bypassing the fd table. */
+static int
+IIO_DeviceIoctl (
+  struct __filedes *filp,
+  ULONGN            cmd,
+  ...
+  )
+{
+  va_list   argp;
+  int       retval;
+
+  va_start(argp, cmd);
+  retval = filp->f_ops->fo_ioctl(filp, cmd, argp);
+  va_end(argp);
+  return retval;
+}
+
+/** Determine whether output to a device reaches the actual console.
+
+    The termios state is per IIO instance, and so shared by stdout and
+    stderr whether redirected or not, so it can't answer this. daConsole
+    knows, through CONIOCISCON.
+
+    @param[in]    filp    Pointer to the output device's file descriptor structure.
+
+    @retval   TRUE    filp is the console, or the device can't tell.
+    @retval   FALSE   The Shell redirected filp to a file or a pipe.
+**/
+BOOLEAN
+EFIAPI
+IIO_IsConsole (
+  struct __filedes *filp
+  )
+{
+  return (BOOLEAN) (IIO_DeviceIoctl(filp, CONIOCISCON) != 0);
+}
+
 /** Calculate the number of character positions between two X/Y coordinate pairs.
 
     Using the current output device characteristics, calculate the number of
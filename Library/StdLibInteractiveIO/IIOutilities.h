@@ -106,6 +106,45 @@ IIO_GetOutputSize (
   UINTN    *Row
 );
 
+/** Set up an IIO instance for output, from the shadow state where possible.
+
+    @param[in]    filp    Pointer to the output device's file descriptor structure.
+    @param[in]    This    Pointer to the IIO instance.
+
+    @retval   <0    An error occurred.  The reason is in errno and EFIerrno.
+    @retval   >=0   Current output mode
+**/
+int
+EFIAPI
+IIO_BeginOutput (
+  struct __filedes *filp,
+  cIIO             *This
+  );
+
+/** Record where an output operation left the cursor.
+
+    @param[in]    This    Pointer to the IIO instance, or NULL if the cursor
+                          position is not known.
+**/
+void
+EFIAPI
+IIO_EndOutput (
+  cIIO             *This
+  );
+
+/** Determine whether output to a device reaches the actual console.
+
+    @param[in]    filp    Pointer to the output device's file descriptor structure.
+
+    @retval   TRUE    filp is the console, or the device can't tell.
+    @retval   FALSE   The Shell redirected filp to a file or a pipe.
+**/
+BOOLEAN
+EFIAPI
+IIO_IsConsole (
+  struct __filedes *filp
+  );
+
 /** Calculate the number of character positions between two X/Y coordinate pairs.
 
     Using the current output device characteristics, calculate the number of
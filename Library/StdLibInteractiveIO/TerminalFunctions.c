@@ -231,17 +231,36 @@ tcsetattr (
 
 /** Transmit pending output.
 
-    Function is not yet implemented for UEFI.
+    Hands anything the device is holding back (e.g. the console's write
+    combining) to the hardware.
 
-    @param[in]  fd        Ignored
+    @param[in]  fd        The file descriptor for an open interactive IO device.
 
-    @retval -1    This function is not yet supported.  errno is set to ENOTSUP.
+    @retval 0     The operation completed successfully.
+    @retval -1    An error occured and errno is set to indicate the error.
+                    * EBADF - The fd argument is not a valid file descriptor.
+                    * ENOTTY - The file associated with fd is not an interactive IO device.
 **/
 int
 tcdrain (int fd)
 {
-  errno = ENOTSUP;
-  return -1;
+  struct __filedes *filp;
+
+  if(!ValidateFD( fd, VALID_OPEN)) {
+    errno = EBADF;
+    return -1;
+  }
+
+  filp = &gMD->fdarray[fd];
+  if((filp->f_iflags & _S_ITTY) == 0) {
+    errno = ENOTTY;
+    return -1;
+  }
+
+  if((filp->Oflags & O_ACCMODE) != O_RDONLY) {
+    (void) filp->f_ops->fo_flush(filp);
+  }
+  return 0;
 }
 
 /** Suspend or restart the transmission or reception of data.
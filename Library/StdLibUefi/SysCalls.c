@@ -17,8 +17,11 @@
 #include  <Library/UefiLib.h>
 #include  <Library/UefiBootServicesTableLib.h>
 #include  <Library/BaseLib.h>
+#include  <Library/BaseMemoryLib.h>
 #include  <Library/MemoryAllocationLib.h>
 #include  <Library/ShellLib.h>
+#include  <Protocol/SimpleFileSystem.h>
+#include  <Protocol/SimpleTextIn.h>
 
 #include  <LibConfig.h>
 #include  <sys/EfiCdefs.h>
@@ -34,6 +37,7 @@
 #include  <sys/stat.h>
 #include  <sys/syslimits.h>
 #include  <sys/filio.h>
+#include  <sys/uio.h>
 #include  <Efi/SysEfi.h>
 #include  <unistd.h>
 #include  <kfile.h>
@@ -41,9 +45,194 @@
 #include  <Device/IIO.h>
 #include  <MainData.h>
 #include  <extern.h>
+#include  <Library/StdExtLib.h>
+
+#include  "Trace.h"
 
 /* EFI versions of BSD system calls used in stdio */
 
+/*
+  64-bit FNV-1a, used to synthesize st_dev and st_ino, which also tell
+  files apart for mmap.
+*/
+#define FNV64_OFFSET  0xcbf29ce484222325ULL
+#define FNV64_PRIME   0x100000001b3ULL
+
+static UINT64
+Fnv64(UINT64 Hash, const void *Data, UINTN Size)
+{
+  const UINT8 *p = Data;
+
+  while (Size--) {
+    Hash ^= *p++;
+    Hash *= FNV64_PRIME;
+  }
+  return Hash;
+}
+
+/*
+  Descriptor allocation bitmap, a set bit means the fd is in use. gMD->fdarray
+  is sized by OPEN_MAX in MainData.h, so the table can't grow from here, but
+  FdTableSize is what everything in this file checks against.
+
+  Slots are marked in use by FdMarkBusy when handed out, and freed by FdRelease
+  when closed. The console sets up 0-2 itself, in its constructor, without
+  FindFreeFD, so on first use the bitmap is seeded from f_iflags (FdSeed).
+  FindFreeFD still double checks f_iflags for anything else taken behind our
+  back.
+*/
+#define FD_WORDS    ((OPEN_MAX + 31) / 32)
+
+static UINT32   FdBusy[FD_WORDS];
+static BOOLEAN  FdSeeded;
+static int      FdTableSize = OPEN_MAX;
+
+/*
+  Device positions of shell files. For these, devdata is the
+  EFI_FILE_PROTOCOL, and fo_read/fo_write/fo_lseek keep its position in
+  step with f_offset, costing a SetPosition per lseek.
+
+  Once an fd is used for pread/pwrite, it's switched to FD_POS_TRACKED,
+  where FdPos records where the EFI_FILE_PROTOCOL actually is. lseek then
+  only moves f_offset, and pread/pwrite/read/write issue a SetPosition
+  only if the position has to change.
+
+  Dup'd fds share the EFI_FILE_PROTOCOL, so dup brings the position back
+  in step with f_offset and stops tracking.
+*/
+#define FD_POS_NONE       0     // Not a shell file, or can't be tracked
+#define FD_POS_SHELL      1     // Shell file, position follows f_offset
+#define FD_POS_TRACKED    2     // Shell file, position is in FdPos
+
+#define FD_POS_UNKNOWN    MAX_UINT64
+
+static UINT8    FdPosState[OPEN_MAX];
+static UINT64   FdPos[OPEN_MAX];
+
+/*  Synthesized st_dev/st_ino of shell files (see PathIdentify), 0 if not known. */
+static UINT64   FdDev[OPEN_MAX];
+static UINT64   FdIno[OPEN_MAX];
+
+static void
+FdMarkBusy (int fd)
+{
+  FdBusy[fd / 32] |= 1U << (fd % 32);
+}
+
+static void
+FdRelease (int fd)
+{
+  gMD->fdarray[fd].f_iflags = 0;
+  gMD->fdarray[fd].RefCount = 0;
+  FdBusy[fd / 32] &= ~(1U << (fd % 32));
+  FdPosState[fd] = FD_POS_NONE;
+  FdDev[fd] = 0;
+  FdIno[fd] = 0;
+}
+
+/*  Marks the fds opened before the bitmap was first used as busy. */
+static void
+FdSeed (void)
+{
+  int     fd;
+
+  if (!FdSeeded) {
+    FdSeeded = TRUE;
+    for (fd = 0; fd < FdTableSize; fd++) {
+      if (gMD->fdarray[fd].f_iflags != 0) {
+        FdMarkBusy(fd);
+      }
+    }
+  }
+}
+
+/*  Returns the lowest fd >= MinFd not marked busy, or -1. */
+static int
+FdNextFree (int MinFd)
+{
+  UINT32  Word;
+  int     i;
+
+  FdSeed();
+  for (i = MinFd / 32; i < FD_WORDS; i++) {
+    Word = ~FdBusy[i];
+    if (i == MinFd / 32) {
+      Word &= ~((1U << (MinFd % 32)) - 1);
+    }
+    if (Word != 0) {
+      i = i * 32 + LowBitSet32(Word);
+      return i < FdTableSize ? i : -1;
+    }
+  }
+  return -1;
+}
+
+/*  Returns the lowest fd >= MinFd marked busy, or -1. */
+static int
+FdNextBusy (int MinFd)
+{
+  UINT32  Word;
+  int     i;
+
+  if (MinFd >= FdTableSize) {
+    return -1;
+  }
+
+  FdSeed();
+  for (i = MinFd / 32; i < FD_WORDS; i++) {
+    Word = FdBusy[i];
+    if (i == MinFd / 32) {
+      Word &= ~((1U << (MinFd % 32)) - 1);
+    }
+    if (Word != 0) {
+      i = i * 32 + LowBitSet32(Word);
+      return i < FdTableSize ? i : -1;
+    }
+  }
+  return -1;
+}
+
+/** Returns the size of the descriptor table.
+
+    @return   One more than the largest fd that may be allocated.
+**/
+int
+getdtablesize (void)
+{
+  return FdTableSize;
+}
+
+/*  Moves a tracked fd's EFI_FILE_PROTOCOL to Position, if not already there. */
+static int
+FdSetPosition (int fd, UINT64 Position)
+{
+  EFI_FILE_PROTOCOL  *File;
+  EFI_STATUS          Status;
+
+  if (FdPos[fd] != Position) {
+    File = (EFI_FILE_PROTOCOL *) gMD->fdarray[fd].devdata;
+    Status = File->SetPosition(File, Position);
+    if (EFI_ERROR(Status)) {
+      FdPos[fd] = FD_POS_UNKNOWN;
+      EFIerrno = Status;
+      errno = EIO;
+      return -1;
+    }
+    FdPos[fd] = Position;
+  }
+  return 0;
+}
+
+/*  Puts a tracked fd back to having its position follow f_offset. */
+static void
+FdUntrack (int fd)
+{
+  if (FdPosState[fd] == FD_POS_TRACKED) {
+    (void) FdSetPosition(fd, gMD->fdarray[fd].f_offset);
+  }
+  FdPosState[fd] = FD_POS_NONE;
+}
+
 /*  Validate that fd refers to a valid file descriptor.
     IsOpen is interpreted as follows:
       - Positive  fd must be OPEN
@@ -59,7 +248,7 @@ ValidateFD( int fd, int IsOpen)
   struct __filedes    *filp;
   BOOLEAN   retval = FALSE;
 
-  if((fd >= 0) && (fd < OPEN_MAX)) {
+  if((fd >= 0) && (fd < FdTableSize)) {
     filp = &gMD->fdarray[fd];
     retval = TRUE;
     if(IsOpen >= 0) {
@@ -78,6 +267,9 @@ ValidateFD( int fd, int IsOpen)
   Returns the first free File Descriptor greater than or equal to the,
   already validated, fd specified by Minfd.
 
+  Uses the FdBusy bitmap, so this is a handful of word operations
+  instead of a walk over fdarray.
+
   @return   Returns -1 if there are no free FDs.  Otherwise returns the
             found fd.
 */
@@ -85,20 +277,20 @@ int
 FindFreeFD( int MinFd )
 {
   struct __filedes    *Mfd;
-  int i;
-  int fd = -1;
+  int                  i;
 
   Mfd = gMD->fdarray;
 
   // Get an available fd
-  for(i=MinFd; i < OPEN_MAX; ++i) {
+  for (i = FdNextFree(MinFd); i >= 0; i = FdNextFree(i + 1)) {
+    FdMarkBusy(i);
     if(Mfd[i].f_iflags == 0) {
       Mfd[i].f_iflags = FIF_LARVAL; // Temporarily mark this fd as reserved
-      fd = i;
-      break;
+      return i;
     }
+    // Opened without FindFreeFD, now it's marked.
   }
-  return fd;
+  return -1;
 }
 
 /* Mark that an open file is to be deleted when closed. */
@@ -160,7 +352,7 @@ IsDupFd( int fd)
   if(ValidateFD( fd, VALID_OPEN )) {
     FileOps = gMD->fdarray[fd].f_ops;
     DevData = gMD->fdarray[fd].devdata;
-    for(i=0; i < OPEN_MAX; ++i) {
+    for(i = FdNextBusy(0); i >= 0; i = FdNextBusy(i + 1)) {
       if(i == fd)   continue;
       if(ValidateFD( i, VALID_OPEN )) {   // TRUE if fd is valid and OPEN
         if((gMD->fdarray[i].f_ops == FileOps)
@@ -206,8 +398,11 @@ _closeX  (int fd, int NewState)
           retval = Fp->f_ops->fo_close( Fp);
         }
       }
-      Fp->f_iflags = NewState;    // Close this FD or reserve it
-      Fp->RefCount = 0;           // No one using this FD
+      FdRelease(fd);              // Close this FD...
+      if(NewState != 0) {
+        Fp->f_iflags = NewState;  // ...or reserve it
+        FdMarkBusy(fd);
+      }
     }
     else {
       --Fp->RefCount;   /* One less user of this FD */
@@ -235,7 +430,13 @@ _closeX  (int fd, int NewState)
 int
 close  (int fd)
 {
-  return _closeX(fd, 0);
+  int   retval;
+  TRACE_DECLARE(Stamp);
+
+  TRACE_BEGIN(Stamp);
+  retval = _closeX(fd, 0);
+  TRACE_END(TraceClose, Stamp, retval);
+  return retval;
 }
 
 /** Delete the file specified by path.
@@ -263,8 +464,7 @@ unlink (const char *path)
     if(Fp->f_ops->fo_delete != NULL) {
       retval = Fp->f_ops->fo_delete(Fp);
   }
-    Fp->f_iflags = 0;    // Close this FD
-    Fp->RefCount = 0;    // No one using this FD
+    FdRelease(fd);       // Close this FD
   }
   return retval;
 }
@@ -375,7 +575,12 @@ fcntl     (int fildes, int cmd, ...)
           /* temp is now a valid fd reserved for further use
              so copy fd into temp.
           */
+          FdUntrack(fildes);
           (void)memcpy(&gMD->fdarray[temp], MyFd, sizeof(struct __filedes));
+          gMD->fdarray[temp].MyFD = (UINT16)temp;
+          FdPosState[temp] = FD_POS_NONE;
+          FdDev[temp] = FdDev[fildes];
+          FdIno[temp] = FdIno[fildes];
           retval = temp;
         }
         else {
@@ -472,10 +677,20 @@ dup2    (int fildes, int fildes2)
     retval = fildes2;
     if( fildes != fildes2) {
       if(ValidateFD( fildes2, VALID_DONT_CARE)) {
-        gMD->fdarray[fildes2].f_iflags = FIF_LARVAL;  // Mark the file closed, but reserved
+        if(ValidateFD( fildes2, VALID_OPEN)) {
+          (void)_closeX(fildes2, FIF_LARVAL);         // Close the file, but keep it reserved
+        }
+        else {
+          gMD->fdarray[fildes2].f_iflags = FIF_LARVAL;  // Mark the file closed, but reserved
+          FdMarkBusy(fildes2);
+        }
+        FdUntrack(fildes);
         (void)memcpy(&gMD->fdarray[fildes2],      // Duplicate fildes into fildes2
                      &gMD->fdarray[fildes], sizeof(struct __filedes));
         gMD->fdarray[fildes2].MyFD = (UINT16)fildes2;
+        FdPosState[fildes2] = FD_POS_NONE;
+        FdDev[fildes2] = FdDev[fildes];
+        FdIno[fildes2] = FdIno[fildes];
       }
       else {
         errno = EBADF;
@@ -527,16 +742,34 @@ lseek (int fd, __off_t offset, int how)
   __off_t             CurPos = -1;
 //  RETURN_STATUS       Status = RETURN_SUCCESS;
   struct __filedes   *filp;
+  TRACE_DECLARE(Stamp);
 
+  TRACE_BEGIN(Stamp);
   EFIerrno = RETURN_SUCCESS;    // In case of error without an EFI call
 
   if( how == SEEK_SET || how == SEEK_CUR  || how == SEEK_END) {
     if(ValidateFD( fd, VALID_OPEN)) {
       filp = &gMD->fdarray[fd];
       // Both of our parameters have been verified as valid
-      CurPos = filp->f_ops->fo_lseek( filp, offset, how);
-      if(CurPos >= 0) {
-        filp->f_offset = CurPos;
+      if((FdPosState[fd] == FD_POS_TRACKED) && (how != SEEK_END)) {
+        // The device position catches up on the next I/O
+        CurPos = (how == SEEK_SET) ? offset : filp->f_offset + offset;
+        if(CurPos >= 0) {
+          filp->f_offset = CurPos;
+        }
+        else {
+          errno = EINVAL;
+          CurPos = -1;
+        }
+      }
+      else {
+        CurPos = filp->f_ops->fo_lseek( filp, offset, how);
+        if(CurPos >= 0) {
+          filp->f_offset = CurPos;
+        }
+        if(FdPosState[fd] == FD_POS_TRACKED) {
+          FdPos[fd] = (CurPos >= 0) ? (UINT64) CurPos : FD_POS_UNKNOWN;
+        }
       }
     }
     else {
@@ -546,9 +779,422 @@ lseek (int fd, __off_t offset, int how)
   else {
     errno = EINVAL;   // Invalid how argument
   }
+  TRACE_END(TraceLseek, Stamp, CurPos);
   return CurPos;
 }
 
+/*
+  ParsePath() converts and normalizes the whole path, looks up the device
+  node, and allocates the results, on every call. What it does is almost
+  entirely determined by the mapping prefix (e.g. "fs0:" or "stdin:") and
+  by the path being absolute or relative. So the results are cached per
+  prefix, and for "simple" paths the full wide path is put together
+  straight from the cached prefix, without calling ParsePath or
+  allocating anything.
+
+  A path is simple if it's printable ASCII, and has no "." or ".."
+  components or repeated or trailing separators, i.e. nothing that
+  normalization could change beyond turning '/' into '\'. The cache
+  learns a prefix from a ParsePath call on a simple path, and only if
+  ParsePath did exactly that.
+*/
+#define PATH_CACHE_SIZE     8
+#define PATH_PREFIX_MAX     32
+
+typedef struct {
+  char          Prefix[PATH_PREFIX_MAX];    // Up to and including ':', or ""
+  BOOLEAN       Absolute;                   // Rest starts with a separator
+  UINTN         Stamp;                      // LRU, 0 means unused
+  wchar_t       WPrefix[PATH_PREFIX_MAX];   // What ParsePath made of Prefix
+  UINTN         WPrefixLen;
+  wchar_t      *MPath;                      // Owned by the cache, or NULL
+  DeviceNode   *Node;
+  int           Instance;
+} PATH_CACHE_ENTRY;
+
+typedef struct {
+  wchar_t      *Path;
+  wchar_t      *MPath;
+  DeviceNode   *Node;
+  int           Instance;
+  BOOLEAN       Allocated;    // Path and MPath came from ParsePath
+} PARSED_PATH;
+
+static PATH_CACHE_ENTRY   PathCache[PATH_CACHE_SIZE];
+static UINTN              PathCacheStamp;
+static wchar_t            PathCacheBuf[PATH_MAX];
+
+static void
+PathCacheFlush (void)
+{
+  int   i;
+
+  for (i = 0; i < PATH_CACHE_SIZE; i++) {
+    free(PathCache[i].MPath);
+    PathCache[i].MPath = NULL;
+    PathCache[i].Stamp = 0;
+  }
+}
+
+/*  Splits path into the mapping prefix and the rest, returning the length
+    of the prefix, or -1 if the rest isn't simple (see above).
+*/
+static int
+PathSplit (const char *path, BOOLEAN *Absolute)
+{
+  const char   *p;
+  const char   *Rest;
+  char          Prev;
+
+  Rest = strchr(path, ':');
+  Rest = (Rest == NULL) ? path : Rest + 1;
+  if ((Rest - path) >= PATH_PREFIX_MAX || *Rest == '\0') {
+    return -1;
+  }
+
+  *Absolute = (*Rest == '/' || *Rest == '\\');
+  Prev = '/';
+  for (p = Rest; *p != '\0'; Prev = *p++) {
+    if (*p < 0x20 || *p > 0x7e || *p == ':') {
+      return -1;
+    }
+    if (Prev == '/' || Prev == '\\') {
+      if (p != Rest && (*p == '/' || *p == '\\')) {
+        return -1;
+      }
+      if (*p == '.') {
+        return -1;
+      }
+    }
+  }
+  if (Prev == '/' || Prev == '\\') {
+    return -1;
+  }
+  return (int) (Rest - path);
+}
+
+static void
+PathRelease (PARSED_PATH *Parsed)
+{
+  if (Parsed->Allocated) {
+    free(Parsed->Path);
+    free(Parsed->MPath);
+  }
+}
+
+/*  ParsePath, via the prefix cache. The results in Parsed must be released
+    with PathRelease, and are only valid until the next PathLookup.
+*/
+static RETURN_STATUS
+PathLookup (const char *path, PARSED_PATH *Parsed)
+{
+  PATH_CACHE_ENTRY   *Entry;
+  PATH_CACHE_ENTRY   *Victim;
+  RETURN_STATUS       Status;
+  BOOLEAN             Absolute;
+  UINTN               RestLen;
+  UINTN               Len;
+  UINTN               Index;
+  int                 PrefixLen;
+  int                 i;
+
+  PrefixLen = PathSplit(path, &Absolute);
+  if (PrefixLen >= 0) {
+    RestLen = strlen(path + PrefixLen);
+    for (i = 0; i < PATH_CACHE_SIZE; i++) {
+      Entry = &PathCache[i];
+      if (Entry->Stamp == 0 || Entry->Absolute != Absolute ||
+          strncmp(Entry->Prefix, path, PrefixLen) != 0 ||
+          Entry->Prefix[PrefixLen] != '\0') {
+        continue;
+      }
+      if (Entry->WPrefixLen + RestLen >= PATH_MAX) {
+        break;
+      }
+
+      CopyMem(PathCacheBuf, Entry->WPrefix, Entry->WPrefixLen * sizeof(wchar_t));
+      for (Index = 0; Index <= RestLen; Index++) {
+        PathCacheBuf[Entry->WPrefixLen + Index] =
+          path[PrefixLen + Index] == '/' ? L'\\' : path[PrefixLen + Index];
+      }
+
+      Entry->Stamp = ++PathCacheStamp;
+      Parsed->Path = PathCacheBuf;
+      Parsed->MPath = Entry->MPath;
+      Parsed->Node = Entry->Node;
+      Parsed->Instance = Entry->Instance;
+      Parsed->Allocated = FALSE;
+      return RETURN_SUCCESS;
+    }
+  }
+
+  Parsed->Instance = 0;
+  Parsed->MPath = NULL;
+  Parsed->Allocated = TRUE;
+  Status = ParsePath(path, &Parsed->Path, &Parsed->Node,
+                     &Parsed->Instance, &Parsed->MPath);
+  if (Status != RETURN_SUCCESS) {
+    Parsed->Path = NULL;    // Not ours to free, like before
+    return Status;
+  }
+  if (PrefixLen < 0) {
+    return Status;
+  }
+
+  /*
+   * Learn the prefix, if ParsePath did nothing to the rest but
+   * flip the separators.
+   */
+  Len = StrLen(Parsed->Path);
+  if (Len < RestLen || Len - RestLen >= PATH_PREFIX_MAX) {
+    return Status;
+  }
+  for (Index = 0; Index < RestLen; Index++) {
+    if (Parsed->Path[Len - RestLen + Index] !=
+        (path[PrefixLen + Index] == '/' ? L'\\' : path[PrefixLen + Index])) {
+      return Status;
+    }
+  }
+
+  Victim = &PathCache[0];
+  for (i = 1; i < PATH_CACHE_SIZE; i++) {
+    if (PathCache[i].Stamp < Victim->Stamp) {
+      Victim = &PathCache[i];
+    }
+  }
+
+  free(Victim->MPath);
+  Victim->MPath = NULL;
+  if (Parsed->MPath != NULL) {
+    Len = StrSize(Parsed->MPath);
+    Victim->MPath = malloc(Len);
+    if (Victim->MPath == NULL) {
+      Victim->Stamp = 0;
+      return Status;
+    }
+    CopyMem(Victim->MPath, Parsed->MPath, Len);
+  }
+
+  memcpy(Victim->Prefix, path, PrefixLen);
+  Victim->Prefix[PrefixLen] = '\0';
+  Victim->Absolute = Absolute;
+  Victim->WPrefixLen = StrLen(Parsed->Path) - RestLen;
+  CopyMem(Victim->WPrefix, Parsed->Path, Victim->WPrefixLen * sizeof(wchar_t));
+  Victim->Node = Parsed->Node;
+  Victim->Instance = Parsed->Instance;
+  Victim->Stamp = ++PathCacheStamp;
+  return Status;
+}
+
+/*
+  st_dev and st_ino for shell files. UEFI has no notion of device or
+  inode numbers, but tools like FTS need them for cycle detection and
+  FTS_XDEV.
+
+  st_dev is a hash of the device path of the file system behind the
+  mapping, so aliases like fs0: and blk0: for the same volume agree.
+  Resolving a mapping to a device path is by far the expensive part,
+  so that's cached per mapping name, like ParsePath results are above.
+
+  st_ino continues the same hash over the normalized, upper-cased path
+  within the volume. FAT does not expose cluster numbers through
+  EFI_FILE_INFO, so a path hash is the best we can do. Being a running
+  hash, the st_ino of a directory can be extended with a name inside
+  it, which is what fstatat does.
+*/
+#define ID_CACHE_SIZE   8
+
+typedef struct {
+  CHAR16        Map[PATH_PREFIX_MAX];       // Upper-cased, with the ':'
+  UINT64        Dev;
+  UINTN         Stamp;                      // LRU, 0 means unused
+} ID_CACHE_ENTRY;
+
+static ID_CACHE_ENTRY     IdCache[ID_CACHE_SIZE];
+static UINTN              IdCacheStamp;
+static CHAR16             IdPathBuf[PATH_MAX];
+static CHAR16             IdPathIn[PATH_MAX];
+
+static BOOLEAN
+IdDevLookup (const CHAR16 *Map, UINT64 *Dev)
+{
+  ID_CACHE_ENTRY             *Victim;
+  EFI_DEVICE_PATH_PROTOCOL   *MapDp;
+  EFI_DEVICE_PATH_PROTOCOL   *Dp;
+  EFI_HANDLE                  Handle;
+  EFI_STATUS                  Status;
+  int                         i;
+
+  for (i = 0; i < ID_CACHE_SIZE; i++) {
+    if (IdCache[i].Stamp != 0 && StrCmp(IdCache[i].Map, Map) == 0) {
+      IdCache[i].Stamp = ++IdCacheStamp;
+      *Dev = IdCache[i].Dev;
+      return TRUE;
+    }
+  }
+
+  MapDp = (EFI_DEVICE_PATH_PROTOCOL *) gEfiShellProtocol->GetDevicePathFromMap(Map);
+  if (MapDp == NULL) {
+    return FALSE;
+  }
+
+  Dp = MapDp;
+  Status = gBS->LocateDevicePath(&gEfiSimpleFileSystemProtocolGuid,
+                                 &Dp, &Handle);
+  if (EFI_ERROR(Status)) {
+    return FALSE;
+  }
+
+  Victim = &IdCache[0];
+  for (i = 1; i < ID_CACHE_SIZE; i++) {
+    if (IdCache[i].Stamp < Victim->Stamp) {
+      Victim = &IdCache[i];
+    }
+  }
+
+  StrCpyS(Victim->Map, PATH_PREFIX_MAX, Map);
+  Victim->Dev = Fnv64(FNV64_OFFSET, MapDp, (UINTN) Dp - (UINTN) MapDp);
+  Victim->Stamp = ++IdCacheStamp;
+  *Dev = Victim->Dev;
+  return TRUE;
+}
+
+/*  Appends the components of Path to the Len characters of normalized
+    path in IdPathBuf, upper-casing them (FAT) and resolving "." and "..",
+    so that "\a\\b\" and "\A\x\..\b" are the same file. With Rooted
+    FALSE, ".." may not go above what's already there. Returns the new
+    length, or -1.
+*/
+static int
+IdPathAppend (int Len, const CHAR16 *Path, BOOLEAN Rooted)
+{
+  const CHAR16 *Comp;
+  int           CompLen;
+  int           i;
+
+  while (*Path != L'\0') {
+    while (*Path == L'\\' || *Path == L'/') {
+      Path++;
+    }
+    for (Comp = Path; *Path != L'\0' && *Path != L'\\' && *Path != L'/'; Path++);
+    CompLen = (int) (Path - Comp);
+
+    if (CompLen == 0 || (CompLen == 1 && Comp[0] == L'.')) {
+      continue;
+    }
+
+    if (CompLen == 2 && Comp[0] == L'.' && Comp[1] == L'.') {
+      if (Len == 0 && !Rooted) {
+        return -1;
+      }
+      while (Len > 0 && IdPathBuf[--Len] != L'\\');
+      continue;
+    }
+
+    if (Len + 1 + CompLen >= PATH_MAX) {
+      return -1;
+    }
+    IdPathBuf[Len++] = L'\\';
+    for (i = 0; i < CompLen; i++) {
+      IdPathBuf[Len++] = CharToUpper(Comp[i]);
+    }
+  }
+  return Len;
+}
+
+/*  Converts path to wide in IdPathIn. */
+static BOOLEAN
+IdPathWiden (const char *path)
+{
+  UINTN   Index;
+
+  for (Index = 0; path[Index] != '\0'; Index++) {
+    if (Index + 1 >= PATH_MAX) {
+      return FALSE;
+    }
+    IdPathIn[Index] = (UINT8) path[Index];
+  }
+  IdPathIn[Index] = L'\0';
+  return TRUE;
+}
+
+/*  Computes st_dev and st_ino for path, relative paths being relative
+    to the Shell current directory. Returns FALSE if path isn't on a
+    file system mapping.
+*/
+static BOOLEAN
+PathIdentify (const char *path, UINT64 *Dev, UINT64 *Ino)
+{
+  CHAR16         Map[PATH_PREFIX_MAX];
+  const CHAR16  *Cwd;
+  const char    *Rest;
+  UINTN          Index;
+  int            Len;
+
+  if (gEfiShellProtocol == NULL) {
+    return FALSE;
+  }
+
+  Rest = strchr(path, ':');
+  if (Rest != NULL) {
+    if (Rest - path + 1 >= PATH_PREFIX_MAX) {
+      return FALSE;
+    }
+    for (Index = 0; path + Index <= Rest; Index++) {
+      Map[Index] = CharToUpper((UINT8) path[Index]);
+    }
+    Rest++;
+  } else {
+    Cwd = gEfiShellProtocol->GetCurDir(NULL);
+    if (Cwd == NULL) {
+      return FALSE;
+    }
+    for (Index = 0; Cwd[Index] != L':'; Index++) {
+      if (Cwd[Index] == L'\0' || Index + 2 >= PATH_PREFIX_MAX) {
+        return FALSE;
+      }
+      Map[Index] = CharToUpper(Cwd[Index]);
+    }
+    Map[Index++] = L':';
+    Rest = path;
+  }
+  Map[Index] = L'\0';
+
+  if (!IdDevLookup(Map, Dev)) {
+    return FALSE;
+  }
+
+  Len = 0;
+  if (*Rest != '/' && *Rest != '\\') {
+    Cwd = gEfiShellProtocol->GetCurDir(Map);
+    if (Cwd != NULL && (Cwd = StrStr(Cwd, L":")) != NULL) {
+      Len = IdPathAppend(0, Cwd + 1, TRUE);
+    }
+  }
+
+  if (Len < 0 || !IdPathWiden(Rest)) {
+    return FALSE;
+  }
+
+  Len = IdPathAppend(Len, IdPathIn, TRUE);
+  if (Len < 0) {
+    return FALSE;
+  }
+
+  *Ino = Fnv64(*Dev, IdPathBuf, Len * sizeof(CHAR16));
+  return TRUE;
+}
+
+/*  Fills in st_dev and st_ino known for fd, if any. */
+static void
+StatSynthesizeIds (int fd, struct stat *statbuf)
+{
+  if (FdDev[fd] != 0) {
+    statbuf->st_dev = (dev_t) (FdDev[fd] ^ (FdDev[fd] >> 32));
+    statbuf->st_ino = (ino_t) FdIno[fd];
+  }
+}
+
 /** The directory path is created with the access permissions specified by
     perms.
 
@@ -563,16 +1209,14 @@ lseek (int fd, __off_t offset, int how)
 int
 mkdir (const char *path, __mode_t perms)
 {
-  wchar_t            *NewPath;
-  DeviceNode         *Node;
+  PARSED_PATH         Parsed;
   char               *GenI;
   RETURN_STATUS       Status;
-  int                 Instance  = 0;
   int                 retval = 0;
 
-  Status = ParsePath(path, &NewPath, &Node, &Instance, NULL);
+  Status = PathLookup(path, &Parsed);
   if(Status == RETURN_SUCCESS) {
-    GenI = Node->InstanceList;
+    GenI = Parsed.Node->InstanceList;
     if(GenI == NULL) {
       errno   = EPERM;
       retval  = -1;
@@ -581,11 +1225,11 @@ mkdir (const char *path, __mode_t perms)
       //GenI += (Instance * Node->InstanceSize);
       retval = ((GenericInstance *)GenI)->Abstraction.fo_mkdir( path, perms);
       }
-    free(NewPath);
     }
   else {
     retval = -1;
   }
+  PathRelease(&Parsed);
   return retval;
 }
 
@@ -660,20 +1304,19 @@ open(
   int mode
   )
 {
-  wchar_t              *NewPath;
-  wchar_t              *MPath;
-  DeviceNode           *Node;
+  PARSED_PATH           Parsed;
   struct __filedes     *filp;
-  int                   Instance  = 0;
   RETURN_STATUS         Status;
   UINT32                OpenMode;
   int                   fd = -1;
   int                   doresult;
+  TRACE_DECLARE(Stamp);
 
-  Status = ParsePath(path, &NewPath, &Node, &Instance, &MPath);
+  TRACE_BEGIN(Stamp);
+  Status = PathLookup(path, &Parsed);
   if(Status == RETURN_SUCCESS) {
-    if ((Node == NULL)               ||
-        (Node->InstanceList == NULL))
+    if ((Parsed.Node == NULL)               ||
+        (Parsed.Node->InstanceList == NULL))
     {
       errno   = EPERM;
     }
@@ -694,9 +1337,10 @@ open(
         filp->Oflags = oflags;
         filp->Omode = mode;
 
-        doresult = Node->OpenFunc(Node, filp, Instance, NewPath, MPath);
+        doresult = Parsed.Node->OpenFunc(Parsed.Node, filp, Parsed.Instance,
+                                         Parsed.Path, Parsed.MPath);
         if(doresult < 0) {
-          filp->f_iflags = 0;   // Release this FD
+          FdRelease(fd);        // Release this FD
           fd = -1;              // Indicate an error
         }
         else {
@@ -707,18 +1351,70 @@ open(
           filp->f_iflags |= OpenMode;
           ++filp->RefCount;
           FILE_SET_MATURE(filp);
+
+          if((Parsed.Node == daDefaultDevice) && ((oflags & O_APPEND) == 0)) {
+            FdPosState[fd] = FD_POS_SHELL;
+          }
+          if ((Parsed.Node == daDefaultDevice) &&
+              !PathIdentify(path, &FdDev[fd], &FdIno[fd])) {
+            FdDev[fd] = 0;
+            FdIno[fd] = 0;
+          }
         }
       }
     }
-    free(NewPath);
   }
-  free(MPath);    // We don't need this any more.
+  PathRelease(&Parsed);   // We don't need this any more.
 
+  TRACE_END(TraceOpen, Stamp, fd);
   // return the fd of our now open file
   return fd;
 }
 
 
+/*
+  Collects the events poll can sleep on until a descriptor might have
+  become ready. The console input is the only thing whose state changes
+  while poll is running, and its WaitForKey is used. Other console
+  streams and redirections always return the same answer, so there's
+  nothing to wait for. For anything else, returns FALSE, and poll has
+  to keep polling.
+*/
+#define POLL_MAX_EVENTS   16
+
+static BOOLEAN
+PollEvents (
+  struct pollfd * pfd,
+  nfds_t nfds,
+  EFI_EVENT * Events,
+  UINTN * NumEvents
+  )
+{
+  struct __filedes * pDescriptor;
+  ConInstance * Stream;
+  EFI_SIMPLE_TEXT_INPUT_PROTOCOL * ConIn;
+  nfds_t i;
+
+  for ( i = 0; i < nfds; i++ ) {
+    if ( !isatty ( pfd [ i ].fd )) {
+      return FALSE;
+    }
+
+    pDescriptor = &gMD->fdarray [ pfd [ i ].fd ];
+    if (( pDescriptor->Oflags & O_ACCMODE ) != O_RDONLY ) {
+      continue;
+    }
+
+    Stream = BASE_CR ( pDescriptor->f_ops, ConInstance, Abstraction );
+    if (( Stream->Cookie != CON_COOKIE ) || ( POLL_MAX_EVENTS == *NumEvents )) {
+      return FALSE;
+    }
+    ConIn = (EFI_SIMPLE_TEXT_INPUT_PROTOCOL *) Stream->Dev;
+    Events [ (*NumEvents)++ ] = ConIn->WaitForKey;
+  }
+  return TRUE;
+}
+
 /**
   Poll a list of file descriptors.
 
@@ -753,14 +1449,21 @@ poll (
   int SelectedFDs;
   EFI_STATUS Status;
   EFI_EVENT Timer;
+  EFI_EVENT Events [ POLL_MAX_EVENTS ];
+  UINTN NumEvents;
+  UINTN Index;
+  BOOLEAN CanWait;
   UINT64 TimerTicks;
+  TRACE_DECLARE(Stamp);
+
+  TRACE_BEGIN(Stamp);
 
   //
   //  Create the timer for the timeout
   //
   Timer = NULL;
   Status = EFI_SUCCESS;
-  if ( INFTIM != timeout ) {
+  if (( INFTIM != timeout ) && ( 0 != timeout )) {
     Status = gBS->CreateEvent ( EVT_TIMER,
                                 TPL_NOTIFY,
                                 NULL,
@@ -799,7 +1502,8 @@ poll (
         //
         if ( !ValidateFD ( pPollFD->fd, VALID_OPEN )) {
           errno = EINVAL;
-          return -1;
+          SelectedFDs = -1;
+          break;
         }
 
         //
@@ -825,6 +1529,33 @@ poll (
         pPollFD += 1;
       }
 
+      if (( 0 != SelectedFDs ) || ( 0 == timeout )) {
+        break;
+      }
+
+      //
+      //  Nothing yet, so sleep until a descriptor or the timer
+      //  has something, if there's a way to tell
+      //
+      NumEvents = 0;
+      if ( NULL != Timer ) {
+        Events [ NumEvents++ ] = Timer;
+      }
+      CanWait = PollEvents ( pfd, nfds, Events, &NumEvents );
+      if ( CanWait && ( 0 != NumEvents )) {
+        Status = gBS->WaitForEvent ( NumEvents, Events, &Index );
+        if ( EFI_ERROR ( Status )) {
+          break;
+        }
+        if (( NULL != Timer ) && ( 0 == Index )) {
+          //
+          //  Timeout
+          //
+          break;
+        }
+        continue;
+      }
+
       //
       //  Check for timeout
       //
@@ -838,10 +1569,9 @@ poll (
         }
         else if ( EFI_NOT_READY == Status ) {
           Status = EFI_SUCCESS;
-    }
-    }
-    } while (( 0 == SelectedFDs )
-        && ( EFI_SUCCESS == Status ));
+        }
+      }
+    } while ( EFI_SUCCESS == Status );
 
     //
     //  Stop the timer
@@ -850,7 +1580,7 @@ poll (
       gBS->SetTimer ( Timer,
                       TimerCancel,
                       0 );
-  }
+    }
   }
   else {
     SelectedFDs = -1;
@@ -864,6 +1594,8 @@ poll (
     gBS->CloseEvent ( Timer );
   }
 
+  TRACE_END(TracePoll, Stamp, SelectedFDs);
+
   //
   //  Return the number of selected file system descriptors
   //
@@ -912,16 +1644,14 @@ rename(
   const char *To
   )
 {
-  wchar_t            *FromPath;
-  DeviceNode         *FromNode;
+  PARSED_PATH         Parsed;
   char               *GenI;
-  int                 Instance    = 0;
   RETURN_STATUS       Status;
   int                 retval      = -1;
 
-  Status = ParsePath(From, &FromPath, &FromNode, &Instance, NULL);
+  Status = PathLookup(From, &Parsed);
   if(Status == RETURN_SUCCESS) {
-    GenI = FromNode->InstanceList;
+    GenI = Parsed.Node->InstanceList;
     if(GenI == NULL) {
       errno   = EPERM;
       retval  = -1;
@@ -930,8 +1660,8 @@ rename(
       //GenI += (Instance * FromNode->InstanceSize);
       retval = ((GenericInstance *)GenI)->Abstraction.fo_rename( From, To);
               }
-    free(FromPath);
             }
+  PathRelease(&Parsed);
   return retval;
 }
 
@@ -956,8 +1686,7 @@ rmdir(
     filp = &gMD->fdarray[fd];
 
     retval = filp->f_ops->fo_rmdir(filp);
-    filp->f_iflags = 0;           // Close this FD
-    filp->RefCount = 0;           // No one using this FD
+    FdRelease(fd);                // Close this FD
   }
   return retval;
 }
@@ -982,8 +1711,9 @@ rmdir(
     The stat structure members which don't have direct analogs to EFI file
     information are filled in as follows:
       - st_mode     Populated with information from fd
-      - st_ino      Set to zero.  (inode)
-      - st_dev      Set to zero.
+      - st_ino      Synthesized for shell files, see PathIdentify,
+                    otherwise zero.  (inode)
+      - st_dev      Likewise.
       - st_uid      Set to zero.
       - st_gid      Set to zero.
       - st_nlink    Set to one.
@@ -1004,6 +1734,9 @@ fstat (int fd, struct stat *statbuf)
   if(ValidateFD( fd, VALID_OPEN)) {
     filp = &gMD->fdarray[fd];
     retval = filp->f_ops->fo_stat(filp, statbuf, NULL);
+    if (retval == 0) {
+      StatSynthesizeIds(fd, statbuf);
+    }
       }
       else {
     errno   =  EBADF;
@@ -1016,6 +1749,8 @@ fstat (int fd, struct stat *statbuf)
     Opens the file pointed to by path, calls _EFI_FileInfo with the file's handle,
     then closes the file.
 
+    st_dev and st_ino are synthesized, see PathIdentify.
+
     @param[in]    path      Path to the file to obtain information about.
     @param[out]   statbuf   Buffer in which the file status is put.
 
@@ -1029,13 +1764,19 @@ stat   (const char *path, struct stat *statbuf)
   int                 fd;
   int                 retval  = -1;
   struct __filedes   *filp;
+  TRACE_DECLARE(Stamp);
 
+  TRACE_BEGIN(Stamp);
   fd = open(path, O_RDONLY, 0);
   if(fd >= 0) {
     filp = &gMD->fdarray[fd];
     retval = filp->f_ops->fo_stat( filp, statbuf, NULL);
+    if (retval == 0) {
+      StatSynthesizeIds(fd, statbuf);
+    }
     close(fd);
   }
+  TRACE_END(TraceStat, Stamp, retval);
   return retval;
 }
 
@@ -1054,6 +1795,104 @@ lstat (const char *path, struct stat *statbuf)
   return stat(path, statbuf);
 }
 
+/** Obtains information about a file relative to an open directory.
+
+    Instead of going through ParsePath, device lookup and a full open of
+    path, like stat() does, the file is opened relative to the directory
+    handle behind fd. This is what makes stat-ing many files in the
+    same directory cheap.
+
+    There is no fileop for opening relative to a descriptor, so this
+    relies on two properties of the Shell file device (daShell), and is
+    only done for descriptors it opened (the ones with synthesized ids):
+      - devdata is the SHELL_FILE_HANDLE, which the UEFI Shell implements
+        as an EFI_FILE_PROTOCOL, so its Open() works relative to it.
+      - fo_stat only looks at devdata, so a copy of the directory's
+        descriptor with the handle swapped stats the child.
+
+    st_dev and st_ino are synthesized by extending the directory's ids
+    with path, matching what stat() returns for the same file.
+
+    @param[in]    fd        Descriptor of an open directory, or AT_FDCWD.
+    @param[in]    path      Path to the file, relative to fd. Absolute
+                            and mapped paths ignore fd.
+    @param[out]   statbuf   Buffer in which the file status is put.
+    @param[in]    flag      Ignored, there are no symlinks.
+
+    @retval    0  Successful Completion.
+    @retval   -1  An error has occurred and errno has been set to
+                  identify the error.
+**/
+int
+fstatat (int fd, const char *path, struct stat *statbuf, int flag)
+{
+  EFI_STATUS          Status;
+  EFI_FILE_PROTOCOL  *Dir;
+  EFI_FILE_PROTOCOL  *File;
+  struct __filedes   *filp;
+  struct __filedes    child;
+  struct stat         dirst;
+  UINTN               Index;
+  int                 Len;
+  int                 retval;
+
+  if (fd == AT_FDCWD || path[0] == '/' || path[0] == '\\' ||
+      strchr(path, ':') != NULL) {
+    return stat(path, statbuf);
+  }
+
+  if (!ValidateFD(fd, VALID_OPEN)) {
+    errno = EBADF;
+    return -1;
+  }
+
+  filp = &gMD->fdarray[fd];
+  if (FdDev[fd] == 0 ||
+      filp->f_ops->fo_stat(filp, &dirst, NULL) != 0 ||
+      !S_ISDIR(dirst.st_mode)) {
+    errno = ENOTDIR;
+    return -1;
+  }
+
+  if (!IdPathWiden(path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  for (Index = 0; IdPathIn[Index] != L'\0'; Index++) {
+    if (IdPathIn[Index] == L'/') {
+      IdPathIn[Index] = L'\\';
+    }
+  }
+
+  Dir = (EFI_FILE_PROTOCOL *) filp->devdata;
+  Status = Dir->Open(Dir, &File, IdPathIn, EFI_FILE_MODE_READ, 0);
+  if (EFI_ERROR(Status)) {
+    EFIerrno = Status;
+    errno = (Status == EFI_NOT_FOUND) ? ENOENT : EIO;
+    return -1;
+  }
+
+  child = *filp;
+  child.devdata = File;
+  child.f_offset = 0;
+  retval = child.f_ops->fo_stat(&child, statbuf, NULL);
+  File->Close(File);
+
+  if (retval == 0) {
+    //
+    // A ".." leading out of fd's directory leaves the ids unknown.
+    //
+    Len = IdPathAppend(0, IdPathIn, FALSE);
+    if (Len >= 0) {
+      statbuf->st_dev = (dev_t) (FdDev[fd] ^ (FdDev[fd] >> 32));
+      statbuf->st_ino = (ino_t) Fnv64(FdIno[fd], IdPathBuf,
+                                      Len * sizeof(CHAR16));
+    }
+  }
+  return retval;
+}
+
 /** Control a device.
 
     @param[in]        fd        Descriptor for the file to be acted upon.
@@ -1175,7 +2014,9 @@ read   (int fildes, void *buf, size_t nbyte)
   struct __filedes *filp;
   cIIO             *IIO;
   ssize_t           BufSize;
+  TRACE_DECLARE(Stamp);
 
+  TRACE_BEGIN(Stamp);
   BufSize = (ssize_t)nbyte;
   if(BufSize > 0) {
     if(ValidateFD( fildes, VALID_OPEN)) {
@@ -1185,8 +2026,15 @@ read   (int fildes, void *buf, size_t nbyte)
       if(isatty(fildes) && (IIO != NULL)) {
         BufSize = IIO->Read(filp, nbyte, buf);
       }
+      else if((FdPosState[fildes] == FD_POS_TRACKED) &&
+              (FdSetPosition(fildes, filp->f_offset) != 0)) {
+        BufSize = -1;
+      }
       else {
         BufSize = filp->f_ops->fo_read(filp, &filp->f_offset, nbyte, buf);
+        if(FdPosState[fildes] == FD_POS_TRACKED) {
+          FdPos[fildes] = (BufSize >= 0) ? (UINT64) filp->f_offset : FD_POS_UNKNOWN;
+        }
       }
     }
     else {
@@ -1194,6 +2042,7 @@ read   (int fildes, void *buf, size_t nbyte)
       BufSize = -1;
     }
   }
+  TRACE_END(TraceRead, Stamp, BufSize);
   return BufSize;
 }
 
@@ -1239,7 +2088,9 @@ write  (int fd, const void *buf, size_t nbyte)
   struct __filedes *filp;
   cIIO             *IIO;
   ssize_t           BufSize;
+  TRACE_DECLARE(Stamp);
 
+  TRACE_BEGIN(Stamp);
   BufSize = (ssize_t)nbyte;
 
   if(ValidateFD( fd, VALID_OPEN)) {
@@ -1252,9 +2103,16 @@ write  (int fd, const void *buf, size_t nbyte)
         // (Terminal device or the slave side of a pseudo-tty)
         BufSize = IIO->Write(filp, buf, nbyte);
       }
+      else if((FdPosState[fd] == FD_POS_TRACKED) &&
+              (FdSetPosition(fd, filp->f_offset) != 0)) {
+        BufSize = -1;
+      }
       else {
         // Output to a regular file, socket, pipe, etc.
         BufSize = filp->f_ops->fo_write(filp, &filp->f_offset, nbyte, buf);
+        if(FdPosState[fd] == FD_POS_TRACKED) {
+          FdPos[fd] = (BufSize >= 0) ? (UINT64) filp->f_offset : FD_POS_UNKNOWN;
+        }
       }
     }
     else {
@@ -1268,9 +2126,359 @@ write  (int fd, const void *buf, size_t nbyte)
     errno = EBADF;
     BufSize = -1;
   }
+  TRACE_END(TraceWrite, Stamp, BufSize);
   return BufSize;
 }
 
+/*  Switches a shell file fd to FD_POS_TRACKED, returns TRUE if it is. */
+static BOOLEAN
+FdTrack (int fd)
+{
+  struct __filedes   *filp;
+  struct stat         st;
+
+  if(FdPosState[fd] == FD_POS_SHELL) {
+    filp = &gMD->fdarray[fd];
+    // Directories are read through fo_read as entries, leave them alone.
+    if((filp->f_ops->fo_stat(filp, &st, NULL) == 0) && !S_ISDIR(st.st_mode)) {
+      FdPos[fd] = (UINT64) filp->f_offset;
+      FdPosState[fd] = FD_POS_TRACKED;
+    }
+    else {
+      FdPosState[fd] = FD_POS_NONE;
+    }
+  }
+  return FdPosState[fd] == FD_POS_TRACKED;
+}
+
+/*  Common part of pread and pwrite, which leave f_offset alone. */
+static ssize_t
+PositionalIo (int fd, void *buf, size_t nbyte, off_t offset, BOOLEAN Write)
+{
+  struct __filedes   *filp;
+  EFI_FILE_PROTOCOL  *File;
+  EFI_STATUS          Status;
+  UINTN               Size;
+  off_t               Pos;
+
+  if(!ValidateFD( fd, VALID_OPEN)) {
+    errno = EBADF;
+    return -1;
+  }
+  filp = &gMD->fdarray[fd];
+  if(Write && ((filp->Oflags & O_ACCMODE) == O_RDONLY)) {
+    errno = EBADF;              // Not open for writing
+    return -1;
+  }
+  if(isatty(fd)) {
+    errno = ESPIPE;
+    return -1;
+  }
+  if(offset < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  if(nbyte == 0) {
+    return 0;
+  }
+
+  if(!FdTrack(fd)) {
+    Pos = offset;
+    return Write ? filp->f_ops->fo_write(filp, &Pos, nbyte, buf) :
+                   filp->f_ops->fo_read(filp, &Pos, nbyte, buf);
+  }
+
+  if(FdSetPosition(fd, (UINT64) offset) != 0) {
+    return -1;
+  }
+  File = (EFI_FILE_PROTOCOL *) filp->devdata;
+  Size = nbyte;
+  Status = Write ? File->Write(File, &Size, buf) : File->Read(File, &Size, buf);
+  if(EFI_ERROR(Status)) {
+    FdPos[fd] = FD_POS_UNKNOWN;
+    EFIerrno = Status;
+    errno = EIO;
+    return -1;
+  }
+  FdPos[fd] = (UINT64) offset + Size;
+  return (ssize_t) Size;
+}
+
+/** Read from a file at a given offset, without changing the file offset.
+
+    @param[in]  fildes    Descriptor of the file to be read.
+    @param[out] buf       Pointer to location in which to store the read data.
+    @param[in]  nbyte     Maximum number of bytes to be read.
+    @param[in]  offset    Position in the file to read from.
+
+    @return   Upon successful completion, pread() returns a non-negative integer
+              indicating the number of bytes actually read.  Otherwise, -1 is
+              returned and errno is set to indicate the error.
+                - ESPIPE: fildes is a terminal.
+                - EINVAL: offset is negative.
+**/
+ssize_t
+pread (int fildes, void *buf, size_t nbyte, off_t offset)
+{
+  return PositionalIo(fildes, buf, nbyte, offset, FALSE);
+}
+
+/** Write to a file at a given offset, without changing the file offset.
+
+    @param[in]  fd        Descriptor of file to be written to.
+    @param[in]  buf       Pointer to data to write to the file.
+    @param[in]  nbyte     Number of bytes to be written to the file.
+    @param[in]  offset    Position in the file to write at.
+
+    @retval   >=0   Number of bytes actually written to the file.
+    @retval   <0    An error occurred.  More data is provided by errno.
+                      - EBADF: fd is not open for writing.
+                      - ESPIPE: fd is a terminal.
+                      - EINVAL: offset is negative.
+**/
+ssize_t
+pwrite (int fd, const void *buf, size_t nbyte, off_t offset)
+{
+  return PositionalIo(fd, (void *) buf, nbyte, offset, TRUE);
+}
+
+/** Scatter read from a file at a given offset, without changing the file offset.
+
+    @param[in]  fildes    Descriptor of the file to be read.
+    @param[in]  iov       Buffers to fill, in order.
+    @param[in]  iovcnt    Number of elements in iov.
+    @param[in]  offset    Position in the file to read from.
+
+    @return   Number of bytes read, which is less than the total size of iov
+              at end of file, or -1 with errno set if nothing could be read.
+**/
+ssize_t
+preadv (int fildes, const struct iovec *iov, int iovcnt, off_t offset)
+{
+  ssize_t   Total;
+  ssize_t   Count;
+  int       i;
+
+  if(iovcnt < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  Total = 0;
+  for(i = 0; i < iovcnt; i++) {
+    if(iov[i].iov_len == 0) {
+      continue;
+    }
+    Count = PositionalIo(fildes, iov[i].iov_base, iov[i].iov_len,
+                         offset + Total, FALSE);
+    if(Count < 0) {
+      return (Total == 0) ? -1 : Total;
+    }
+    Total += Count;
+    if((size_t) Count < iov[i].iov_len) {
+      break;
+    }
+  }
+  return Total;
+}
+
+/*
+  mmap emulation. There's no way to take page faults from an application,
+  so a mapping is a copy of the mapped part of the file in boot services
+  pages, read in up front with large pread calls. Read-only mappings of
+  the same file (same st_dev/st_ino, size and modification time) share
+  one copy when it covers the requested range, refcounted by
+  mmap/munmap. Writable MAP_PRIVATE mappings always get their own.
+*/
+#define MMAP_MAX          32
+#define MMAP_CHUNK        (1024 * 1024)
+
+typedef struct {
+  void        *Base;
+  UINTN        Pages;
+  UINTN        Users;     // 0 means unused
+  BOOLEAN      Shared;
+  UINT64       Dev;
+  UINT64       Ino;
+  off_t        Offset;    // File offset of Base
+  off_t        Size;
+  time_t       MTime;
+} MMAP_ENTRY;
+
+static MMAP_ENTRY   MmapTable[MMAP_MAX];
+
+/*  Finds a shared copy of fd's file covering [Offset, Offset + Len). */
+static MMAP_ENTRY *
+MmapFind (int fd, const struct stat *st, off_t Offset, size_t Len)
+{
+  MMAP_ENTRY   *Entry;
+  int           i;
+
+  for(i = 0; i < MMAP_MAX; i++) {
+    Entry = &MmapTable[i];
+    if((Entry->Users != 0) && Entry->Shared &&
+       (Entry->Dev == FdDev[fd]) && (Entry->Ino == FdIno[fd]) &&
+       (Entry->Size == st->st_size) && (Entry->MTime == st->st_mtime) &&
+       (Entry->Offset <= Offset) &&
+       ((UINT64) (Offset - Entry->Offset) + Len <=
+        EFI_PAGES_TO_SIZE(Entry->Pages))) {
+      return Entry;
+    }
+  }
+  return NULL;
+}
+
+/*  Reads Size bytes of the file at Offset into Base, returns 0 on success. */
+static int
+MmapFill (int fd, char *Base, off_t Offset, off_t Size)
+{
+  off_t     Done;
+  ssize_t   Count;
+
+  for(Done = 0; Done < Size; Done += Count) {
+    Count = pread(fd, Base + Done, (size_t) MIN(Size - Done, MMAP_CHUNK),
+                  Offset + Done);
+    if(Count < 0) {
+      return -1;
+    }
+    if(Count == 0) {
+      break;      // Truncated under us, the rest stays zero
+    }
+  }
+  return 0;
+}
+
+/** Map a file into memory.
+
+    Only private or read-only shared mappings are supported, and the
+    mapping is a snapshot of the file taken at mmap time. Only the pages
+    backing [offset, offset + len) are read; past the end of the file
+    they read as zeroes.
+
+    @param[in]  addr      Ignored, the mapping goes wherever there are free pages.
+    @param[in]  len       Length of the mapping.
+    @param[in]  prot      PROT_READ, optionally with PROT_WRITE for MAP_PRIVATE.
+    @param[in]  flags     MAP_PRIVATE or MAP_SHARED.
+    @param[in]  fd        Descriptor of the file to map.
+    @param[in]  offset    Page aligned offset in the file to map from.
+
+    @return   The address of the mapping, or MAP_FAILED with errno set.
+                - EINVAL:  Bad len, offset, prot or flags.
+                - ENODEV:  fd is not a regular file.
+                - ENOTSUP: Writable MAP_SHARED mappings can't be emulated.
+                - ENOMEM:  Out of memory or mapping slots.
+**/
+void *
+mmap (void *addr, size_t len, int prot, int flags, int fd, off_t offset)
+{
+  struct stat           st;
+  MMAP_ENTRY           *Entry;
+  EFI_PHYSICAL_ADDRESS  Base;
+  EFI_STATUS            Status;
+  BOOLEAN               Shared;
+  UINTN                 Pages;
+  off_t                 Fill;
+  int                   i;
+
+  if((len == 0) || (offset < 0) || ((offset & EFI_PAGE_MASK) != 0) ||
+     ((prot & ~(PROT_READ | PROT_WRITE)) != 0) ||
+     (((flags & MAP_PRIVATE) != 0) == ((flags & MAP_SHARED) != 0))) {
+    errno = EINVAL;
+    return MAP_FAILED;
+  }
+  if(((prot & PROT_WRITE) != 0) && ((flags & MAP_SHARED) != 0)) {
+    errno = ENOTSUP;
+    return MAP_FAILED;
+  }
+  if(fstat(fd, &st) != 0) {
+    return MAP_FAILED;
+  }
+  if(!S_ISREG(st.st_mode)) {
+    errno = ENODEV;
+    return MAP_FAILED;
+  }
+
+  Shared = ((prot & PROT_WRITE) == 0) && (FdDev[fd] != 0);
+  if(Shared) {
+    Entry = MmapFind(fd, &st, offset, len);
+    if(Entry != NULL) {
+      Entry->Users++;
+      return (char *) Entry->Base + (offset - Entry->Offset);
+    }
+  }
+
+  Entry = NULL;
+  for(i = 0; i < MMAP_MAX; i++) {
+    if(MmapTable[i].Users == 0) {
+      Entry = &MmapTable[i];
+      break;
+    }
+  }
+  if(Entry == NULL) {
+    errno = ENOMEM;
+    return MAP_FAILED;
+  }
+
+  Pages = EFI_SIZE_TO_PAGES(len);
+  Status = gBS->AllocatePages(AllocateAnyPages, EfiBootServicesData, Pages, &Base);
+  if(EFI_ERROR(Status)) {
+    EFIerrno = Status;
+    errno = ENOMEM;
+    return MAP_FAILED;
+  }
+  ZeroMem((VOID *) (UINTN) Base, EFI_PAGES_TO_SIZE(Pages));
+  Fill = MIN((off_t) EFI_PAGES_TO_SIZE(Pages), st.st_size - offset);
+  if((Fill > 0) &&
+     (MmapFill(fd, (char *) (UINTN) Base, offset, Fill) != 0)) {
+    gBS->FreePages(Base, Pages);
+    return MAP_FAILED;
+  }
+
+  Entry->Base = (void *) (UINTN) Base;
+  Entry->Pages = Pages;
+  Entry->Users = 1;
+  Entry->Shared = Shared;
+  Entry->Dev = FdDev[fd];
+  Entry->Ino = FdIno[fd];
+  Entry->Offset = offset;
+  Entry->Size = st.st_size;
+  Entry->MTime = st.st_mtime;
+  return Entry->Base;
+}
+
+/** Remove a mapping made by mmap.
+
+    Each munmap drops one reference to the mapping containing addr, the
+    memory is freed with the last one.
+
+    @param[in]  addr      An address returned by mmap.
+    @param[in]  len       Length of the mapping.
+
+    @retval   0     Successful completion.
+    @retval   -1    addr isn't in a mapping and errno is set to EINVAL.
+**/
+int
+munmap (void *addr, size_t len)
+{
+  MMAP_ENTRY   *Entry;
+  int           i;
+
+  for(i = 0; i < MMAP_MAX; i++) {
+    Entry = &MmapTable[i];
+    if((Entry->Users != 0) &&
+       ((UINTN) addr >= (UINTN) Entry->Base) &&
+       ((UINTN) addr < (UINTN) Entry->Base + EFI_PAGES_TO_SIZE(Entry->Pages))) {
+      if(--Entry->Users == 0) {
+        gBS->FreePages((EFI_PHYSICAL_ADDRESS) (UINTN) Entry->Base, Entry->Pages);
+        Entry->Base = NULL;
+      }
+      return 0;
+    }
+  }
+  errno = EINVAL;
+  return -1;
+}
+
 /** Gets the current working directory.
 
   The getcwd() function shall place an absolute pathname of the current
@@ -1350,6 +2558,7 @@ chdir (const char *path)
       AsciiStrToUnicodeStrS(path, UnicodePath, AsciiStrSize(path));
       Status = gEfiShellProtocol->SetCurDir(NULL, UnicodePath);
       FreePool(UnicodePath);
+      PathCacheFlush();
       if (EFI_ERROR(Status)) {
         errno = ENOENT;
         return -1;
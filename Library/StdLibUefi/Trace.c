@@ -0,0 +1,266 @@
+/** @file
+  Syscall-level I/O tracing for LibUefi.
+
+  Counts calls, bytes moved and latencies for open, close, read, write,
+  lseek, stat and poll. Latencies go into log2 histograms of counter ticks,
+  converted to microseconds when dumped, using a counter rate measured
+  once against gBS->Stall.
+
+  Only built in with -DSTDLIB_TRACE (see STDLIB_TRACE in the package DSCs).
+  The statistics are written out at exit to the file named by the
+  STDLIB_TRACE environment variable, if set, or on demand via trace_dump().
+
+  Copyright (C) 2017 Andrei Evgenievich Warkentin
+
+  This program and the accompanying materials are licensed and made available under
+  the terms and conditions of the BSD License that accompanies this distribution.
+  The full text of the license may be found at
+  http://opensource.org/licenses/bsd-license.
+
+  THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+  WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+
+**/
+#include  <Uefi.h>
+#include  <Library/BaseLib.h>
+#include  <Library/PrintLib.h>
+#include  <Library/UefiBootServicesTableLib.h>
+
+#include  <LibConfig.h>
+#include  <sys/EfiCdefs.h>
+
+#include  <errno.h>
+#include  <stdlib.h>
+#include  <fcntl.h>
+#include  <sys/stat.h>
+#include  <unistd.h>
+
+#include  "Trace.h"
+
+#ifdef STDLIB_TRACE
+
+#define TRACE_BUCKETS     64
+#define TRACE_CALIBRATE   1000      // Microseconds
+
+typedef struct {
+  UINT64    Count;
+  UINT64    Errors;
+  UINT64    Bytes;
+  UINT64    Ticks;
+  UINT64    MaxTicks;
+  UINT64    Histogram[TRACE_BUCKETS];   // Bucket n is [2^(n-1), 2^n) ticks
+} TRACE_STATS;
+
+static TRACE_STATS    TraceStats[TraceMax];
+static UINTN          TraceDepth;
+static UINT64         TraceTicksPerUs;
+static BOOLEAN        TraceStarted;
+
+static CONST CHAR8   *TraceNames[TraceMax] = {
+  "open", "close", "read", "write", "lseek", "stat", "poll"
+};
+
+static UINT64
+TraceCounter (
+  VOID
+  )
+{
+#if defined (MDE_CPU_IA32) || defined (MDE_CPU_X64)
+  return AsmReadTsc ();
+#elif defined (MDE_CPU_AARCH64) && defined (__GNUC__)
+  UINT64 Value;
+
+  __asm__ __volatile__ ("isb; mrs %0, cntvct_el0" : "=r" (Value));
+  return Value;
+#else
+  //
+  // No usable free-running counter, only counts and bytes are kept.
+  //
+  return 0;
+#endif
+}
+
+static void
+TraceAtExit (
+  void
+  )
+{
+  char *Path;
+
+  Path = getenv ("STDLIB_TRACE");
+  if (Path != NULL && *Path != '\0') {
+    trace_dump (Path);
+  }
+}
+
+static VOID
+TraceStart (
+  VOID
+  )
+{
+  UINT64 Start;
+
+  TraceStarted = TRUE;
+
+  Start = TraceCounter ();
+  gBS->Stall (TRACE_CALIBRATE);
+  TraceTicksPerUs = DivU64x32 (TraceCounter () - Start, TRACE_CALIBRATE);
+
+  atexit (TraceAtExit);
+}
+
+UINT64
+TraceBegin (
+  VOID
+  )
+{
+  if (!TraceStarted) {
+    TraceStart ();
+  }
+
+  TraceDepth++;
+  return TraceCounter ();
+}
+
+VOID
+TraceEnd (
+  IN  TRACE_CALL  Call,
+  IN  UINT64      Stamp,
+  IN  INT64       Result
+  )
+{
+  UINT64        Ticks;
+  UINTN         Bucket;
+  TRACE_STATS  *Stats;
+
+  Ticks = TraceCounter () - Stamp;
+  if (--TraceDepth != 0) {
+    return;
+  }
+
+  Stats = &TraceStats[Call];
+  Stats->Count++;
+  if (Result < 0) {
+    Stats->Errors++;
+  } else if (Call == TraceRead || Call == TraceWrite) {
+    Stats->Bytes += (UINT64) Result;
+  }
+
+  Stats->Ticks += Ticks;
+  if (Ticks > Stats->MaxTicks) {
+    Stats->MaxTicks = Ticks;
+  }
+  Bucket = Ticks == 0 ? 0 : HighBitSet64 (Ticks) + 1;
+  Stats->Histogram[MIN (Bucket, TRACE_BUCKETS - 1)]++;
+}
+
+static UINT64
+TraceUs (
+  IN  UINT64  Ticks
+  )
+{
+  if (TraceTicksPerUs == 0) {
+    return 0;
+  }
+
+  return DivU64x64Remainder (Ticks, TraceTicksPerUs, NULL);
+}
+
+static int
+TracePrint (
+  IN  int          fd,
+  IN  CONST CHAR8  *Format,
+  ...
+  )
+{
+  CHAR8    Buffer[160];
+  UINTN    Length;
+  VA_LIST  Marker;
+
+  VA_START (Marker, Format);
+  Length = AsciiVSPrint (Buffer, sizeof (Buffer), Format, Marker);
+  VA_END (Marker);
+
+  return write (fd, Buffer, Length) == (ssize_t) Length ? 0 : -1;
+}
+
+#endif /* STDLIB_TRACE */
+
+/** Write out the I/O statistics collected so far.
+
+    @param[in]  path    File to write to, or NULL for stderr.
+
+    @retval   0     Successful completion.
+    @retval   -1    An error occurred and errno is set to identify the error.
+                      - ENOSYS: LibUefi was built without STDLIB_TRACE.
+**/
+int
+trace_dump (const char *path)
+{
+#ifdef STDLIB_TRACE
+  int           fd;
+  int           Status;
+  UINTN         Call;
+  UINTN         Bucket;
+  TRACE_STATS  *Stats;
+
+  //
+  // Our own I/O is not to be traced.
+  //
+  TraceDepth++;
+
+  if (path == NULL) {
+    fd = STDERR_FILENO;
+  } else {
+    fd = open (path, O_WRONLY | O_CREAT | O_TRUNC, DEFFILEMODE);
+    if (fd < 0) {
+      TraceDepth--;
+      return -1;
+    }
+  }
+
+  Status = TracePrint (fd, "%-6a %10a %8a %14a %12a %12a\n",
+                       "call", "count", "errors", "bytes", "avg us", "max us");
+  for (Call = 0; Call < TraceMax && Status == 0; Call++) {
+    Stats = &TraceStats[Call];
+    if (Stats->Count == 0) {
+      continue;
+    }
+
+    Status = TracePrint (fd, "%-6a %10Lu %8Lu %14Lu %12Lu %12Lu\n",
+                         TraceNames[Call], Stats->Count, Stats->Errors,
+                         Stats->Bytes,
+                         TraceUs (DivU64x64Remainder (Stats->Ticks,
+                                                      Stats->Count, NULL)),
+                         TraceUs (Stats->MaxTicks));
+  }
+
+  for (Call = 0; Call < TraceMax && Status == 0; Call++) {
+    Stats = &TraceStats[Call];
+    if (Stats->Count == 0 || TraceTicksPerUs == 0) {
+      continue;
+    }
+
+    Status = TracePrint (fd, "\n%a latency:\n", TraceNames[Call]);
+    for (Bucket = 0; Bucket < TRACE_BUCKETS && Status == 0; Bucket++) {
+      if (Stats->Histogram[Bucket] == 0) {
+        continue;
+      }
+
+      Status = TracePrint (fd, "  < %12Lu us %10Lu\n",
+                           TraceUs (LShiftU64 (1, Bucket)) + 1,
+                           Stats->Histogram[Bucket]);
+    }
+  }
+
+  if (fd != STDERR_FILENO) {
+    close (fd);
+  }
+
+  TraceDepth--;
+  return Status;
+#else
+  errno = ENOSYS;
+  return -1;
+#endif /* STDLIB_TRACE */
+}
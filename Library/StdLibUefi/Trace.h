@@ -0,0 +1,67 @@
+/** @file
+  Syscall-level I/O tracing for LibUefi.
+
+  Copyright (C) 2017 Andrei Evgenievich Warkentin
+
+  This program and the accompanying materials are licensed and made available under
+  the terms and conditions of the BSD License that accompanies this distribution.
+  The full text of the license may be found at
+  http://opensource.org/licenses/bsd-license.
+
+  THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+  WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+
+**/
+
+#ifndef _LIBUEFI_TRACE_H_
+#define _LIBUEFI_TRACE_H_
+
+typedef enum {
+  TraceOpen,
+  TraceClose,
+  TraceRead,
+  TraceWrite,
+  TraceLseek,
+  TraceStat,
+  TracePoll,
+  TraceMax
+} TRACE_CALL;
+
+int
+trace_dump (
+  const char *path
+  );
+
+#ifdef STDLIB_TRACE
+
+UINT64
+TraceBegin (
+  VOID
+  );
+
+VOID
+TraceEnd (
+  IN  TRACE_CALL  Call,
+  IN  UINT64      Stamp,
+  IN  INT64       Result
+  );
+
+/*
+  Bracket the body of a traced call. Result is the return value, with
+  anything positive counted as bytes moved. Calls made while another
+  traced call is in progress (e.g. the open() inside stat()) are not
+  recorded on their own.
+*/
+#define TRACE_DECLARE(Stamp)              UINT64 Stamp
+#define TRACE_BEGIN(Stamp)                Stamp = TraceBegin ()
+#define TRACE_END(Call, Stamp, Result)    TraceEnd ((Call), (Stamp), (INT64) (Result))
+
+#else /* STDLIB_TRACE */
+
+#define TRACE_DECLARE(Stamp)
+#define TRACE_BEGIN(Stamp)
+#define TRACE_END(Call, Stamp, Result)
+
+#endif /* STDLIB_TRACE */
+
+#endif /* _LIBUEFI_TRACE_H_ */
@@ -92,8 +92,13 @@
  *  $NetBSD: compat.c,v 1.1.1.1 2008/08/24 05:33:08 gmcgarry Exp $
  */
 #include  <LibConfig.h>
+#include  <ctype.h>
+#include  <stdarg.h>
+#include  <stddef.h>
+#include  <stdint.h>
 #include  <string.h>
 #include  <fcntl.h>
+#include  <sys/types.h>
 #include  <sys/syslimits.h>
 
 #define ISPATHSEPARATOR(x) ((x == '/') || (x == '\\'))
@@ -218,22 +223,30 @@ static void
 dopr(char *buffer, size_t maxlen, const char *format, va_list args);
 
 static void
-fmtstr(char *buffer, size_t *currlen, size_t maxlen, char *value, int flags,
-    int min, int max);
+fmtstr(char *buffer, size_t *currlen, size_t maxlen, const char *value,
+    int len, int flags, int min, int max);
 
 static void
-fmtint(char *buffer, size_t *currlen, size_t maxlen, long value, int base,
-    int min, int max, int flags);
+fmtint(char *buffer, size_t *currlen, size_t maxlen, unsigned long long uvalue,
+    int neg, int base, int min, int max, int flags);
 
 static void
-fmtfp(char *buffer, size_t *currlen, size_t maxlen, long double fvalue,
-    int min, int max, int flags);
+fmtfp(char *buffer, size_t *currlen, size_t maxlen, double fvalue,
+    int min, int max, int flags, char conv);
 
 static void
-dopr_outch(char *buffer, size_t *currlen, size_t maxlen, char c);
+dopr_outmem(char *buffer, size_t *currlen, size_t maxlen, const char *s,
+    size_t len);
+
+static void
+dopr_outpad(char *buffer, size_t *currlen, size_t maxlen, char c, int len);
 
 /*
  * dopr(): poor man's version of doprintf
+ *
+ * Literal text is copied in runs, padding is done with memset, and
+ * numbers are converted into a local buffer and then copied, rather
+ * than everything going through a character at a time.
  */
 
 /* format read states */
@@ -260,20 +273,42 @@ dopr_outch(char *buffer, size_t *currlen, size_t maxlen, char c);
 #define DP_C_LONG      2
 #define DP_C_LDOUBLE   3
 #define DP_C_LONG_LONG 4
+#define DP_C_CHAR      5
+#define DP_C_SIZE      6
+#define DP_C_INTMAX    7
+#define DP_C_PTRDIFF   8
 
 #define char_to_int(p) (p - '0')
-#define abs_val(p) (p < 0 ? -p : p)
 
+/* Large enough for a 64-bit value in octal */
+#define DP_INT_DIGITS  24
+
+static const char digit_pairs[] =
+  "00010203040506070809"
+  "10111213141516171819"
+  "20212223242526272829"
+  "30313233343536373839"
+  "40414243444546474849"
+  "50515253545556575859"
+  "60616263646566676869"
+  "70717273747576777879"
+  "80818283848586878889"
+  "90919293949596979899";
 
 static void
 dopr(char *buffer, size_t maxlen, const char *format, va_list args)
 {
-  char *strvalue, ch;
-  long value;
-  long double fvalue;
+  const char *run;
+  char *strvalue, ch, cvalue;
+  long long value;
+  unsigned long long uvalue;
+  double fvalue;
   int min = 0, max = -1, state = DP_S_DEFAULT, flags = 0, cflags = 0;
   size_t currlen = 0;
 
+  if (maxlen == 0)
+    return;
+
   ch = *format++;
 
   while (state != DP_S_DONE) {
@@ -282,10 +317,14 @@ dopr(char *buffer, size_t maxlen, const char *format, va_list args)
 
     switch(state) {
     case DP_S_DEFAULT:
-      if (ch == '%')
+      if (ch == '%') {
         state = DP_S_FLAGS;
-      else
-        dopr_outch(buffer, &currlen, maxlen, ch);
+      } else {
+        run = format - 1;
+        while (*format != '\0' && *format != '%')
+          format++;
+        dopr_outmem(buffer, &currlen, maxlen, run, format - run);
+      }
       ch = *format++;
       break;
     case DP_S_FLAGS:
@@ -321,6 +360,10 @@ dopr(char *buffer, size_t maxlen, const char *format, va_list args)
         ch = *format++;
       } else if (ch == '*') {
         min = va_arg (args, int);
+        if (min < 0) {
+          flags |= DP_F_MINUS;
+          min = -min;
+        }
         ch = *format++;
         state = DP_S_DOT;
       } else
@@ -329,18 +372,19 @@ dopr(char *buffer, size_t maxlen, const char *format, va_list args)
     case DP_S_DOT:
       if (ch == '.') {
         state = DP_S_MAX;
+        max = 0;
         ch = *format++;
       } else
         state = DP_S_MOD;
       break;
     case DP_S_MAX:
       if (isdigit((unsigned char)ch)) {
-        if (max < 0)
-          max = 0;
         max = 10 * max + char_to_int(ch);
         ch = *format++;
       } else if (ch == '*') {
         max = va_arg (args, int);
+        if (max < 0)
+          max = -1;
         ch = *format++;
         state = DP_S_MOD;
       } else
@@ -351,6 +395,10 @@ dopr(char *buffer, size_t maxlen, const char *format, va_list args)
       case 'h':
         cflags = DP_C_SHORT;
         ch = *format++;
+        if (ch == 'h') {
+          cflags = DP_C_CHAR;
+          ch = *format++;
+        }
         break;
       case 'l':
         cflags = DP_C_LONG;
@@ -368,6 +416,18 @@ dopr(char *buffer, size_t maxlen, const char *format, va_list args)
         cflags = DP_C_LDOUBLE;
         ch = *format++;
         break;
+      case 'z':
+        cflags = DP_C_SIZE;
+        ch = *format++;
+        break;
+      case 'j':
+        cflags = DP_C_INTMAX;
+        ch = *format++;
+        break;
+      case 't':
+        cflags = DP_C_PTRDIFF;
+        ch = *format++;
+        break;
       default:
         break;
       }
@@ -377,93 +437,83 @@ dopr(char *buffer, size_t maxlen, const char *format, va_list args)
       switch (ch) {
       case 'd':
       case 'i':
-        if (cflags == DP_C_SHORT)
-          value = va_arg(args, int);
+        if (cflags == DP_C_CHAR)
+          value = (signed char) va_arg(args, int);
+        else if (cflags == DP_C_SHORT)
+          value = (short) va_arg(args, int);
         else if (cflags == DP_C_LONG)
           value = va_arg(args, long int);
         else if (cflags == DP_C_LONG_LONG)
           value = va_arg (args, long long);
+        else if (cflags == DP_C_SIZE)
+          value = va_arg (args, ssize_t);
+        else if (cflags == DP_C_INTMAX)
+          value = va_arg (args, intmax_t);
+        else if (cflags == DP_C_PTRDIFF)
+          value = va_arg (args, ptrdiff_t);
         else
           value = va_arg (args, int);
-        fmtint(buffer, &currlen, maxlen, value, 10, min, max, flags);
-        break;
-      case 'o':
-        flags |= DP_F_UNSIGNED;
-        if (cflags == DP_C_SHORT)
-          value = va_arg(args, unsigned int);
-        else if (cflags == DP_C_LONG)
-          value = va_arg(args, unsigned long int);
-        else if (cflags == DP_C_LONG_LONG)
-          value = va_arg(args, unsigned long long);
-        else
-          value = va_arg(args, unsigned int);
-        fmtint(buffer, &currlen, maxlen, value, 8, min, max, flags);
-        break;
-      case 'u':
-        flags |= DP_F_UNSIGNED;
-        if (cflags == DP_C_SHORT)
-          value = va_arg(args, unsigned int);
-        else if (cflags == DP_C_LONG)
-          value = va_arg(args, unsigned long int);
-        else if (cflags == DP_C_LONG_LONG)
-          value = va_arg(args, unsigned long long);
-        else
-          value = va_arg(args, unsigned int);
-        fmtint (buffer, &currlen, maxlen, value, 10, min, max, flags);
+        uvalue = value < 0 ? 0ULL - (unsigned long long) value : value;
+        fmtint(buffer, &currlen, maxlen, uvalue, value < 0, 10, min, max,
+               flags);
         break;
       case 'X':
         flags |= DP_F_UP;
+      case 'o':
+      case 'u':
       case 'x':
         flags |= DP_F_UNSIGNED;
-        if (cflags == DP_C_SHORT)
-          value = va_arg(args, unsigned int);
+        if (cflags == DP_C_CHAR)
+          uvalue = (unsigned char) va_arg(args, unsigned int);
+        else if (cflags == DP_C_SHORT)
+          uvalue = (unsigned short) va_arg(args, unsigned int);
         else if (cflags == DP_C_LONG)
-          value = va_arg(args, unsigned long int);
+          uvalue = va_arg(args, unsigned long int);
         else if (cflags == DP_C_LONG_LONG)
-          value = va_arg(args, unsigned long long);
+          uvalue = va_arg(args, unsigned long long);
+        else if (cflags == DP_C_SIZE)
+          uvalue = va_arg(args, size_t);
+        else if (cflags == DP_C_INTMAX)
+          uvalue = va_arg(args, uintmax_t);
+        else if (cflags == DP_C_PTRDIFF)
+          uvalue = (size_t) va_arg(args, ptrdiff_t);
         else
-          value = va_arg(args, unsigned int);
-        fmtint(buffer, &currlen, maxlen, value, 16, min, max, flags);
-        break;
-      case 'f':
-        if (cflags == DP_C_LDOUBLE)
-          fvalue = va_arg(args, long double);
-        else
-          fvalue = va_arg(args, double);
-        /* um, floating point? */
-        fmtfp(buffer, &currlen, maxlen, fvalue, min, max, flags);
+          uvalue = va_arg(args, unsigned int);
+        fmtint(buffer, &currlen, maxlen, uvalue, 0,
+               ch == 'o' ? 8 : (ch == 'u' ? 10 : 16), min, max, flags);
         break;
+      case 'F':
       case 'E':
-        flags |= DP_F_UP;
-      case 'e':
-        if (cflags == DP_C_LDOUBLE)
-          fvalue = va_arg(args, long double);
-        else
-          fvalue = va_arg(args, double);
-        break;
       case 'G':
         flags |= DP_F_UP;
+      case 'f':
+      case 'e':
       case 'g':
         if (cflags == DP_C_LDOUBLE)
-          fvalue = va_arg(args, long double);
+          fvalue = (double) va_arg(args, long double);
         else
           fvalue = va_arg(args, double);
+        fmtfp(buffer, &currlen, maxlen, fvalue, min, max, flags, ch);
         break;
       case 'c':
-        dopr_outch(buffer, &currlen, maxlen, va_arg(args, int));
+        cvalue = (char) va_arg(args, int);
+        fmtstr(buffer, &currlen, maxlen, &cvalue, 1, flags, min, -1);
         break;
       case 's':
         strvalue = va_arg(args, char *);
-        if (max < 0)
-          max = maxlen; /* ie, no max */
-        fmtstr(buffer, &currlen, maxlen, strvalue, flags, min, max);
+        fmtstr(buffer, &currlen, maxlen, strvalue, -1, flags, min, max);
         break;
       case 'p':
         strvalue = va_arg(args, void *);
-        fmtint(buffer, &currlen, maxlen, (long) strvalue, 16, min, max, flags);
+        fmtint(buffer, &currlen, maxlen, (uintptr_t) strvalue, 0, 16,
+               min, max, flags | DP_F_NUM | DP_F_UNSIGNED);
         break;
       case 'n':
-        if (cflags == DP_C_SHORT) {
+        if (cflags == DP_C_CHAR) {
+          signed char *num;
+          num = va_arg(args, signed char *);
+          *num = currlen;
+        } else if (cflags == DP_C_SHORT) {
           short int *num;
           num = va_arg(args, short int *);
           *num = currlen;
@@ -475,6 +525,18 @@ dopr(char *buffer, size_t maxlen, const char *format, va_list args)
           long long *num;
           num = va_arg(args, long long *);
           *num = currlen;
+        } else if (cflags == DP_C_SIZE) {
+          ssize_t *num;
+          num = va_arg(args, ssize_t *);
+          *num = currlen;
+        } else if (cflags == DP_C_INTMAX) {
+          intmax_t *num;
+          num = va_arg(args, intmax_t *);
+          *num = currlen;
+        } else if (cflags == DP_C_PTRDIFF) {
+          ptrdiff_t *num;
+          num = va_arg(args, ptrdiff_t *);
+          *num = currlen;
         } else {
           int *num;
           num = va_arg(args, int *);
@@ -482,7 +544,7 @@ dopr(char *buffer, size_t maxlen, const char *format, va_list args)
         }
         break;
       case '%':
-        dopr_outch(buffer, &currlen, maxlen, ch);
+        dopr_outmem(buffer, &currlen, maxlen, &ch, 1);
         break;
       case 'w': /* not supported yet, treat as next char */
         ch = *format++;
@@ -507,270 +569,548 @@ dopr(char *buffer, size_t maxlen, const char *format, va_list args)
     buffer[maxlen - 1] = '\0';
 }
 
+/*
+ * Output len characters of value, or up to the NUL if len is
+ * negative, no more than max (if not negative) and padded to min.
+ */
 static void
 fmtstr(char *buffer, size_t *currlen, size_t maxlen,
-    char *value, int flags, int min, int max)
+    const char *value, int len, int flags, int min, int max)
 {
-  int cnt = 0, padlen, strln;     /* amount to pad */
+  int padlen;     /* amount to pad */
 
   if (value == 0)
     value = "<NULL>";
 
-  for (strln = 0; value[strln]; ++strln); /* strlen */
-  padlen = min - strln;
-  if (padlen < 0)
-    padlen = 0;
+  if (len < 0)
+    for (len = 0; value[len] && (max < 0 || len < max); ++len); /* strnlen */
+  else if (max >= 0 && len > max)
+    len = max;
+
+  padlen = min - len;
+  if (!(flags & DP_F_MINUS))
+    dopr_outpad(buffer, currlen, maxlen, ' ', padlen);
+  dopr_outmem(buffer, currlen, maxlen, value, len);
   if (flags & DP_F_MINUS)
-    padlen = -padlen; /* Left Justify */
+    dopr_outpad(buffer, currlen, maxlen, ' ', padlen);
+}
 
-  while ((padlen > 0) && (cnt < max)) {
-    dopr_outch(buffer, currlen, maxlen, ' ');
-    --padlen;
-    ++cnt;
-  }
-  while (*value && (cnt < max)) {
-    dopr_outch(buffer, currlen, maxlen, *value++);
-    ++cnt;
-  }
-  while ((padlen < 0) && (cnt < max)) {
-    dopr_outch(buffer, currlen, maxlen, ' ');
-    ++padlen;
-    ++cnt;
+/*
+ * Convert uvalue into the digits ending at end, returning where they start.
+ * Decimal goes two digits per division.
+ */
+static char *
+fmtdigits(char *end, unsigned long long uvalue, int base, int caps)
+{
+  const char *digits = caps ? "0123456789ABCDEF" : "0123456789abcdef";
+  unsigned int shift, pair;
+
+  if (base == 10) {
+    while (uvalue >= 100) {
+      pair = (unsigned int) (uvalue % 100);
+      uvalue /= 100;
+      end -= 2;
+      end[0] = digit_pairs[pair * 2];
+      end[1] = digit_pairs[pair * 2 + 1];
+    }
+    if (uvalue >= 10) {
+      end -= 2;
+      end[0] = digit_pairs[uvalue * 2];
+      end[1] = digit_pairs[uvalue * 2 + 1];
+    } else {
+      *--end = (char) ('0' + uvalue);
+    }
+  } else {
+    shift = base == 16 ? 4 : 3;
+    do {
+      *--end = digits[uvalue & (base - 1)];
+      uvalue >>= shift;
+    } while (uvalue);
   }
-}
 
-/* Have to handle DP_F_NUM (ie 0x and 0 alternates) */
+  return end;
+}
 
 static void
 fmtint(char *buffer, size_t *currlen, size_t maxlen,
-    long value, int base, int min, int max, int flags)
+    unsigned long long uvalue, int neg, int base, int min, int max, int flags)
 {
-  unsigned long uvalue;
-  char convert[20];
-  int signvalue = 0, place = 0, caps = 0;
+  char convert[DP_INT_DIGITS];
+  char prefix[3];
+  char *digits;
+  int place, prefixlen = 0;
   int spadlen = 0; /* amount to space pad */
   int zpadlen = 0; /* amount to zero pad */
 
-#define PADMAX(x,y) ((x) > (y) ? (x) : (y))
-
-  if (max < 0)
-    max = 0;
-
-  uvalue = value;
-
   if (!(flags & DP_F_UNSIGNED)) {
-    if (value < 0) {
-      signvalue = '-';
-      uvalue = -value;
-    } else if (flags & DP_F_PLUS)  /* Do a sign (+/i) */
-      signvalue = '+';
+    if (neg)
+      prefix[prefixlen++] = '-';
+    else if (flags & DP_F_PLUS)  /* Do a sign (+/i) */
+      prefix[prefixlen++] = '+';
     else if (flags & DP_F_SPACE)
-      signvalue = ' ';
+      prefix[prefixlen++] = ' ';
   }
 
-  if (flags & DP_F_UP)
-    caps = 1; /* Should characters be upper case? */
-  do {
-    convert[place++] =
-        (caps ? "0123456789ABCDEF" : "0123456789abcdef")
-        [uvalue % (unsigned)base];
-    uvalue = (uvalue / (unsigned)base );
-  } while (uvalue && (place < 20));
-  if (place == 20)
-    place--;
-  convert[place] = 0;
+  if (uvalue == 0 && max == 0) {
+    /* Explicit zero precision and a zero value print no digits */
+    digits = convert + sizeof(convert);
+  } else {
+    digits = fmtdigits(convert + sizeof(convert), uvalue, base,
+                       flags & DP_F_UP);
+  }
+  place = (int) (convert + sizeof(convert) - digits);
 
   zpadlen = max - place;
-  spadlen = min - PADMAX(max, place) - (signvalue ? 1 : 0);
   if (zpadlen < 0)
     zpadlen = 0;
-  if (spadlen < 0)
-    spadlen = 0;
-  if (flags & DP_F_ZERO) {
-    zpadlen = PADMAX(zpadlen, spadlen);
+
+  if (flags & DP_F_NUM) {
+    /* Octal gets a leading zero, hex 0x */
+    if (base == 8 && zpadlen == 0 && (place == 0 || *digits != '0'))
+      zpadlen = 1;
+    else if (base == 16 && uvalue != 0) {
+      prefix[prefixlen++] = '0';
+      prefix[prefixlen++] = (flags & DP_F_UP) ? 'X' : 'x';
+    }
+  }
+  spadlen = min - place - zpadlen - prefixlen;
+  if ((flags & DP_F_ZERO) && !(flags & DP_F_MINUS) && max < 0) {
+    zpadlen += spadlen > 0 ? spadlen : 0;
     spadlen = 0;
   }
+
+  if (!(flags & DP_F_MINUS))
+    dopr_outpad(buffer, currlen, maxlen, ' ', spadlen);
+  dopr_outmem(buffer, currlen, maxlen, prefix, prefixlen);
+  dopr_outpad(buffer, currlen, maxlen, '0', zpadlen);
+  dopr_outmem(buffer, currlen, maxlen, digits, place);
   if (flags & DP_F_MINUS)
-    spadlen = -spadlen; /* Left Justifty */
+    dopr_outpad(buffer, currlen, maxlen, ' ', spadlen);
+}
+
+/*
+ * Floating point.
+ *
+ * The decimal digits of a double are produced exactly, with no floating
+ * point arithmetic: the value is split into mantissa and binary exponent,
+ * the integer part is converted from a big integer by dividing out 10^9
+ * at a time, and the fraction, kept as a big fixed point number, yields
+ * nine digits per multiplication by 10^9. Rounding is to nearest, ties to
+ * even, on the exact value, so results match C libraries that get this
+ * right (e.g. glibc).
+ */
+
+/* Significant digits produced. Beyond that, zeros are output. */
+#define DP_FP_DIGITS   400
+
+/* 2^1024, or a 1074 bit fraction, in 32-bit limbs */
+#define DP_FP_LIMBS    35
+
+#define DP_FP_CHUNK    1000000000U    /* 10^9 */
 
-  /* Spaces */
-  while (spadlen > 0) {
-    dopr_outch(buffer, currlen, maxlen, ' ');
-    --spadlen;
+typedef struct {
+  char    digits[DP_FP_DIGITS + 10];  /* Significant digits */
+  int     ndigits;
+  int     exp10;                      /* Decimal exponent of digits[0] */
+  int     round;                      /* First digit not in digits */
+  int     sticky;                     /* Anything non-zero after that */
+} fp_digits;
+
+/*
+ * Write the 9 digits of chunk into out.
+ */
+static void
+fmtchunk(char *out, unsigned int chunk)
+{
+  char *end = out + 9;
+  unsigned int pair;
+  int i;
+
+  for (i = 0; i < 4; i++) {
+    pair = chunk % 100;
+    chunk /= 100;
+    end -= 2;
+    end[0] = digit_pairs[pair * 2];
+    end[1] = digit_pairs[pair * 2 + 1];
   }
+  out[0] = (char) ('0' + chunk);
+}
+
+/*
+ * Produce the significant digits of the non-negative finite value
+ * mant * 2^exp2, until want(exp10) + 1 digits are there. f_prec >= 0
+ * means "%f" with that precision, so want depends on where the first
+ * digit is, otherwise want is e_digits.
+ */
+static void
+fpdigits(fp_digits *fd, unsigned long long mant, int exp2,
+    int f_prec, int e_digits)
+{
+  uint32_t big[DP_FP_LIMBS];
+  char ibuf[DP_FP_DIGITS + 10];
+  unsigned long long ipart, acc;
+  int nlimbs, i, k, shift, want, lead;
+  char *p;
 
-  /* Sign */
-  if (signvalue)
-    dopr_outch(buffer, currlen, maxlen, signvalue);
+  fd->ndigits = 0;
+  fd->exp10 = 0;
+  fd->round = 0;
+  fd->sticky = 0;
 
-  /* Zeros */
-  if (zpadlen > 0) {
-    while (zpadlen > 0) {
-      dopr_outch(buffer, currlen, maxlen, '0');
-      --zpadlen;
+  /*
+   * Integer part.
+   */
+  if (exp2 >= 0 && exp2 <= 11) {
+    ipart = mant << exp2;
+    mant = 0;
+  } else if (exp2 > 11) {
+    /* Big integer mant << exp2, then 9 digits at a time */
+    nlimbs = (exp2 + 64) / 32 + 1;
+    memset(big, 0, nlimbs * sizeof(big[0]));
+    k = exp2 / 32;
+    shift = exp2 % 32;
+    big[k] = (uint32_t) (mant << shift);
+    big[k + 1] = (uint32_t) ((mant << shift) >> 32);
+    big[k + 2] = shift ? (uint32_t) (mant >> (64 - shift)) : 0;
+    while (nlimbs > 0 && big[nlimbs - 1] == 0)
+      nlimbs--;
+
+    p = ibuf + sizeof(ibuf);
+    while (nlimbs > 0) {
+      acc = 0;
+      for (i = nlimbs - 1; i >= 0; i--) {
+        acc = (acc << 32) | big[i];
+        big[i] = (uint32_t) (acc / DP_FP_CHUNK);
+        acc %= DP_FP_CHUNK;
+      }
+      while (nlimbs > 0 && big[nlimbs - 1] == 0)
+        nlimbs--;
+      p -= 9;
+      fmtchunk(p, (unsigned int) acc);
     }
+    while (*p == '0')
+      p++;
+
+    fd->ndigits = (int) (ibuf + sizeof(ibuf) - p);
+    memcpy(fd->digits, p, fd->ndigits);
+    fd->exp10 = fd->ndigits - 1;
+    mant = 0;
+    ipart = 0;
+  } else if (exp2 > -64) {
+    ipart = mant >> -exp2;
+    mant &= (1ULL << -exp2) - 1;
+  } else {
+    ipart = 0;
   }
 
-  /* Digits */
-  while (place > 0)
-    dopr_outch(buffer, currlen, maxlen, convert[--place]);
+  if (ipart != 0) {
+    p = fmtdigits(ibuf + sizeof(ibuf), ipart, 10, 0);
+    fd->ndigits = (int) (ibuf + sizeof(ibuf) - p);
+    memcpy(fd->digits, p, fd->ndigits);
+    fd->exp10 = fd->ndigits - 1;
+  }
 
-  /* Left Justified spaces */
-  while (spadlen < 0) {
-    dopr_outch (buffer, currlen, maxlen, ' ');
-    ++spadlen;
+  want = f_prec >= 0 ? fd->exp10 + 1 + f_prec : e_digits;
+  if (fd->ndigits > want) {
+    fd->round = fd->digits[want] - '0';
+    for (i = want + 1; i < fd->ndigits; i++)
+      if (fd->digits[i] != '0')
+        fd->sticky = 1;
+    fd->sticky |= mant != 0;
+    fd->ndigits = want;
+    return;
   }
-}
 
-static long double
-pow10(int exp)
-{
-  long double result = 1;
+  if (mant == 0)
+    return;
+
+  /*
+   * Fraction: mant / 2^-exp2, scaled to a whole number of limbs so
+   * that what carries out of the top limb is the next digit chunk.
+   */
+  k = -exp2;
+  nlimbs = (k + 31) / 32;
+  shift = nlimbs * 32 - k;
+  memset(big, 0, nlimbs * sizeof(big[0]));
+  big[0] = (uint32_t) (mant << shift);
+  if (nlimbs > 1)
+    big[1] = (uint32_t) ((mant << shift) >> 32);
+  if (nlimbs > 2)
+    big[2] = shift ? (uint32_t) (mant >> (64 - shift)) : 0;
+
+  lead = 0;
+  i = 0;
+  while (1) {
+    /* Drop trailing zero limbs, which never become non-zero again. */
+    while (i < nlimbs && big[i] == 0)
+      i++;
+    if (i == nlimbs)
+      break;
+
+    acc = 0;
+    for (k = i; k < nlimbs; k++) {
+      acc += (unsigned long long) big[k] * DP_FP_CHUNK;
+      big[k] = (uint32_t) acc;
+      acc >>= 32;
+    }
+
+    if (fd->ndigits == 0 && acc == 0) {
+      /* Nine more leading zeros */
+      lead += 9;
+      fd->exp10 = -lead - 1;
+      if (f_prec >= 0 && lead > f_prec) {
+        fd->sticky = 1;
+        fd->ndigits = 0;
+        fd->round = 0;
+        return;
+      }
+      continue;
+    }
+
+    fmtchunk(fd->digits + fd->ndigits, (unsigned int) acc);
+    if (fd->ndigits == 0) {
+      /* Skip leading zeros of the first non-zero chunk */
+      for (k = 0; fd->digits[k] == '0'; k++)
+        lead++;
+      memmove(fd->digits, fd->digits + k, 9 - k);
+      fd->ndigits = 9 - k;
+      fd->exp10 = -lead - 1;
+    } else {
+      fd->ndigits += 9;
+    }
 
-  while (exp) {
-    result *= 10;
-    exp--;
+    want = f_prec >= 0 ? fd->exp10 + 1 + f_prec : e_digits;
+    if (want < 0)
+      want = -1;
+    if (fd->ndigits > want || fd->ndigits > DP_FP_DIGITS)
+      break;
   }
 
-  return result;
+  want = f_prec >= 0 ? fd->exp10 + 1 + f_prec : e_digits;
+  if (want > DP_FP_DIGITS)
+    want = DP_FP_DIGITS;
+  for (k = i; k < nlimbs; k++)
+    if (big[k] != 0)
+      fd->sticky = 1;
+  if (want < 0) {
+    fd->sticky = 1;
+    fd->ndigits = 0;
+  } else if (fd->ndigits > want) {
+    fd->round = fd->digits[want] - '0';
+    for (k = want + 1; k < fd->ndigits; k++)
+      if (fd->digits[k] != '0')
+        fd->sticky = 1;
+    fd->ndigits = want;
+  }
 }
 
-static long
-round(long double value)
+/*
+ * Round the digits to nearest, ties to even. Returns TRUE if this added
+ * a digit in front (e.g. 9.99 -> 10.0).
+ */
+static int
+fpround(fp_digits *fd)
 {
-  long intpart = value;
+  int i;
+
+  if (fd->round < 5 ||
+      (fd->round == 5 && !fd->sticky &&
+       (fd->ndigits == 0 || ((fd->digits[fd->ndigits - 1] - '0') & 1) == 0)))
+    return 0;
 
-  value -= intpart;
-  if (value >= 0.5)
-    intpart++;
+  for (i = fd->ndigits - 1; i >= 0; i--) {
+    if (fd->digits[i] != '9') {
+      fd->digits[i]++;
+      return 0;
+    }
+    fd->digits[i] = '0';
+  }
 
-  return intpart;
+  memmove(fd->digits + 1, fd->digits, fd->ndigits);
+  fd->digits[0] = '1';
+  fd->ndigits++;
+  fd->exp10++;
+  return 1;
 }
 
+/*
+ * Output the digits in [from, to) of fd, zeros where there are none.
+ */
 static void
-fmtfp(char *buffer, size_t *currlen, size_t maxlen, long double fvalue,
-      int min, int max, int flags)
+fpoutdigits(char *buffer, size_t *currlen, size_t maxlen, fp_digits *fd,
+    int from, int to)
 {
-  char iconvert[20], fconvert[20];
-  int signvalue = 0, iplace = 0, fplace = 0;
-  int padlen = 0; /* amount to pad */
-  int zpadlen = 0, caps = 0;
-  long intpart, fracpart;
-  long double ufvalue;
+  int have;
 
-  /*
-   * AIX manpage says the default is 0, but Solaris says the default
-   * is 6, and sprintf on AIX defaults to 6
-   */
-  if (max < 0)
-    max = 6;
+  if (from < 0) {
+    dopr_outpad(buffer, currlen, maxlen, '0', (to < 0 ? to : 0) - from);
+    from = 0;
+  }
+  if (to <= from)
+    return;
+
+  have = fd->ndigits - from;
+  if (have > to - from)
+    have = to - from;
+  if (have > 0)
+    dopr_outmem(buffer, currlen, maxlen, fd->digits + from, have);
+  else
+    have = 0;
+  dopr_outpad(buffer, currlen, maxlen, '0', to - from - have);
+}
+
+static void
+fmtfp(char *buffer, size_t *currlen, size_t maxlen, double fvalue,
+      int min, int max, int flags, char conv)
+{
+  fp_digits fd;
+  unsigned long long bits, mant;
+  char sign = 0, expbuf[8], *exps;
+  int exp2, style, intlen, fraclen, explen = 0, dot, padlen, len, x;
 
-  ufvalue = abs_val(fvalue);
+  memcpy(&bits, &fvalue, sizeof(bits));
+  mant = bits & ((1ULL << 52) - 1);
+  exp2 = (int) ((bits >> 52) & 0x7FF);
 
-  if (fvalue < 0)
-    signvalue = '-';
+  if (bits >> 63)
+    sign = '-';
   else if (flags & DP_F_PLUS)  /* Do a sign (+/i) */
-    signvalue = '+';
+    sign = '+';
   else if (flags & DP_F_SPACE)
-    signvalue = ' ';
-
-  intpart = ufvalue;
-
-  /*
-   * Sorry, we only support 9 digits past the decimal because of our
-   * conversion method
-   */
-  if (max > 9)
-    max = 9;
-
-  /* We "cheat" by converting the fractional part to integer by
-   * multiplying by a factor of 10
-   */
-  fracpart = round((pow10 (max)) * (ufvalue - intpart));
-
-  if (fracpart >= pow10 (max)) {
-    intpart++;
-    fracpart -= pow10 (max);
+    sign = ' ';
+
+  if (exp2 == 0x7FF) {
+    padlen = min - 3 - (sign ? 1 : 0);
+    if (!(flags & DP_F_MINUS))
+      dopr_outpad(buffer, currlen, maxlen, ' ', padlen);
+    if (sign)
+      dopr_outmem(buffer, currlen, maxlen, &sign, 1);
+    dopr_outmem(buffer, currlen, maxlen,
+                mant ? ((flags & DP_F_UP) ? "NAN" : "nan") :
+                ((flags & DP_F_UP) ? "INF" : "inf"), 3);
+    if (flags & DP_F_MINUS)
+      dopr_outpad(buffer, currlen, maxlen, ' ', padlen);
+    return;
   }
 
-  /* Convert integer part */
-  do {
-    iconvert[iplace++] =
-        (caps ? "0123456789ABCDEF" : "0123456789abcdef")
-        [intpart % 10];
-    intpart = (intpart / 10);
-  } while(intpart && (iplace < 20));
-  if (iplace == 20)
-    iplace--;
-  iconvert[iplace] = 0;
-
-  /* Convert fractional part */
-  do {
-    fconvert[fplace++] =
-        (caps ? "0123456789ABCDEF" : "0123456789abcdef")
-        [fracpart % 10];
-    fracpart = (fracpart / 10);
-  } while(fracpart && (fplace < 20));
-  if (fplace == 20)
-    fplace--;
-  fconvert[fplace] = 0;
-
-  /* -1 for decimal point, another -1 if we are printing a sign */
-  padlen = min - iplace - max - 1 - ((signvalue) ? 1 : 0);
-  zpadlen = max - fplace;
-  if (zpadlen < 0)
-    zpadlen = 0;
-  if (padlen < 0)
-    padlen = 0;
-  if (flags & DP_F_MINUS)
-    padlen = -padlen; /* Left Justifty */
-
-  if ((flags & DP_F_ZERO) && (padlen > 0)) {
-    if (signvalue) {
-      dopr_outch(buffer, currlen, maxlen, signvalue);
-      --padlen;
-      signvalue = 0;
-    }
-    while (padlen > 0) {
-      dopr_outch(buffer, currlen, maxlen, '0');
-      --padlen;
-    }
+  if (exp2 == 0) {
+    exp2 = -1074;
+  } else {
+    mant |= 1ULL << 52;
+    exp2 -= 1075;
   }
-  while (padlen > 0) {
-    dopr_outch(buffer, currlen, maxlen, ' ');
-    --padlen;
-  }
-  if (signvalue)
-    dopr_outch(buffer, currlen, maxlen, signvalue);
 
-  while (iplace > 0)
-    dopr_outch(buffer, currlen, maxlen, iconvert[--iplace]);
+  if (max < 0)
+    max = 6;
 
-  /*
-   * Decimal point.  This should probably use locale to find the
-   * correct char to print out.
-   */
-  dopr_outch(buffer, currlen, maxlen, '.');
+  conv |= 0x20;  /* lower case */
+  if (conv == 'g' && max == 0)
+    max = 1;
 
-  while (fplace > 0)
-    dopr_outch(buffer, currlen, maxlen, fconvert[--fplace]);
+  if (conv == 'f')
+    fpdigits(&fd, mant, exp2, max, 0);
+  else
+    fpdigits(&fd, mant, exp2, -1, conv == 'g' ? max : max + 1);
+  fpround(&fd);
+  if (fd.ndigits == 0)
+    fd.exp10 = conv == 'f' ? -max - 1 : 0;
+
+  style = conv;
+  if (conv == 'g') {
+    /* Precision is significant digits, which have been produced */
+    x = fd.exp10;
+    if (x < max && x >= -4) {
+      style = 'f';
+      max = max - 1 - x;
+    } else {
+      style = 'e';
+      max = max - 1;
+    }
 
-  while (zpadlen > 0) {
-    dopr_outch(buffer, currlen, maxlen, '0');
-    --zpadlen;
+    if (!(flags & DP_F_NUM)) {
+      /* Trailing zeros go */
+      while (fd.ndigits > 0 && fd.digits[fd.ndigits - 1] == '0')
+        fd.ndigits--;
+      if (style == 'f') {
+        len = fd.ndigits - (x + 1);
+        max = len > 0 ? len : 0;
+      } else {
+        max = fd.ndigits > 1 ? fd.ndigits - 1 : 0;
+      }
+    }
   }
 
-  while (padlen < 0) {
-    dopr_outch(buffer, currlen, maxlen, ' ');
-    ++padlen;
+  if (style == 'f') {
+    intlen = fd.exp10 >= 0 ? fd.exp10 + 1 : 1;
+  } else {
+    intlen = 1;
+    x = fd.ndigits == 0 ? 0 : fd.exp10;
+    exps = fmtdigits(expbuf + sizeof(expbuf), x < 0 ? -x : x, 10, 0);
+    if (expbuf + sizeof(expbuf) - exps < 2)
+      *--exps = '0';
+    *--exps = x < 0 ? '-' : '+';
+    *--exps = (flags & DP_F_UP) ? 'E' : 'e';
+    explen = (int) (expbuf + sizeof(expbuf) - exps);
   }
+  fraclen = max;
+  dot = (fraclen > 0 || (flags & DP_F_NUM)) ? 1 : 0;
+
+  len = (sign ? 1 : 0) + intlen + dot + fraclen + explen;
+  padlen = min - len;
+
+  if (!(flags & DP_F_MINUS) && !(flags & DP_F_ZERO))
+    dopr_outpad(buffer, currlen, maxlen, ' ', padlen);
+  if (sign)
+    dopr_outmem(buffer, currlen, maxlen, &sign, 1);
+  if (!(flags & DP_F_MINUS) && (flags & DP_F_ZERO))
+    dopr_outpad(buffer, currlen, maxlen, '0', padlen);
+
+  if (style == 'f') {
+    if (fd.exp10 >= 0)
+      fpoutdigits(buffer, currlen, maxlen, &fd, 0, fd.exp10 + 1);
+    else
+      dopr_outpad(buffer, currlen, maxlen, '0', 1);
+
+    /*
+     * Decimal point.  This should probably use locale to find the
+     * correct char to print out.
+     */
+    if (dot)
+      dopr_outmem(buffer, currlen, maxlen, ".", 1);
+
+    fpoutdigits(buffer, currlen, maxlen, &fd, fd.exp10 + 1,
+                fd.exp10 + 1 + fraclen);
+  } else {
+    fpoutdigits(buffer, currlen, maxlen, &fd, 0, 1);
+    if (dot)
+      dopr_outmem(buffer, currlen, maxlen, ".", 1);
+    fpoutdigits(buffer, currlen, maxlen, &fd, 1, 1 + fraclen);
+    dopr_outmem(buffer, currlen, maxlen, exps, explen);
+  }
+
+  if (flags & DP_F_MINUS)
+    dopr_outpad(buffer, currlen, maxlen, ' ', padlen);
 }
 
 static void
-dopr_outch(char *buffer, size_t *currlen, size_t maxlen, char c)
+dopr_outmem(char *buffer, size_t *currlen, size_t maxlen, const char *s,
+    size_t len)
 {
-  if (*currlen < maxlen)
-    buffer[(*currlen)++] = c;
+  if (len > maxlen - *currlen)
+    len = maxlen - *currlen;
+  memcpy(buffer + *currlen, s, len);
+  *currlen += len;
+}
+
+static void
+dopr_outpad(char *buffer, size_t *currlen, size_t maxlen, char c, int len)
+{
+  if (len <= 0)
+    return;
+  if ((size_t) len > maxlen - *currlen)
+    len = (int) (maxlen - *currlen);
+  memset(buffer + *currlen, c, len);
+  *currlen += len;
 }
 #endif /* !defined(HAVE_SNPRINTF) || !defined(HAVE_VSNPRINTF) */
 
@@ -778,6 +1118,9 @@ dopr_outch(char *buffer, size_t *currlen, size_t maxlen, char c)
 int
 vsnprintf(char *str, size_t count, const char *fmt, va_list args)
 {
+  if (count == 0)
+    return 0;
+
   str[0] = 0;
   dopr(str, count, fmt, args);
 
@@ -790,12 +1133,13 @@ int
 snprintf(char *str,size_t count,const char *fmt,...)
 {
   va_list ap;
+  int len;
 
   va_start(ap, fmt);
-  (void) vsnprintf(str, count, fmt, ap);
+  len = vsnprintf(str, count, fmt, ap);
   va_end(ap);
 
-  return(strlen(str));
+  return(len);
 }
 
 #endif /* !HAVE_SNPRINTF */
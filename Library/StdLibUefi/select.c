@@ -57,6 +57,7 @@
 #include <sys/poll.h>
 #include <sys/param.h>
 #include <sys/time.h>
+#include <limits.h>
 #ifndef KERNEL
 #define KERNEL
 #include <errno.h>
@@ -65,12 +66,6 @@
 #include <errno.h>
 #endif
 
-#ifdef  EFI_NT_EMULATOR
-#define _SELECT_DELAY_  10000
-#else
-#define _SELECT_DELAY_  1000
-#endif
-
 #define MAX_SLEEP_DELAY 0xfffffffe
 
 /** Sleep for the specified number of Microseconds.
@@ -98,53 +93,6 @@ sleep( unsigned int Seconds )
   return (usleep( (useconds_t)(Seconds * 1000000) ));
 }
 
-static int
-selscan(
-  fd_mask **ibits,
-  fd_mask **obits,
-  int nfd,
-  int *nselected
-  )
-{
-  int   msk;
-  int i;
-  int j;
-  int fd;
-  int n;
-  struct pollfd pfd;
-  int FdCount;
-  fd_mask   bits;
-  /* Note: backend also returns POLLHUP/POLLERR if appropriate. */
-  static int16_t  flag[3] = { POLLRDNORM, POLLWRNORM, POLLRDBAND };
-
-  for (msk = 0, n = 0; msk < 3; msk++) {
-    if (ibits[msk] == NULL)
-      continue;
-    for (i = 0; i < nfd; i += NFDBITS) {
-      bits = ibits[ msk ][ i / NFDBITS ];
-      while (( 0 != (j = ffs(bits))) && ((fd = i + --j) < nfd)) {
-        bits &= ~(1 << j);
-
-        pfd.fd = fd;
-        pfd.events = flag[msk];
-        pfd.revents = 0;
-        FdCount = poll ( &pfd, 1, 0 );
-        if ( -1 == FdCount ) {
-          return errno;
-        }
-        if ( 0 != FdCount ) {
-          obits[msk][(fd)/NFDBITS] |=
-            (1 << ((fd) % NFDBITS));
-          n++;
-          break;
-        }
-      }
-    }
-  }
-  *nselected = n;
-  return (0);
-}
-
 int
 select(
   int nd,
@@ -158,6 +106,11 @@ select(
   int error, forever, nselected;
   u_int nbufbytes, ncpbytes, nfdbits;
   int64_t timo;
+  struct pollfd *pfd;
+  int npfd, fd, i, msk, ms;
+  short events;
+  /* Note: backend also returns POLLHUP/POLLERR if appropriate. */
+  static const short flag[3] = { POLLRDNORM, POLLWRNORM, POLLRDBAND };
 
   if (nd < 0)
     return (EINVAL);
@@ -210,29 +163,57 @@ select(
   }
 
   /*
-   *  Poll for I/O events
+   *  Hand all the descriptors to poll at once, so that it can
+   *  sleep on their events instead of select spinning here.
    */
+  error = 0;
   nselected = 0;
-  do {
-    /*
-     *  Scan for pending I/O
-     */
-    error = selscan(ibits, obits, nd, &nselected);
-    if (error || nselected)
-      break;
+  npfd = 0;
+  pfd = malloc(nd * sizeof *pfd);
+  if (pfd == NULL && nd != 0) {
+    error = ENOMEM;
+  }
+  for (fd = 0; error == 0 && fd < nd; fd++) {
+    events = 0;
+    for (msk = 0; msk < 3; msk++) {
+      if (ibits[msk] != NULL &&
+          (ibits[msk][fd / NFDBITS] & (1 << (fd % NFDBITS))) != 0) {
+        events |= flag[msk];
+      }
+    }
+    if (events != 0) {
+      pfd[npfd].fd = fd;
+      pfd[npfd].events = events;
+      pfd[npfd].revents = 0;
+      npfd++;
+    }
+  }
 
-    /*
-     *  Adjust timeout is needed
-     */
-    if (timo)  {
-      /*
-       *  Give it a rest
-       */
-      usleep( _SELECT_DELAY_ );
-      timo -= _SELECT_DELAY_;
+  if (error == 0) {
+    if (forever) {
+      ms = INFTIM;
+    } else if (timo <= 0) {
+      ms = 0;
+    } else {
+      ms = (int) MIN((timo + 999) / 1000, INT_MAX);
+    }
+    if (poll(pfd, npfd, ms) < 0) {
+      error = errno;
     }
+  }
 
-  } while (timo > 0 || forever);
+  for (i = 0; error == 0 && i < npfd; i++) {
+    fd = pfd[i].fd;
+    for (msk = 0; msk < 3; msk++) {
+      if (ibits[msk] != NULL &&
+          (ibits[msk][fd / NFDBITS] & (1 << (fd % NFDBITS))) != 0 &&
+          (pfd[i].revents & (flag[msk] | POLL_RETONLY)) != 0) {
+        obits[msk][fd / NFDBITS] |= (1 << (fd % NFDBITS));
+        nselected++;
+      }
+    }
+  }
+  free(pfd);
 
   /* select is not restarted after signals... */
   if (error == ERESTART)
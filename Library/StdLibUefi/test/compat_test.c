@@ -0,0 +1,426 @@
+/*
+ * Host test for the compat.c snprintf/vsnprintf engine, comparing its
+ * output with the host C library (glibc is the reference). See the
+ * Makefile for how it's built.
+ *
+ *   compat_test [cases [seed]]
+ *
+ * A fixed set of cases is run first, then a random sweep of integer,
+ * floating point, string, character and %p conversions with random
+ * flags, width, precision and length modifiers, surrounded by literal
+ * text. Each case is also run truncated, and with a zero-sized buffer.
+ *
+ * Known divergences, which are counted but not reported as failures:
+ *
+ *  - "%#g" of a value that rounds up to the next power of ten, e.g.
+ *    999999.5: glibc prints "1.e+06", C requires (and compat.c prints)
+ *    "1.00000e+06", as '#' keeps the trailing zeros.
+ *  - "%p" of NULL: glibc prints "(nil)", compat.c prints "0".
+ *  - "%s" of NULL: glibc prints "(null)", compat.c prints "<NULL>".
+ *  - On truncation the return value is the number of characters
+ *    written, not the length the output would have had (C99), and a
+ *    zero-sized buffer returns 0.
+ *  - At most DP_FP_DIGITS (400) significant digits are produced, the
+ *    rest print as zeros. The sweep stays well below that.
+ *
+ * The first three are checked against what compat.c is expected to
+ * print instead; the fourth is checked as the expected behavior.
+ */
+
+#include <float.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+int compat_snprintf(char *str, size_t count, const char *fmt, ...);
+int compat_vsnprintf(char *str, size_t count, const char *fmt, va_list args);
+
+#define OUT_MAX     1024
+#define SHOW_MAX    20
+
+static unsigned long cases;
+static unsigned long failures;
+static unsigned long known;
+
+static uint64_t rng_state;
+
+static uint64_t
+rnd(void)
+{
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+static unsigned int
+rndn(unsigned int n)
+{
+  return (unsigned int) (rnd() % n);
+}
+
+static void
+fail(const char *what, const char *fmt, const char *expect, const char *got)
+{
+  failures++;
+  if (failures <= SHOW_MAX)
+    printf("FAIL %s: format \"%s\"\n  expect \"%s\"\n  got    \"%s\"\n",
+           what, fmt, expect, got);
+}
+
+/*
+ * Is the glibc output for fmt a known divergence?
+ */
+static int
+divergence(const char *fmt, const char *expect)
+{
+  const char *conv = fmt + strlen(fmt) - 1;
+
+  /* "%#g": glibc drops the zeros after a round up to 10^n */
+  if ((*conv == 'g' || *conv == 'G') && strchr(fmt, '#') != NULL &&
+      (strstr(expect, ".e") != NULL || strstr(expect, ".E") != NULL)) {
+    return 1;
+  }
+
+  return 0;
+}
+
+/*
+ * Run fmt through both implementations, fully and truncated.
+ */
+static void
+check(const char *fmt, ...)
+{
+  char expect[OUT_MAX], got[OUT_MAX], trunc[OUT_MAX];
+  va_list ap, aq;
+  int elen, glen, size, sizes[4], i;
+
+  cases++;
+
+  va_start(ap, fmt);
+  va_copy(aq, ap);
+  elen = vsnprintf(expect, sizeof(expect), fmt, aq);
+  va_end(aq);
+
+  if (elen < 0 || elen >= OUT_MAX) {
+    va_end(ap);
+    return;
+  }
+
+  if (divergence(fmt, expect)) {
+    known++;
+    va_end(ap);
+    return;
+  }
+
+  va_copy(aq, ap);
+  glen = compat_vsnprintf(got, sizeof(got), fmt, aq);
+  va_end(aq);
+  if (strcmp(expect, got) != 0 || glen != elen) {
+    fail("output", fmt, expect, got);
+    va_end(ap);
+    return;
+  }
+
+  /*
+   * Truncated, the output must be the prefix glibc writes, and the
+   * return value the number of characters actually written.
+   */
+  sizes[0] = 1;
+  sizes[1] = elen / 2 + 1;
+  sizes[2] = elen;
+  sizes[3] = elen + 1;
+  for (i = 0; i < 4; i++) {
+    size = sizes[i];
+    if (size <= 0)
+      continue;
+    memset(trunc, 'X', sizeof(trunc));
+    va_copy(aq, ap);
+    glen = compat_vsnprintf(trunc, size, fmt, aq);
+    va_end(aq);
+    if (glen != (elen < size ? elen : size - 1) ||
+        strncmp(trunc, expect, glen) != 0 || trunc[glen] != '\0' ||
+        trunc[size] != 'X') {
+      trunc[OUT_MAX - 1] = '\0';
+      fail("truncated", fmt, expect, trunc);
+      va_end(ap);
+      return;
+    }
+  }
+
+  /* Zero-sized buffers are never written */
+  memset(trunc, 'X', 2);
+  va_copy(aq, ap);
+  glen = compat_vsnprintf(trunc, 0, fmt, aq);
+  va_end(aq);
+  if (glen != 0 || trunc[0] != 'X')
+    fail("zero size", fmt, "", "written");
+
+  va_end(ap);
+}
+
+/*
+ * Check compat.c prints expect, where it knowingly differs from glibc.
+ */
+static void
+check_known(const char *expect, const char *fmt, ...)
+{
+  char got[OUT_MAX];
+  va_list ap;
+
+  cases++;
+  known++;
+  va_start(ap, fmt);
+  compat_vsnprintf(got, sizeof(got), fmt, ap);
+  va_end(ap);
+  if (strcmp(expect, got) != 0)
+    fail("known divergence", fmt, expect, got);
+}
+
+static void
+fixed_cases(void)
+{
+  int n;
+
+  check("");
+  check("plain text, no conversions");
+  check("%%");
+  check("100%% %s%%", "done");
+  check("%d %i %u %o %x %X", -42, 42, 42U, 42U, 255U, 255U);
+  check("%d %d %d", 0, INT_MAX, INT_MIN);
+  check("%ld %lu", LONG_MIN, ULONG_MAX);
+  check("%lld %llu %llx", LLONG_MIN, ULLONG_MAX, ULLONG_MAX);
+  check("%hhd %hhu %hd %hu", 300, 300, 70000, 70000);
+  check("%zd %zu %jd %ju %td", (ssize_t) -1, SIZE_MAX, INTMAX_MIN,
+        UINTMAX_MAX, (ptrdiff_t) -5);
+  check("[%5d] [%-5d] [%05d] [%+d] [% d] [%+05d]", 42, 42, 42, 42, 42, -42);
+  check("[%.0d] [%.0x] [%#.0o] [%#o] [%#x] [%#X]", 0, 0U, 0U, 0U, 0U, 0U);
+  check("[%#o] [%#x] [%#X] [%#10.4x]", 8U, 255U, 255U, 255U);
+  check("[%.5d] [%8.5d] [%-8.5d] [%08.5d]", -42, -42, -42, -42);
+  check("[%*d] [%-*d] [%*d]", 6, 42, 6, 42, -6, 42);
+  check("[%.*d] [%.*d]", 4, 42, -1, 42);
+  check("[%*.*f]", 10, 3, 3.14159);
+  check("[%c] [%3c] [%-3c]", 'a', 'b', 'c');
+  check("[%s] [%10s] [%-10s] [%.2s] [%10.2s]", "abc", "abc", "abc",
+        "abc", "abc");
+  check("%p %p", (void *) 0x1234, (void *) &n);
+  check("[%20p] [%-20p]", (void *) 0xdead, (void *) 0xbeef);
+
+  check("%f %e %g", 0.0, 0.0, 0.0);
+  check("%f %e %g", -0.0, -0.0, -0.0);
+  check("%f %F %e %E %g %G", 1.5, 1.5, 1.5, 1.5, 1.5, 1.5);
+  check("%.0f %.0f %.0f %.0f", 0.5, 1.5, 2.5, 3.5);
+  check("%.1f %.2f %.3f", 0.05, 0.005, 0.0005);
+  check("%.20f", 0.1);
+  check("%.40e", 1.0 / 3.0);
+  check("%f", 1e300);
+  check("%.30f", DBL_MIN);
+  check("%e %g", DBL_TRUE_MIN, DBL_TRUE_MIN);
+  check("%e %g %f", DBL_MAX, DBL_MAX, DBL_MAX);
+  check("%g %g %g %g", 100000.0, 1000000.0, 0.0001, 0.00001);
+  check("%g %g", 999999.5, 9999995.0);
+  check("%#g %#.0f %#.0e %#.1g", 1.0, 1.0, 1.0, 999999.5);
+  check("[%10.3f] [%-10.3f] [%010.3f] [%+.3f] [% .3f]",
+        -1.25, -1.25, -1.25, 1.25, 1.25);
+  check("%f %F %e %g", INFINITY, INFINITY, -INFINITY, INFINITY);
+  check("%f %F %e %G", NAN, NAN, NAN, NAN);
+  check("[%10f] [%-10f] [%010f] [%+f]", INFINITY, -INFINITY, INFINITY,
+        INFINITY);
+  check("%Lf %Le %Lg", (long double) 2.5, (long double) 2.5,
+        (long double) 2.5);
+  check("%s is %d years and %.1f%% done, %c%c", "it", 7, 99.5, 'o', 'k');
+
+  check_known("1.00000e+06", "%#g", 999999.5);
+  check_known("0", "%p", (void *) 0);
+  check_known("<NULL>", "%s", (char *) 0);
+}
+
+/*
+ * Random sweep.
+ */
+
+static const char *text[] = {
+  "", "", "", "x", "abc ", " = ", "[", "]", "long literal text run: ",
+};
+
+static unsigned long long
+rnd_int(void)
+{
+  static const unsigned long long edges[] = {
+    0, 1, 9, 10, 99, 100, 127, 128, 255, 256, 32767, 32768, 65535,
+    65536, 2147483647ULL, 2147483648ULL, 4294967295ULL, 4294967296ULL,
+    999999999ULL, 1000000000ULL, 9999999999999999999ULL,
+    0x7FFFFFFFFFFFFFFFULL, 0x8000000000000000ULL, ~0ULL,
+  };
+  unsigned long long v;
+
+  switch (rndn(4)) {
+  case 0:
+    v = edges[rndn(sizeof(edges) / sizeof(edges[0]))];
+    break;
+  case 1:
+    v = rnd() >> rndn(64);
+    break;
+  default:
+    v = rnd() % 100000;
+    break;
+  }
+  return rndn(2) ? v : 0ULL - v;
+}
+
+static double
+rnd_double(void)
+{
+  static const double special[] = {
+    0.0, -0.0, 0.5, 1.5, 2.5, 0.05, 0.125, 999999.5, 9999995.0, 99.95,
+    0.000095, 1e15, 1e16, 1e17, 1e22, 1e23, 5e-324, 2.2250738585072014e-308,
+    1.7976931348623157e308,
+  };
+  uint64_t bits;
+  double v;
+
+  switch (rndn(8)) {
+  case 0:
+    do {
+      bits = rnd();
+      memcpy(&v, &bits, sizeof(v));
+    } while (!isfinite(v));
+    return v;
+  case 1:
+    v = special[rndn(sizeof(special) / sizeof(special[0]))];
+    break;
+  case 2:
+    /* Exact ties at some decimal position */
+    v = ((double) (rnd() % 2000000) + 0.5) / (double) (1 << rndn(8));
+    break;
+  case 3:
+    /* Around powers of ten */
+    v = pow(10.0, (double) ((int) rndn(60) - 30));
+    v = rndn(2) ? nextafter(v, 0.0) : nextafter(v, INFINITY);
+    break;
+  case 4:
+    v = ldexp((double) (rnd() >> 11), (int) rndn(200) - 100);
+    break;
+  case 5:
+    switch (rndn(3)) {
+    case 0:  return INFINITY;
+    case 1:  return -INFINITY;
+    default: return NAN;
+    }
+  default:
+    v = (double) (rnd() % 1000000) / pow(10.0, (double) rndn(10));
+    break;
+  }
+  return rndn(2) ? v : -v;
+}
+
+/*
+ * Append random flags (from allowed), width and precision to f.
+ */
+static char *
+rnd_spec(char *f, const char *allowed, int maxprec)
+{
+  const char *a;
+
+  *f++ = '%';
+  for (a = allowed; *a != '\0'; a++)
+    if (rndn(4) == 0)
+      *f++ = *a;
+  if (rndn(2))
+    f += sprintf(f, "%u", rndn(40));
+  if (maxprec >= 0 && rndn(2))
+    f += sprintf(f, ".%u", rndn(maxprec + 1));
+  return f;
+}
+
+static void
+sweep_one(void)
+{
+  static const char *imods[] = { "", "hh", "h", "l", "ll", "z", "j", "t" };
+  static const char iconv[] = "diouxX";
+  static const char fconv[] = "fFeEgG";
+  char fmt[128], str[32], *f, conv;
+  const char *mod;
+  unsigned long long v;
+  double d;
+  int i, len, kind;
+
+  f = fmt + sprintf(fmt, "%s", text[rndn(sizeof(text) / sizeof(text[0]))]);
+  kind = rndn(10);
+
+  if (kind < 4) {
+    conv = iconv[rndn(sizeof(iconv) - 1)];
+    f = rnd_spec(f, (conv == 'd' || conv == 'i' || conv == 'u') ?
+                 "-+ 0" : "-+ #0", 30);
+    mod = imods[rndn(sizeof(imods) / sizeof(imods[0]))];
+    sprintf(f, "%s%c", mod, conv);
+    v = rnd_int();
+    if (strcmp(mod, "l") == 0)
+      check(fmt, (long) v);
+    else if (strcmp(mod, "ll") == 0)
+      check(fmt, (long long) v);
+    else if (strcmp(mod, "z") == 0)
+      check(fmt, (size_t) v);
+    else if (strcmp(mod, "j") == 0)
+      check(fmt, (intmax_t) v);
+    else if (strcmp(mod, "t") == 0)
+      check(fmt, (ptrdiff_t) v);
+    else
+      check(fmt, (int) v);
+  } else if (kind < 8) {
+    conv = fconv[rndn(sizeof(fconv) - 1)];
+    f = rnd_spec(f, "-+ #0", 40);
+    d = rnd_double();
+    if (rndn(8) == 0) {
+      sprintf(f, "L%c", conv);
+      check(fmt, (long double) d);
+    } else {
+      sprintf(f, "%c", conv);
+      check(fmt, d);
+    }
+  } else if (kind == 8) {
+    len = (int) rndn(sizeof(str));
+    for (i = 0; i < len; i++)
+      str[i] = (char) (' ' + 1 + rndn(94));
+    str[len] = '\0';
+    if (rndn(4) == 0) {
+      f = rnd_spec(f, "-", -1);
+      sprintf(f, "c");
+      check(fmt, len ? str[0] : 'z');
+    } else {
+      f = rnd_spec(f, "-", 20);
+      sprintf(f, "s");
+      check(fmt, str);
+    }
+  } else {
+    f = rnd_spec(f, "-", -1);
+    sprintf(f, "p");
+    v = rnd_int();
+    check(fmt, (void *) (uintptr_t) (v ? v : 1));
+  }
+}
+
+int
+main(int argc, char **argv)
+{
+  unsigned long n, i;
+
+  n = argc > 1 ? strtoul(argv[1], NULL, 0) : 400000;
+  rng_state = argc > 2 ? strtoull(argv[2], NULL, 0) : 1;
+  if (rng_state == 0)
+    rng_state = 1;
+
+  fixed_cases();
+  for (i = 0; i < n; i++)
+    sweep_one();
+
+  printf("%lu cases, %lu failures, %lu known divergences\n",
+         cases, failures, known);
+  return failures != 0;
+}
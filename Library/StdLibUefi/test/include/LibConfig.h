@@ -0,0 +1,3 @@
+/*
+ * Host build stub, compat.c needs nothing from the edk2 one.
+ */
@@ -0,0 +1,4 @@
+/*
+ * Host build stub for the StdLib header.
+ */
+#include <limits.h>
@@ -76,6 +76,14 @@ Revision History
 #include <errno.h>
 #endif
 
+//
+//  Iovecs are gathered into a scratch buffer so that runs of small ones
+//  go out in a single write(), which for a TTY is also a single output
+//  conversion pass. Iovecs that don't fit are written as they are.
+//
+
+#define WRITEV_SCRATCH  2048
+
 //
 //  Name:
 //      writev
@@ -99,46 +107,71 @@ writev(
     int iovcnt
     )
 {
-  const struct iovec   *pVecTmp;
-  char                 *pBuf;
-  size_t                TotalBytes;
-  size_t                i;
-  size_t                ret;
-
-  //
-  //  See how much memory we'll need
-  //
-
-  for (i = 0, TotalBytes = 0, pVecTmp = iov; i < (size_t)iovcnt; i++, pVecTmp++) {
-    TotalBytes += pVecTmp->iov_len;
-  }
-
-  //
-  //  Allocate a contiguous buffer
-  //
-
-  pBuf = (char*)malloc (TotalBytes);
-  if (pBuf == NULL) {
-    errno = ENOMEM;
+  char                  Scratch[WRITEV_SCRATCH];
+  size_t                Fill;
+  size_t                Want;
+  ssize_t               TotalBytes;
+  ssize_t               ret;
+  int                   i;
+
+  if (iovcnt < 0) {
+    errno = EINVAL;
     return -1;
   }
 
-  //
-  //  Copy vectors to the buffer
-  //
-
-  for (; iovcnt; iovcnt--) {
-    bcopy(iov->iov_base, pBuf, iov->iov_len);
-    pBuf += iov->iov_len;
-    iov++;
+  TotalBytes = 0;
+  Fill = 0;
+  for (i = 0; i <= iovcnt; i++) {
+    //
+    //  Gather this iovec if it fits
+    //
+
+    if (i < iovcnt && Fill + iov[i].iov_len <= sizeof (Scratch)) {
+      memcpy (Scratch + Fill, iov[i].iov_base, iov[i].iov_len);
+      Fill += iov[i].iov_len;
+      continue;
+    }
+
+    //
+    //  Flush what was gathered so far
+    //
+
+    if (Fill != 0) {
+      ret = write (fd, Scratch, Fill);
+      if (ret < 0) {
+        return TotalBytes == 0 ? -1 : TotalBytes;
+      }
+      TotalBytes += ret;
+      if ((size_t) ret < Fill) {
+        return TotalBytes;
+      }
+      Fill = 0;
+    }
+
+    if (i == iovcnt) {
+      break;
+    }
+
+    //
+    //  Start gathering afresh, or write a large iovec directly
+    //
+
+    Want = iov[i].iov_len;
+    if (Want <= sizeof (Scratch)) {
+      memcpy (Scratch, iov[i].iov_base, Want);
+      Fill = Want;
+      continue;
+    }
+
+    ret = write (fd, iov[i].iov_base, Want);
+    if (ret < 0) {
+      return TotalBytes == 0 ? -1 : TotalBytes;
+    }
+    TotalBytes += ret;
+    if ((size_t) ret < Want) {
+      return TotalBytes;
+    }
   }
 
-  //
-  //  Use standard write(2) then free buffer
-  //
-
-  ret = write (fd, pBuf, TotalBytes);
-  free (pBuf);
-
-  return (ret);
+  return TotalBytes;
 }
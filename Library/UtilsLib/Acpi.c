@@ -0,0 +1,461 @@
+/*
+ * Copyright (C) 2017 Andrei Evgenievich Warkentin
+ *
+ * This program and the accompanying materials
+ * are licensed and made available under the terms and conditions of the BSD License
+ * which accompanies this distribution.  The full text of the license may be found at
+ * http://opensource.org/licenses/bsd-license.php
+ *
+ * THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+ */
+
+#include <Uefi.h>
+#include <Library/BaseLib.h>
+#include <Library/UefiLib.h>
+#include <Library/UtilsLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/MemoryAllocationLib.h>
+
+#include <IndustryStandard/Acpi.h>
+
+//
+// Byte lanes, as 16-bit lanes holding the even and odd bytes of
+// a word. These truncate to the right thing for 32-bit UINTN.
+//
+#define LANES_LO   ((UINTN) 0x00FF00FF00FF00FFULL)
+#define LANES_16   ((UINTN) 0x0000FFFF0000FFFFULL)
+
+//
+// Each word adds at most 2 * 0xFF to a lane, so 128 words can
+// be summed before a 16-bit lane could overflow.
+//
+#define SUM_BLOCK  128
+
+//
+// The 8-bit sum of Size bytes at Buffer, i.e. 0 for an ACPI table
+// with a valid checksum.
+//
+// Sums a word at a time, as there are no SSE/NEON intrinsics
+// available to all toolchains edk2 supports. Words are only ever
+// read aligned.
+//
+UINT8
+AcpiChecksum (
+              IN CONST VOID *Buffer,
+              IN UINTN Size
+              )
+{
+  UINTN Sum;
+  UINTN Lanes;
+  UINTN Block;
+  CONST UINT8 *Ptr;
+  CONST UINTN *Word;
+
+  Sum = 0;
+  Ptr = Buffer;
+  while (Size != 0 && ((UINTN) Ptr & (sizeof(UINTN) - 1)) != 0) {
+    Sum += *Ptr++;
+    Size--;
+  }
+
+  Word = (CONST UINTN *) Ptr;
+  while (Size >= sizeof(UINTN)) {
+    Block = MIN(Size / sizeof(UINTN), SUM_BLOCK);
+    Size -= Block * sizeof(UINTN);
+
+    for (Lanes = 0; Block != 0; Block--, Word++) {
+      Lanes += (*Word & LANES_LO) + ((*Word >> 8) & LANES_LO);
+    }
+
+    //
+    // Fold the lanes, widening them first so that carries
+    // don't end up in the wrong lane.
+    //
+    Lanes = (Lanes & LANES_16) + ((Lanes >> 16) & LANES_16);
+    Lanes = (Lanes & MAX_UINT32) + ((Lanes >> 16) >> 16);
+    Sum += Lanes;
+  }
+
+  Ptr = (CONST UINT8 *) Word;
+  while (Size != 0) {
+    Sum += *Ptr++;
+    Size--;
+  }
+
+  return (UINT8) Sum;
+}
+
+STATIC ACPI_TABLE_CHECK *
+AddTable (
+          IN OUT ACPI_VALIDATION *Validation,
+          IN UINTN Address
+          )
+{
+  ACPI_TABLE_CHECK *Entry;
+
+  if (Validation->Count == Validation->Entries) {
+    Entry = ReallocatePool(Validation->Entries * sizeof(ACPI_TABLE_CHECK),
+                           (Validation->Entries * 2 + 16) *
+                           sizeof(ACPI_TABLE_CHECK),
+                           Validation->Tables);
+    if (Entry == NULL) {
+      return NULL;
+    }
+
+    Validation->Tables = Entry;
+    Validation->Entries = Validation->Entries * 2 + 16;
+  }
+
+  Entry = &Validation->Tables[Validation->Count++];
+  ZeroMem(Entry, sizeof(*Entry));
+  Entry->Address = Address;
+  return Entry;
+}
+
+//
+// Checks the tables at Addresses, all at once: first that
+// MinLength bytes of each are mapped, then that the length
+// in the header is sane and all of it is mapped, and finally
+// (with Checksum) the checksum.
+//
+STATIC EFI_STATUS
+CheckTables (
+             IN OUT ACPI_VALIDATION *Validation,
+             IN OUT RANGE_CHECK_CONTEXT *RangeCheck,
+             IN UINTN *Addresses,
+             IN UINTN Count,
+             IN UINT32 MinLength,
+             IN BOOLEAN Checksum
+             )
+{
+  UINTN Base;
+  UINTN Index;
+  UINTN Mapped;
+  ACPI_TABLE_CHECK *Entry;
+  RANGE_CHECK_RANGE *Ranges;
+  EFI_ACPI_DESCRIPTION_HEADER *Header;
+
+  if (Count == 0) {
+    return EFI_SUCCESS;
+  }
+
+  Ranges = AllocatePool(Count * sizeof(RANGE_CHECK_RANGE));
+  if (Ranges == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  Base = Validation->Count;
+  for (Index = 0; Index < Count; Index++) {
+    if (AddTable(Validation, Addresses[Index]) == NULL) {
+      FreePool(Ranges);
+      return EFI_OUT_OF_RESOURCES;
+    }
+
+    Ranges[Index].Start = Addresses[Index];
+    Ranges[Index].Length = MinLength;
+  }
+
+  RangesAreMapped(RangeCheck, Ranges, Count);
+
+  //
+  // Only the tables with a mapped header and a sane length
+  // go on to the second pass, in the same order.
+  //
+  for (Mapped = 0, Index = 0; Index < Count; Index++) {
+    Entry = &Validation->Tables[Base + Index];
+    if (Entry->Address == 0 || EFI_ERROR(Ranges[Index].Status)) {
+      Entry->Problems |= ACPI_TABLE_UNMAPPED;
+      continue;
+    }
+
+    Header = (VOID *) Entry->Address;
+    Entry->Signature = Header->Signature;
+    Entry->Length = Header->Length;
+    if (Entry->Length < MinLength) {
+      Entry->Problems |= ACPI_TABLE_BAD_LENGTH;
+      continue;
+    }
+
+    Ranges[Mapped].Start = Entry->Address;
+    Ranges[Mapped].Length = Entry->Length;
+    Mapped++;
+  }
+
+  RangesAreMapped(RangeCheck, Ranges, Mapped);
+
+  for (Mapped = 0, Index = 0; Index < Count; Index++) {
+    Entry = &Validation->Tables[Base + Index];
+    if (Entry->Problems != 0) {
+      continue;
+    }
+
+    if (EFI_ERROR(Ranges[Mapped++].Status)) {
+      Entry->Problems |= ACPI_TABLE_UNMAPPED;
+      continue;
+    }
+
+    if (Checksum) {
+      if (AcpiChecksum((VOID *) Entry->Address, Entry->Length) != 0) {
+        Entry->Problems |= ACPI_TABLE_BAD_CHECKSUM;
+      }
+      Validation->Bytes += Entry->Length;
+    }
+  }
+
+  FreePool(Ranges);
+  return EFI_SUCCESS;
+}
+
+STATIC EFI_STATUS
+CheckRsdp (
+           IN OUT ACPI_VALIDATION *Validation,
+           IN OUT RANGE_CHECK_CONTEXT *RangeCheck,
+           IN EFI_ACPI_2_0_ROOT_SYSTEM_DESCRIPTION_POINTER *Rsdp
+           )
+{
+  ACPI_TABLE_CHECK *Entry;
+
+  Entry = AddTable(Validation, (UINTN) Rsdp);
+  if (Entry == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  Entry->Length = sizeof(EFI_ACPI_1_0_ROOT_SYSTEM_DESCRIPTION_POINTER);
+  if (RangeIsMapped(RangeCheck, (UINTN) Rsdp, Entry->Length) != EFI_SUCCESS) {
+    Entry->Problems |= ACPI_TABLE_UNMAPPED;
+    return EFI_SUCCESS;
+  }
+
+  Entry->Signature = (UINT32) Rsdp->Signature;
+  if (AcpiChecksum(Rsdp, Entry->Length) != 0) {
+    Entry->Problems |= ACPI_TABLE_BAD_CHECKSUM;
+  }
+  Validation->Bytes += Entry->Length;
+
+  if (Rsdp->Revision < EFI_ACPI_2_0_ROOT_SYSTEM_DESCRIPTION_POINTER_REVISION) {
+    return EFI_SUCCESS;
+  }
+
+  if (RangeIsMapped(RangeCheck, (UINTN) Rsdp,
+                    sizeof(EFI_ACPI_2_0_ROOT_SYSTEM_DESCRIPTION_POINTER))
+      != EFI_SUCCESS) {
+    Entry->Problems |= ACPI_TABLE_UNMAPPED;
+    return EFI_SUCCESS;
+  }
+
+  Entry->Length = Rsdp->Length;
+  if (Entry->Length < sizeof(EFI_ACPI_2_0_ROOT_SYSTEM_DESCRIPTION_POINTER)) {
+    Entry->Problems |= ACPI_TABLE_BAD_LENGTH;
+    return EFI_SUCCESS;
+  }
+
+  if (RangeIsMapped(RangeCheck, (UINTN) Rsdp, Entry->Length) != EFI_SUCCESS) {
+    Entry->Problems |= ACPI_TABLE_UNMAPPED;
+    return EFI_SUCCESS;
+  }
+
+  if (AcpiChecksum(Rsdp, Entry->Length) != 0) {
+    Entry->Problems |= ACPI_TABLE_BAD_CHECKSUM;
+  }
+  Validation->Bytes += Entry->Length;
+  return EFI_SUCCESS;
+}
+
+//
+// Checks the DSDT and FACS the FADT at Index points to.
+//
+STATIC EFI_STATUS
+CheckFadt (
+           IN OUT ACPI_VALIDATION *Validation,
+           IN OUT RANGE_CHECK_CONTEXT *RangeCheck,
+           IN UINTN Index
+           )
+{
+  UINTN Dsdt;
+  UINTN Facs;
+  EFI_STATUS Status;
+  EFI_ACPI_5_1_FIXED_ACPI_DESCRIPTION_TABLE *Fadt;
+
+  Fadt = (VOID *) Validation->Tables[Index].Address;
+  if (Fadt->Header.Length < OFFSET_OF(EFI_ACPI_5_1_FIXED_ACPI_DESCRIPTION_TABLE,
+                                      Reserved0)) {
+    Validation->Tables[Index].Problems |= ACPI_TABLE_BAD_LENGTH;
+    return EFI_SUCCESS;
+  }
+
+  //
+  // The 64-bit pointers are only looked at if the table is long
+  // enough to have them.
+  //
+  Dsdt = Fadt->Dsdt;
+  if (Fadt->Header.Revision >= 3 &&
+      Fadt->Header.Length >= OFFSET_OF(EFI_ACPI_5_1_FIXED_ACPI_DESCRIPTION_TABLE,
+                                       XDsdt) + sizeof(UINT64) &&
+      Fadt->XDsdt != 0) {
+    Dsdt = (UINTN) Fadt->XDsdt;
+  }
+
+  Facs = Fadt->FirmwareCtrl;
+  if (Fadt->Header.Revision >= 3 &&
+      Fadt->Header.Length >= OFFSET_OF(EFI_ACPI_5_1_FIXED_ACPI_DESCRIPTION_TABLE,
+                                       XFirmwareCtrl) + sizeof(UINT64) &&
+      Fadt->XFirmwareCtrl != 0) {
+    Facs = (UINTN) Fadt->XFirmwareCtrl;
+  }
+
+  Status = CheckTables(Validation, RangeCheck, &Dsdt, 1,
+                       sizeof(EFI_ACPI_DESCRIPTION_HEADER), TRUE);
+  if (EFI_ERROR(Status)) {
+    return Status;
+  }
+
+  //
+  // A FACS doesn't have a checksum.
+  //
+  if (Facs != 0) {
+    Status = CheckTables(Validation, RangeCheck, &Facs, 1,
+                         sizeof(EFI_ACPI_1_0_FIRMWARE_ACPI_CONTROL_STRUCTURE),
+                         FALSE);
+  }
+
+  return Status;
+}
+
+//
+// Validates the header length, mapping and checksum of every table
+// reachable from Rsdp: the RSDP itself, the XSDT (or the RSDT, for
+// ACPI 1.0), all tables it points to, and the DSDT and FACS. The
+// result is to be freed with AcpiValidationFree, once done with.
+//
+EFI_STATUS
+AcpiValidate (
+              IN OUT RANGE_CHECK_CONTEXT *RangeCheck,
+              IN VOID *Rsdp,
+              OUT ACPI_VALIDATION *Validation
+              )
+{
+  UINTN Index;
+  UINTN Count;
+  UINTN Root;
+  UINTN EntrySize;
+  UINTN *Addresses;
+  EFI_STATUS Status;
+  EFI_ACPI_DESCRIPTION_HEADER *Sdt;
+  EFI_ACPI_2_0_ROOT_SYSTEM_DESCRIPTION_POINTER *Rsdp2;
+
+  ZeroMem(Validation, sizeof(*Validation));
+  Rsdp2 = Rsdp;
+
+  Status = CheckRsdp(Validation, RangeCheck, Rsdp2);
+  if (EFI_ERROR(Status) || Validation->Tables[0].Problems != 0) {
+    goto done;
+  }
+
+  if (Rsdp2->Revision >= EFI_ACPI_2_0_ROOT_SYSTEM_DESCRIPTION_POINTER_REVISION &&
+      Rsdp2->XsdtAddress != 0) {
+    Root = (UINTN) Rsdp2->XsdtAddress;
+    EntrySize = sizeof(UINT64);
+  } else {
+    Root = Rsdp2->RsdtAddress;
+    EntrySize = sizeof(UINT32);
+  }
+
+  Status = CheckTables(Validation, RangeCheck, &Root, 1,
+                       sizeof(EFI_ACPI_DESCRIPTION_HEADER), TRUE);
+  if (EFI_ERROR(Status) || Validation->Tables[1].Problems != 0) {
+    goto done;
+  }
+
+  Sdt = (VOID *) Root;
+  Count = (Sdt->Length - sizeof(EFI_ACPI_DESCRIPTION_HEADER)) / EntrySize;
+  if ((Sdt->Length - sizeof(EFI_ACPI_DESCRIPTION_HEADER)) % EntrySize != 0) {
+    Validation->Tables[1].Problems |= ACPI_TABLE_BAD_LENGTH;
+  }
+
+  Addresses = AllocatePool(Count * sizeof(UINTN) + 1);
+  if (Addresses == NULL) {
+    Status = EFI_OUT_OF_RESOURCES;
+    goto done;
+  }
+
+  for (Index = 0; Index < Count; Index++) {
+    if (EntrySize == sizeof(UINT32)) {
+      Addresses[Index] = ReadUnaligned32((UINT32 *) (Sdt + 1) + Index);
+    } else {
+      Addresses[Index] = (UINTN) ReadUnaligned64((UINT64 *) (Sdt + 1) + Index);
+    }
+  }
+
+  Status = CheckTables(Validation, RangeCheck, Addresses, Count,
+                       sizeof(EFI_ACPI_DESCRIPTION_HEADER), TRUE);
+  FreePool(Addresses);
+
+  for (Index = 2; !EFI_ERROR(Status) && Index < 2 + Count; Index++) {
+    if ((Validation->Tables[Index].Problems & (ACPI_TABLE_UNMAPPED |
+                                               ACPI_TABLE_BAD_LENGTH)) == 0 &&
+        Validation->Tables[Index].Signature ==
+        EFI_ACPI_5_1_FIXED_ACPI_DESCRIPTION_TABLE_SIGNATURE) {
+      Status = CheckFadt(Validation, RangeCheck, Index);
+    }
+  }
+
+done:
+  for (Index = 0; Index < Validation->Count; Index++) {
+    if (Validation->Tables[Index].Problems != 0) {
+      Validation->Bad++;
+    }
+  }
+
+  if (EFI_ERROR(Status)) {
+    Print(L"%a: %r\n", __FUNCTION__, Status);
+    AcpiValidationFree(Validation);
+  }
+
+  return Status;
+}
+
+//
+// Reports the tables with problems (or all, with Verbose)
+// and a one line summary.
+//
+VOID
+AcpiValidationPrint (
+                     IN ACPI_VALIDATION *Validation,
+                     IN BOOLEAN Verbose
+                     )
+{
+  UINTN Index;
+  ACPI_TABLE_CHECK *Entry;
+
+  for (Index = 0; Index < Validation->Count; Index++) {
+    Entry = &Validation->Tables[Index];
+    if (Entry->Problems == 0 && !Verbose) {
+      continue;
+    }
+
+    Print(L"%.4a @ 0x%lx (0x%x bytes):%s%s%s%s\n",
+          Entry->Signature != 0 ? (CHAR8 *) &Entry->Signature : "????",
+          (UINT64) Entry->Address, Entry->Length,
+          Entry->Problems == 0 ? L" ok" : L"",
+          (Entry->Problems & ACPI_TABLE_UNMAPPED) != 0 ? L" unmapped" : L"",
+          (Entry->Problems & ACPI_TABLE_BAD_LENGTH) != 0 ? L" bad length" : L"",
+          (Entry->Problems & ACPI_TABLE_BAD_CHECKSUM) != 0 ?
+          L" bad checksum" : L"");
+  }
+
+  Print(L"%u ACPI tables checked, %u bad (0x%lx bytes checksummed)\n",
+        Validation->Count, Validation->Bad, Validation->Bytes);
+}
+
+VOID
+AcpiValidationFree (
+                    IN OUT ACPI_VALIDATION *Validation
+                    )
+{
+  if (Validation->Tables != NULL) {
+    FreePool(Validation->Tables);
+  }
+
+  ZeroMem(Validation, sizeof(*Validation));
+}
@@ -0,0 +1,230 @@
+/*
+ * Copyright (C) 2017 Andrei Evgenievich Warkentin
+ *
+ * This program and the accompanying materials
+ * are licensed and made available under the terms and conditions of the BSD License
+ * which accompanies this distribution.  The full text of the license may be found at
+ * http://opensource.org/licenses/bsd-license.php
+ *
+ * THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+ */
+
+//
+// Many files saved as one cpio archive, in the "newc" format that
+// cpio -i, bsdtar, 7-Zip and the Linux initramfs code all read,
+// written out as a single sequential stream through a file save
+// session. The last member is a plain text table of contents,
+// named TOC, listing the offset and size of every other member.
+//
+
+#include <Uefi.h>
+#include <Library/BaseLib.h>
+#include <Library/UefiLib.h>
+#include <Library/PrintLib.h>
+#include <Library/UtilsLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/MemoryAllocationLib.h>
+
+#define NEWC_HEADER_SIZE 110
+#define NEWC_MODE_FILE   0100444
+#define NEWC_TRAILER     "TRAILER!!!"
+#define NEWC_TOC         "TOC"
+
+//
+// Offset, size and the name, with the separators.
+//
+#define TOC_LINE_SIZE    (16 + 1 + 8 + 1 + BUNDLE_NAME_MAX + 1)
+
+STATIC CONST UINT8 mPad[4];
+
+STATIC EFI_STATUS
+BundleWrite (
+             IN OUT BUNDLE_WRITER *Bundle,
+             IN VOID *Buffer,
+             IN UINTN Size
+             )
+{
+  EFI_STATUS Status;
+
+  //
+  // Nothing to write shouldn't wait for what's being written.
+  //
+  if (Size == 0) {
+    return EFI_SUCCESS;
+  }
+
+  Status = FileSaveSessionAppend(Bundle->Session, Buffer, Size);
+  if (!EFI_ERROR(Status)) {
+    Bundle->Offset += Size;
+  }
+
+  return Status;
+}
+
+//
+// Writes a member header for Name, followed by Size bytes of Buffer,
+// both padded to 4 bytes as the format wants.
+//
+// Appends may be asynchronous, but each waits for the previous one
+// to be done, so of the two header buffers, the one used before the
+// last is always free.
+//
+STATIC EFI_STATUS
+BundleMember (
+              IN OUT BUNDLE_WRITER *Bundle,
+              IN CONST CHAR8 *Name,
+              IN VOID *Buffer,
+              IN UINTN Size
+              )
+{
+  UINTN Length;
+  UINTN NameSize;
+  CHAR8 *Header;
+  EFI_STATUS Status;
+
+  Header = Bundle->Header[Bundle->Members++ & 1];
+  NameSize = AsciiStrLen(Name) + 1;
+  Length = AsciiSPrint(Header, sizeof(Bundle->Header[0]),
+                       "070701%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x",
+                       (UINT32) Bundle->Members,    // ino
+                       NEWC_MODE_FILE,
+                       0, 0,                        // uid, gid
+                       1,                           // nlink
+                       0,                           // mtime
+                       (UINT32) Size,
+                       0, 0, 0, 0,                  // dev, rdev
+                       (UINT32) NameSize,
+                       0);                          // check
+  CopyMem(Header + Length, Name, NameSize);
+  Length += NameSize;
+  ZeroMem(Header + Length, ALIGN_VALUE(Length, 4) - Length);
+  Length = ALIGN_VALUE(Length, 4);
+
+  Status = BundleWrite(Bundle, Header, Length);
+  if (!EFI_ERROR(Status)) {
+    Status = BundleWrite(Bundle, Buffer, Size);
+  }
+
+  if (!EFI_ERROR(Status)) {
+    Status = BundleWrite(Bundle, (VOID *) mPad, ALIGN_VALUE(Size, 4) - Size);
+  }
+
+  return Status;
+}
+
+EFI_STATUS
+BundleOpen (
+            IN OUT FILE_SAVE_SESSION *Session,
+            IN CHAR16 *Path,
+            OUT BUNDLE_WRITER *Bundle
+            )
+{
+  ZeroMem(Bundle, sizeof(*Bundle));
+  Bundle->Session = Session;
+
+  return FileSaveSessionBegin(Session, Path);
+}
+
+//
+// Adds Size bytes at Buffer as Name. Names are stored
+// as ASCII, truncated to BUNDLE_NAME_MAX - 1 characters.
+//
+EFI_STATUS
+BundleAdd (
+           IN OUT BUNDLE_WRITER *Bundle,
+           IN CHAR16 *Name,
+           IN VOID *Buffer,
+           IN UINTN Size
+           )
+{
+  UINTN Index;
+  EFI_STATUS Status;
+  BUNDLE_ENTRY *Entry;
+
+  if ((UINT64) Size > MAX_UINT32) {
+    return EFI_BAD_BUFFER_SIZE;
+  }
+
+  if (Bundle->Count == Bundle->Entries) {
+    Entry = ReallocatePool(Bundle->Entries * sizeof(BUNDLE_ENTRY),
+                           (Bundle->Entries * 2 + 16) * sizeof(BUNDLE_ENTRY),
+                           Bundle->Toc);
+    if (Entry == NULL) {
+      return EFI_OUT_OF_RESOURCES;
+    }
+
+    Bundle->Toc = Entry;
+    Bundle->Entries = Bundle->Entries * 2 + 16;
+  }
+
+  Entry = &Bundle->Toc[Bundle->Count];
+  for (Index = 0; Index < BUNDLE_NAME_MAX - 1 && Name[Index] != L'\0'; Index++) {
+    Entry->Name[Index] = Name[Index] < 0x80 ? (CHAR8) Name[Index] : '_';
+  }
+  Entry->Name[Index] = '\0';
+  Entry->Size = Size;
+  Entry->Offset = Bundle->Offset + ALIGN_VALUE(NEWC_HEADER_SIZE + Index + 1, 4);
+
+  Status = BundleMember(Bundle, Entry->Name, Buffer, Size);
+  if (EFI_ERROR(Status)) {
+    return Status;
+  }
+
+  Bundle->Count++;
+  return EFI_SUCCESS;
+}
+
+//
+// Writes the table of contents and the trailer, and finishes the
+// file. The bundle is freed even on failure.
+//
+EFI_STATUS
+BundleClose (
+             IN OUT BUNDLE_WRITER *Bundle
+             )
+{
+  UINTN Index;
+  UINTN TocSize;
+  CHAR8 *Toc;
+  EFI_STATUS Status;
+
+  TocSize = 0;
+  Toc = AllocatePool(Bundle->Count * TOC_LINE_SIZE + 1);
+  if (Toc == NULL) {
+    Status = EFI_OUT_OF_RESOURCES;
+  } else {
+    for (Index = 0; Index < Bundle->Count; Index++) {
+      TocSize += AsciiSPrint(Toc + TocSize, TOC_LINE_SIZE + 1, "%016lx %08x %a\n",
+                             Bundle->Toc[Index].Offset,
+                             (UINT32) Bundle->Toc[Index].Size,
+                             Bundle->Toc[Index].Name);
+    }
+
+    Status = BundleMember(Bundle, NEWC_TOC, Toc, TocSize);
+  }
+
+  if (!EFI_ERROR(Status)) {
+    Status = BundleMember(Bundle, NEWC_TRAILER, NULL, 0);
+  }
+
+  //
+  // Wait for the TOC to be written before freeing it.
+  //
+  if (EFI_ERROR(Status)) {
+    FileSaveSessionEnd(Bundle->Session);
+  } else {
+    Status = FileSaveSessionEnd(Bundle->Session);
+  }
+
+  if (Toc != NULL) {
+    FreePool(Toc);
+  }
+
+  if (Bundle->Toc != NULL) {
+    FreePool(Bundle->Toc);
+  }
+
+  ZeroMem(Bundle, sizeof(*Bundle));
+  return Status;
+}
@@ -0,0 +1,373 @@
+/*
+ * Copyright (C) 2017 Andrei Evgenievich Warkentin
+ *
+ * This program and the accompanying materials
+ * are licensed and made available under the terms and conditions of the BSD License
+ * which accompanies this distribution.  The full text of the license may be found at
+ * http://opensource.org/licenses/bsd-license.php
+ *
+ * THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+ */
+
+#include <Uefi.h>
+#include <Library/BaseLib.h>
+#include <Library/UefiLib.h>
+#include <Library/SortLib.h>
+#include <Library/UtilsLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/UefiBootServicesTableLib.h>
+#include <Library/MemoryAllocationLib.h>
+
+//
+// One snapshot shared by everything in the image that needs
+// the memory map, e.g. several range check contexts.
+//
+STATIC MEMORY_MAP_SNAPSHOT *mSnapshot;
+STATIC UINTN mSnapshotRefs;
+
+STATIC INTN EFIAPI
+MemoryMapSort (
+               IN CONST VOID *Buffer1,
+               IN CONST VOID *Buffer2
+               )
+{
+  CONST EFI_MEMORY_DESCRIPTOR *D1 = Buffer1;
+  CONST EFI_MEMORY_DESCRIPTOR *D2 = Buffer2;
+
+  if (D1->PhysicalStart < D2->PhysicalStart) {
+    return -1;
+  } else if (D1->PhysicalStart == D2->PhysicalStart) {
+    return 0;
+  } else {
+    return 1;
+  }
+}
+
+STATIC BOOLEAN
+MemoryMapIsSorted (
+                   IN EFI_MEMORY_DESCRIPTOR *Map,
+                   IN UINTN MapSize,
+                   IN UINTN DescriptorSize
+                   )
+{
+  EFI_MEMORY_DESCRIPTOR *Next;
+  EFI_MEMORY_DESCRIPTOR *End;
+
+  End = (VOID *)((UINTN) Map + MapSize);
+  for (Next = NEXT_MEMORY_DESCRIPTOR(Map, DescriptorSize); Next < End;
+       Map = Next, Next = NEXT_MEMORY_DESCRIPTOR(Next, DescriptorSize)) {
+    if (Next->PhysicalStart < Map->PhysicalStart) {
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+STATIC VOID
+FreeSnapshot (
+              IN MEMORY_MAP_SNAPSHOT *Snapshot
+              )
+{
+  if (Snapshot->MapPages != 0) {
+    FreePages(Snapshot->Map, Snapshot->MapPages);
+  }
+
+  if (Snapshot->ScratchPages != 0) {
+    FreePages(Snapshot->Scratch, Snapshot->ScratchPages);
+  }
+
+  FreePool(Snapshot);
+}
+
+//
+// Fetches the memory map into the scratch buffer, which is kept
+// around so that revalidating doesn't allocate (and thus doesn't
+// change the map). Only if the MapKey changed is the scratch
+// buffer swapped in, and sorted if the firmware didn't already
+// return it sorted (EDK2 does).
+//
+EFI_STATUS
+RevalidateMemoryMapSnapshot (
+                             IN OUT MEMORY_MAP_SNAPSHOT *Snapshot
+                             )
+{
+  UINTN Pages;
+  UINTN MapKey;
+  UINTN MapSize;
+  UINTN DescriptorSize;
+  UINT32 DescriptorVersion;
+  EFI_STATUS Status;
+  EFI_MEMORY_DESCRIPTOR *Map;
+
+  do {
+    MapSize = EFI_PAGES_TO_SIZE(Snapshot->ScratchPages);
+    Status = gBS->GetMemoryMap(&MapSize, Snapshot->Scratch, &MapKey,
+                               &DescriptorSize, &DescriptorVersion);
+    if (!EFI_ERROR(Status)) {
+      break;
+    }
+
+    if (Status != EFI_BUFFER_TOO_SMALL) {
+      Print(L"%a: gBS->GetMemoryMap failed: %r\n", __FUNCTION__, Status);
+      return Status;
+    }
+
+    //
+    // The UEFI specification advises to allocate more memory for
+    // the MemoryMap buffer between successive calls to GetMemoryMap(),
+    // since allocation of the new buffer may potentially increase
+    // memory map size. Leave room for the descriptors
+    // SnapshotAddRange and SnapshotAllocatePages may add as well.
+    //
+    if (Snapshot->ScratchPages != 0) {
+      FreePages(Snapshot->Scratch, Snapshot->ScratchPages);
+      Snapshot->ScratchPages = 0;
+    }
+
+    Pages = EFI_SIZE_TO_PAGES(MapSize) + 1;
+    Snapshot->Scratch = AllocatePages(Pages);
+    if (Snapshot->Scratch == NULL) {
+      Print(L"%a: AllocatePages failed\n", __FUNCTION__);
+      return EFI_OUT_OF_RESOURCES;
+    }
+    Snapshot->ScratchPages = Pages;
+  } while (1);
+
+  if (Snapshot->Valid && MapKey == Snapshot->MapKey) {
+    return EFI_SUCCESS;
+  }
+
+  Map = Snapshot->Map;
+  Pages = Snapshot->MapPages;
+  Snapshot->Map = Snapshot->Scratch;
+  Snapshot->MapPages = Snapshot->ScratchPages;
+  Snapshot->Scratch = Map;
+  Snapshot->ScratchPages = Pages;
+
+  Snapshot->MapKey = MapKey;
+  Snapshot->MapSize = MapSize;
+  Snapshot->DescriptorSize = DescriptorSize;
+  Snapshot->DescriptorVersion = DescriptorVersion;
+
+  if (!MemoryMapIsSorted(Snapshot->Map, MapSize, DescriptorSize)) {
+    PerformQuickSort(Snapshot->Map, MapSize / DescriptorSize,
+                     DescriptorSize, MemoryMapSort);
+  }
+
+  Snapshot->Valid = TRUE;
+  Snapshot->Generation++;
+  return EFI_SUCCESS;
+}
+
+//
+// Returns a reference to the shared snapshot, revalidated.
+// Drop it with PutMemoryMapSnapshot.
+//
+EFI_STATUS
+GetMemoryMapSnapshot (
+                      OUT MEMORY_MAP_SNAPSHOT **Snapshot
+                      )
+{
+  EFI_STATUS Status;
+
+  if (mSnapshot == NULL) {
+    mSnapshot = AllocateZeroPool(sizeof(MEMORY_MAP_SNAPSHOT));
+    if (mSnapshot == NULL) {
+      Print(L"%a: AllocateZeroPool failed\n", __FUNCTION__);
+      return EFI_OUT_OF_RESOURCES;
+    }
+  }
+
+  Status = RevalidateMemoryMapSnapshot(mSnapshot);
+  if (EFI_ERROR(Status)) {
+    if (mSnapshotRefs == 0) {
+      FreeSnapshot(mSnapshot);
+      mSnapshot = NULL;
+    }
+    return Status;
+  }
+
+  mSnapshotRefs++;
+  *Snapshot = mSnapshot;
+  return EFI_SUCCESS;
+}
+
+VOID
+PutMemoryMapSnapshot (
+                      IN MEMORY_MAP_SNAPSHOT *Snapshot
+                      )
+{
+  if (Snapshot != mSnapshot || mSnapshotRefs == 0) {
+    return;
+  }
+
+  if (--mSnapshotRefs == 0) {
+    FreeSnapshot(mSnapshot);
+    mSnapshot = NULL;
+  }
+}
+
+//
+// Replaces [Start, Start + Pages) with a descriptor of MemoryType,
+// splitting the descriptor it was carved out of. Returns FALSE
+// if the range isn't inside a single descriptor, or there's no
+// room left for the split.
+//
+STATIC BOOLEAN
+SnapshotSplice (
+                IN OUT MEMORY_MAP_SNAPSHOT *Snapshot,
+                IN EFI_PHYSICAL_ADDRESS Start,
+                IN UINTN Pages,
+                IN EFI_MEMORY_TYPE MemoryType
+                )
+{
+  UINTN Added;
+  UINTN Before;
+  UINTN After;
+  EFI_MEMORY_DESCRIPTOR *Next;
+  EFI_MEMORY_DESCRIPTOR *End;
+
+  End = (VOID *)((UINTN) Snapshot->Map + Snapshot->MapSize);
+  for (Next = Snapshot->Map; Next < End;
+       Next = NEXT_MEMORY_DESCRIPTOR(Next, Snapshot->DescriptorSize)) {
+    if (Next->PhysicalStart <= Start &&
+        Start - Next->PhysicalStart < LShiftU64(Next->NumberOfPages,
+                                                EFI_PAGE_SHIFT)) {
+      break;
+    }
+  }
+
+  if (Next == End) {
+    return FALSE;
+  }
+
+  Before = (UINTN) RShiftU64(Start - Next->PhysicalStart, EFI_PAGE_SHIFT);
+  if (Next->NumberOfPages - Before < Pages) {
+    return FALSE;
+  }
+  After = (UINTN) (Next->NumberOfPages - Before - Pages);
+
+  Added = (Before != 0 ? 1 : 0) + (After != 0 ? 1 : 0);
+  if (Snapshot->MapSize + Added * Snapshot->DescriptorSize >
+      EFI_PAGES_TO_SIZE(Snapshot->MapPages)) {
+    return FALSE;
+  }
+
+  //
+  // Make Added copies of the descriptor, then fix them up.
+  //
+  CopyMem((VOID *)((UINTN) Next + Added * Snapshot->DescriptorSize), Next,
+          (UINTN) End - (UINTN) Next);
+  Snapshot->MapSize += Added * Snapshot->DescriptorSize;
+
+  if (Before != 0) {
+    Next->NumberOfPages = Before;
+    Next = NEXT_MEMORY_DESCRIPTOR(Next, Snapshot->DescriptorSize);
+    CopyMem(Next, NEXT_MEMORY_DESCRIPTOR(Next, (Added - 1) *
+                                         Snapshot->DescriptorSize),
+            Snapshot->DescriptorSize);
+  }
+
+  Next->Type = MemoryType;
+  Next->PhysicalStart = Start;
+  Next->VirtualStart = 0;
+  Next->NumberOfPages = Pages;
+
+  if (After != 0) {
+    Next = NEXT_MEMORY_DESCRIPTOR(Next, Snapshot->DescriptorSize);
+    Next->PhysicalStart = Start + EFI_PAGES_TO_SIZE(Pages);
+    Next->VirtualStart = 0;
+    Next->NumberOfPages = After;
+  }
+
+  return TRUE;
+}
+
+//
+// Records a range that was just added to the memory map, e.g.
+// system memory added with DS->AddMemorySpace, which shows up as
+// EfiConventionalMemory with the capabilities as attributes. If
+// the range overlaps something already in the snapshot, or there's
+// no room, the snapshot is marked invalid instead.
+//
+VOID
+SnapshotAddRange (
+                  IN OUT MEMORY_MAP_SNAPSHOT *Snapshot,
+                  IN EFI_PHYSICAL_ADDRESS Start,
+                  IN UINTN Pages,
+                  IN EFI_MEMORY_TYPE MemoryType,
+                  IN UINT64 Attribute
+                  )
+{
+  EFI_MEMORY_DESCRIPTOR *Prev;
+  EFI_MEMORY_DESCRIPTOR *Next;
+  EFI_MEMORY_DESCRIPTOR *End;
+
+  Snapshot->Generation++;
+  if (!Snapshot->Valid) {
+    return;
+  }
+
+  Prev = NULL;
+  End = (VOID *)((UINTN) Snapshot->Map + Snapshot->MapSize);
+  for (Next = Snapshot->Map; Next < End;
+       Next = NEXT_MEMORY_DESCRIPTOR(Next, Snapshot->DescriptorSize)) {
+    if (Next->PhysicalStart >= Start) {
+      break;
+    }
+    Prev = Next;
+  }
+
+  if ((Prev != NULL &&
+       Prev->PhysicalStart + EFI_PAGES_TO_SIZE(Prev->NumberOfPages) > Start) ||
+      (Next != End &&
+       Next->PhysicalStart < Start + EFI_PAGES_TO_SIZE(Pages)) ||
+      Snapshot->MapSize + Snapshot->DescriptorSize >
+      EFI_PAGES_TO_SIZE(Snapshot->MapPages)) {
+    Snapshot->Valid = FALSE;
+    return;
+  }
+
+  CopyMem(NEXT_MEMORY_DESCRIPTOR(Next, Snapshot->DescriptorSize), Next,
+          (UINTN) End - (UINTN) Next);
+  Snapshot->MapSize += Snapshot->DescriptorSize;
+
+  ZeroMem(Next, Snapshot->DescriptorSize);
+  Next->Type = MemoryType;
+  Next->PhysicalStart = Start;
+  Next->NumberOfPages = Pages;
+  Next->Attribute = Attribute;
+}
+
+//
+// gBS->AllocatePages, with the allocation applied to the snapshot
+// right away, so that it doesn't need to be fetched again. If that's
+// not possible (e.g. the range wasn't in the map), the snapshot is
+// marked invalid and will be fetched on next revalidation.
+//
+EFI_STATUS
+SnapshotAllocatePages (
+                       IN OUT MEMORY_MAP_SNAPSHOT *Snapshot,
+                       IN EFI_ALLOCATE_TYPE Type,
+                       IN EFI_MEMORY_TYPE MemoryType,
+                       IN UINTN Pages,
+                       IN OUT EFI_PHYSICAL_ADDRESS *Memory
+                       )
+{
+  EFI_STATUS Status;
+
+  Status = gBS->AllocatePages(Type, MemoryType, Pages, Memory);
+  if (EFI_ERROR(Status)) {
+    return Status;
+  }
+
+  if (!Snapshot->Valid ||
+      !SnapshotSplice(Snapshot, *Memory, Pages, MemoryType)) {
+    Snapshot->Valid = FALSE;
+  }
+
+  Snapshot->Generation++;
+  return EFI_SUCCESS;
+}
@@ -11,30 +11,11 @@
  */
 
 #include <Uefi.h>
+#include <Library/BaseLib.h>
 #include <Library/UefiLib.h>
-#include <Library/SortLib.h>
 #include <Library/UtilsLib.h>
-#include <Library/UefiBootServicesTableLib.h>
 #include <Library/MemoryAllocationLib.h>
 
-STATIC INTN EFIAPI
-MemoryMapSort (
-               IN CONST VOID *Buffer1,
-               IN CONST VOID *Buffer2
-               )
-{
-  CONST EFI_MEMORY_DESCRIPTOR *D1 = Buffer1;
-  CONST EFI_MEMORY_DESCRIPTOR *D2 = Buffer2;
-
-  if (D1->PhysicalStart < D2->PhysicalStart) {
-    return -1;
-  } else if (D1->PhysicalStart == D2->PhysicalStart) {
-    return 0;
-  } else {
-    return 1;
-  }
-}
-
 VOID
 CleanRangeCheckContext (
                         IN OUT RANGE_CHECK_CONTEXT *Context
@@ -45,16 +26,110 @@ CleanRangeCheckContext (
   }
 
 
-  if (Context->MapPages != 0) {
-    FreePages(Context->Map, Context->MapPages);
+  if (Context->Snapshot != NULL) {
+    PutMemoryMapSnapshot(Context->Snapshot);
+  }
+
+  if (Context->IntervalStart != NULL) {
+    FreePool(Context->IntervalStart);
   }
 
   Context->Enabled = FALSE;
   Context->WarnIfNotFound = FALSE;
-  Context->MapSize = 0;
-  Context->MapPages = 0;
-  Context->DescriptorSize = 0;
-  Context->Map = NULL;
+  Context->Snapshot = NULL;
+  Context->Generation = 0;
+  Context->IntervalEntries = 0;
+  Context->IntervalCount = 0;
+  Context->IntervalHint = 0;
+  Context->IntervalStart = NULL;
+  Context->IntervalLast = NULL;
+}
+
+//
+// Coalesce the sorted memory map into disjoint intervals, merging
+// adjacent and overlapping descriptors, so that a range can be
+// looked up with a binary search instead of walking the map.
+//
+STATIC EFI_STATUS
+BuildIntervals (
+                IN OUT RANGE_CHECK_CONTEXT *Context
+                )
+{
+  UINTN Index;
+  UINTN Count;
+  UINTN Entries;
+  EFI_PHYSICAL_ADDRESS Last;
+  EFI_MEMORY_DESCRIPTOR *Next;
+  MEMORY_MAP_SNAPSHOT *Snapshot;
+
+  Snapshot = Context->Snapshot;
+  Entries = Snapshot->MapSize / Snapshot->DescriptorSize;
+  if (Entries > Context->IntervalEntries) {
+    if (Context->IntervalStart != NULL) {
+      FreePool(Context->IntervalStart);
+    }
+
+    Context->IntervalEntries = 0;
+    Context->IntervalCount = 0;
+    Context->IntervalStart = AllocatePool(Entries * 2 *
+                                          sizeof(EFI_PHYSICAL_ADDRESS));
+    if (Context->IntervalStart == NULL) {
+      Print(L"%a: AllocatePool failed\n", __FUNCTION__);
+      return EFI_OUT_OF_RESOURCES;
+    }
+    Context->IntervalLast = Context->IntervalStart + Entries;
+    Context->IntervalEntries = Entries;
+  }
+
+  for (Count = 0, Next = Snapshot->Map, Index = 0; Index < Entries;
+       Index++, Next = NEXT_MEMORY_DESCRIPTOR(Next, Snapshot->DescriptorSize)) {
+    if (Next->NumberOfPages == 0) {
+      continue;
+    }
+
+    Last = Next->PhysicalStart - 1 + LShiftU64(Next->NumberOfPages,
+                                               EFI_PAGE_SHIFT);
+    if (Count != 0 &&
+        (Next->PhysicalStart <= Context->IntervalLast[Count - 1] ||
+         Next->PhysicalStart - 1 == Context->IntervalLast[Count - 1])) {
+      Context->IntervalLast[Count - 1] = MAX(Last,
+                                             Context->IntervalLast[Count - 1]);
+    } else {
+      Context->IntervalStart[Count] = Next->PhysicalStart;
+      Context->IntervalLast[Count] = Last;
+      Count++;
+    }
+  }
+
+  Context->IntervalCount = Count;
+  Context->IntervalHint = 0;
+  Context->Generation = Snapshot->Generation;
+  return EFI_SUCCESS;
+}
+
+//
+// Picks up changes to the snapshot, e.g. from SnapshotAllocatePages,
+// rebuilding the intervals only if something changed.
+//
+STATIC EFI_STATUS
+SyncIntervals (
+               IN OUT RANGE_CHECK_CONTEXT *Context
+               )
+{
+  EFI_STATUS Status;
+
+  if (!Context->Snapshot->Valid) {
+    Status = RevalidateMemoryMapSnapshot(Context->Snapshot);
+    if (EFI_ERROR(Status)) {
+      return Status;
+    }
+  }
+
+  if (Context->Generation != Context->Snapshot->Generation) {
+    return BuildIntervals(Context);
+  }
+
+  return EFI_SUCCESS;
 }
 
 EFI_STATUS
@@ -64,79 +139,100 @@ InitRangeCheckContext (
                        OUT RANGE_CHECK_CONTEXT *Context
                        )
 {
-  UINTN MapKey;
   EFI_STATUS Status;
-  UINT32 DescriptorVersion;
 
   Context->Enabled = Enabled;
   Context->WarnIfNotFound = WarnIfNotFound;
-  Context->MapSize = 0;
-  Context->MapPages = 0;
-  Context->DescriptorSize = 0;
-  Context->Map = NULL;
+  Context->Snapshot = NULL;
+  Context->Generation = 0;
+  Context->IntervalEntries = 0;
+  Context->IntervalCount = 0;
+  Context->IntervalHint = 0;
+  Context->IntervalStart = NULL;
+  Context->IntervalLast = NULL;
 
   if (!Enabled) {
     return EFI_SUCCESS;
   }
 
-  Status = gBS->GetMemoryMap(&Context->MapSize, NULL, &MapKey,
-                             &Context->DescriptorSize, &DescriptorVersion);
-  if (Status != EFI_BUFFER_TOO_SMALL) {
-    Print(L"%a: gBS->GetMemoryMap failed to size: %r\n",
-          __FUNCTION__, Status);
-    return EFI_UNSUPPORTED;
-  }
-
-  do {
-    //
-    // The UEFI specification advises to allocate more memory for
-    // the MemoryMap buffer between successive calls to GetMemoryMap(),
-    // since allocation of the new buffer may potentially increase
-    // memory map size.
-    //
-    Context->MapPages = EFI_SIZE_TO_PAGES(Context->MapSize) + 1;
-    Context->Map = AllocatePages(Context->MapPages);
-    if (Context->Map == NULL) {
-      Print(L"%a: AllocatePages failed\n", __FUNCTION__);
-      return EFI_OUT_OF_RESOURCES;
-    }
+  Status = GetMemoryMapSnapshot(&Context->Snapshot);
+  if (EFI_ERROR(Status)) {
+    Context->Enabled = FALSE;
+    return Status;
+  }
 
-    Status = gBS->GetMemoryMap(&Context->MapSize, Context->Map, &MapKey,
-                               &Context->DescriptorSize,
-                               &DescriptorVersion);
-    if (!EFI_ERROR(Status)) {
-      break;
-    }
+  Status = BuildIntervals(Context);
+  if (EFI_ERROR(Status)) {
+    CleanRangeCheckContext(Context);
+    return Status;
+  }
 
-    if (EFI_ERROR(Status)) {
-      CleanRangeCheckContext(Context);
+  return EFI_SUCCESS;
+}
 
-      if (Status != EFI_BUFFER_TOO_SMALL) {
-        Print(L"%a: gBS->GetMemoryMap failed: %r\n", __FUNCTION__,
-              Status);
-        return Status;
+//
+// Checks that [RangeStart, RangeLast] is inside one interval,
+// returning the first address that is not otherwise.
+//
+STATIC EFI_STATUS
+RangeLookup (
+             IN OUT RANGE_CHECK_CONTEXT *Context,
+             IN EFI_PHYSICAL_ADDRESS RangeStart,
+             IN EFI_PHYSICAL_ADDRESS RangeLast,
+             OUT EFI_PHYSICAL_ADDRESS *Unmapped
+             )
+{
+  UINTN Low;
+  UINTN Mid;
+  UINTN High;
+  UINTN Index;
+
+  //
+  // Ranges are usually checked close to each other, e.g. a table
+  // header and then the entire table, so try the last hit first.
+  //
+  Index = Context->IntervalHint;
+  if (Index >= Context->IntervalCount ||
+      RangeStart < Context->IntervalStart[Index] ||
+      RangeStart > Context->IntervalLast[Index]) {
+    Low = 0;
+    High = Context->IntervalCount;
+    while (Low < High) {
+      Mid = Low + (High - Low) / 2;
+      if (Context->IntervalStart[Mid] <= RangeStart) {
+        Low = Mid + 1;
+      } else {
+        High = Mid;
       }
     }
-  } while (1);
 
-  PerformQuickSort(Context->Map, Context->MapSize / Context->DescriptorSize,
-                   Context->DescriptorSize, MemoryMapSort);
+    if (Low == 0 || RangeStart > Context->IntervalLast[Low - 1]) {
+      *Unmapped = RangeStart;
+      return EFI_NOT_FOUND;
+    }
+
+    Index = Low - 1;
+    Context->IntervalHint = Index;
+  }
+
+  if (RangeLast > Context->IntervalLast[Index]) {
+    *Unmapped = Context->IntervalLast[Index] + 1;
+    return EFI_NOT_FOUND;
+  }
 
   return EFI_SUCCESS;
 }
 
 EFI_STATUS
 RangeIsMapped (
-               IN RANGE_CHECK_CONTEXT *Context,
+               IN OUT RANGE_CHECK_CONTEXT *Context,
                IN UINTN RangeStart,
                IN UINTN RangeLength
                )
 {
-
-  UINTN Index;
-  UINTN RangeNext;
-  UINTN RangePages;
-  EFI_MEMORY_DESCRIPTOR *Next;
+  EFI_STATUS Status;
+  EFI_PHYSICAL_ADDRESS RangeLast;
+  EFI_PHYSICAL_ADDRESS Unmapped;
 
   if (!Context->Enabled) {
     return EFI_SUCCESS;
@@ -147,39 +243,47 @@ RangeIsMapped (
     return EFI_INVALID_PARAMETER;
   }
 
-  RangePages = EFI_SIZE_TO_PAGES(RangeLength);
-
-  for (RangeNext = RangeStart, Next = Context->Map, Index = 0;
-       Index < (Context->MapSize / Context->DescriptorSize) &&
-         RangePages != 0;
-       Index++, Next = (VOID *)((UINTN)Next + Context->DescriptorSize)) {
-    UINTN NextLast = Next->PhysicalStart - 1 +
-      (Next->NumberOfPages * EFI_PAGE_SIZE);
+  RangeLast = (EFI_PHYSICAL_ADDRESS) RangeStart - 1 + RangeLength;
+  if (RangeLast < RangeStart) {
+    Print(L"0x%lx-0x%lx wraps around\n", RangeStart, RangeLast);
+    return EFI_INVALID_PARAMETER;
+  }
 
-    if (RangeNext < Next->PhysicalStart) {
-      break;
-    }
+  Status = SyncIntervals(Context);
+  if (EFI_ERROR(Status)) {
+    return Status;
+  }
 
-    if (RangeNext >= Next->PhysicalStart &&
-        RangeNext <= NextLast) {
-      UINTN RemPages = EFI_SIZE_TO_PAGES(NextLast - RangeNext + 1);
-      RemPages = MIN(RemPages, RangePages);
-      RangePages -= RemPages;
-      RangeNext += RemPages * EFI_PAGE_SIZE;
-    }
+  Status = RangeLookup(Context, RangeStart, RangeLast, &Unmapped);
+  if (Status == EFI_NOT_FOUND && Context->WarnIfNotFound) {
+    Print(L"0x%lx-0x%lx not in memory map (starting at 0x%lx)\n",
+          RangeStart, RangeLast, Unmapped);
   }
 
-  if (RangePages != 0) {
-    if (Context->WarnIfNotFound) {
-      Print(L"0x%lx-0x%lx not in memory map (starting at 0x%lx)\n",
-            RangeStart,
-            RangeLength - 1 + RangeStart,
-            RangeNext);
-    }
+  return Status;
+}
 
-    return EFI_NOT_FOUND;
+//
+// Validates Count ranges in one call, setting the Status of each.
+// Returns the Status of the first range that failed, if any.
+//
+EFI_STATUS
+RangesAreMapped (
+                 IN OUT RANGE_CHECK_CONTEXT *Context,
+                 IN OUT RANGE_CHECK_RANGE *Ranges,
+                 IN UINTN Count
+                 )
+{
+  UINTN Index;
+  EFI_STATUS Status;
+
+  for (Status = EFI_SUCCESS, Index = 0; Index < Count; Index++) {
+    Ranges[Index].Status = RangeIsMapped(Context, Ranges[Index].Start,
+                                         Ranges[Index].Length);
+    if (Status == EFI_SUCCESS) {
+      Status = Ranges[Index].Status;
+    }
   }
 
-  return EFI_SUCCESS;
+  return Status;
 }
-
@@ -11,6 +11,7 @@
  */
 
 #include <Uefi.h>
+#include <Library/BaseLib.h>
 #include <Library/UefiLib.h>
 #include <Library/BaseMemoryLib.h>
 #include <Library/UtilsLib.h>
@@ -85,21 +86,121 @@ GetOpt(IN UINTN Argc,
   return EFI_SUCCESS;
 }
 
+//
+// Waits for the outstanding asynchronous write, if any.
+//
+STATIC EFI_STATUS
+FileSaveWait (
+              IN OUT FILE_SAVE_SESSION *Session
+              )
+{
+  UINTN Index;
+  EFI_STATUS Status;
+
+  if (!Session->Pending) {
+    return EFI_SUCCESS;
+  }
+
+  gBS->WaitForEvent(1, &Session->Token.Event, &Index);
+  Session->Pending = FALSE;
+  Status = Session->Token.Status;
+  if (!EFI_ERROR(Status) &&
+      Session->Token.BufferSize != Session->PendingSize) {
+    Status = EFI_DEVICE_ERROR;
+  }
+
+  return Status;
+}
+
+//
+// Closes the file being saved, once the writes are done, truncating
+// it if it used to be longer.
+//
 EFI_STATUS
-FileSystemSave (
-                IN EFI_HANDLE Handle,
-                IN CHAR16 *VolSubDir,
-                IN CHAR16 *Path,
-                IN VOID *Table,
-                IN UINTN TableSize
-               )
+FileSaveSessionEnd (
+                    IN OUT FILE_SAVE_SESSION *Session
+                    )
 {
+  UINT64 End;
+  UINTN InfoSize;
   EFI_STATUS Status;
-  EFI_SIMPLE_FILE_SYSTEM_PROTOCOL *FsProtocol;
-  EFI_FILE_PROTOCOL *Fs;
-  EFI_FILE_PROTOCOL *Dir;
+  EFI_FILE_INFO *Info;
   EFI_FILE_PROTOCOL *File;
-  UINTN Size;
+
+  End = 0;
+  File = Session->File;
+  if (File == NULL) {
+    return EFI_SUCCESS;
+  }
+
+  Status = FileSaveWait(Session);
+  if (!EFI_ERROR(Session->FileStatus)) {
+    Session->FileStatus = Status;
+  }
+  Status = Session->FileStatus;
+
+  //
+  // Instead of deleting and recreating an existing file, it is
+  // overwritten in place, and only needs to be truncated if it
+  // was longer.
+  //
+  if (!EFI_ERROR(Status)) {
+    Status = File->SetPosition(File, MAX_UINT64);
+    if (!EFI_ERROR(Status)) {
+      Status = File->GetPosition(File, &End);
+    }
+  }
+
+  if (!EFI_ERROR(Status) && End > Session->Size) {
+    InfoSize = 0;
+    Status = File->GetInfo(File, &gEfiFileInfoGuid, &InfoSize, NULL);
+    if (Status == EFI_BUFFER_TOO_SMALL) {
+      Info = AllocatePool(InfoSize);
+      if (Info == NULL) {
+        Status = EFI_OUT_OF_RESOURCES;
+      } else {
+        Status = File->GetInfo(File, &gEfiFileInfoGuid, &InfoSize, Info);
+        if (!EFI_ERROR(Status)) {
+          Info->FileSize = Session->Size;
+          Status = File->SetInfo(File, &gEfiFileInfoGuid, InfoSize, Info);
+        }
+        FreePool(Info);
+      }
+    }
+  }
+
+  if (EFI_ERROR(Status)) {
+    Print(L"Writing '\\%s\\%s' failed: %r\n", Session->VolSubDir,
+          Session->Path, Status);
+  }
+
+  File->Close(File);
+  Session->File = NULL;
+  return Status;
+}
+
+//
+// Opens VolSubDir on the file system the handle is on, creating
+// it if needed, for saving any number of files with FileSaveSessionSave.
+//
+// With Async, the last chunk of each file is written with WriteEx
+// and only waited for on the next save or on close, if the file
+// system supports it. The buffer then needs to stay valid until then.
+//
+EFI_STATUS
+FileSaveSessionOpen (
+                     IN EFI_HANDLE Handle,
+                     IN CHAR16 *VolSubDir,
+                     IN BOOLEAN Async,
+                     OUT FILE_SAVE_SESSION *Session
+                     )
+{
+  EFI_STATUS Status;
+  EFI_SIMPLE_FILE_SYSTEM_PROTOCOL *FsProtocol;
+
+  ZeroMem(Session, sizeof(*Session));
+  Session->VolSubDir = VolSubDir;
+  Session->ChunkSize = FILE_SAVE_CHUNK_SIZE;
 
   Status = gBS->HandleProtocol(Handle, &gEfiSimpleFileSystemProtocolGuid,
                                (void **) &FsProtocol);
@@ -108,56 +209,206 @@ FileSystemSave (
     return Status;
   }
 
-  Status = FsProtocol->OpenVolume(FsProtocol, &Fs);
+  Status = FsProtocol->OpenVolume(FsProtocol, &Session->Fs);
   if (Status != EFI_SUCCESS) {
     Print(L"Could not open volume: %r\n", Status);
     return Status;
   }
 
-  Status = Fs->Open(Fs, &Dir, VolSubDir, EFI_FILE_MODE_CREATE |
-                     EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE,
-                     EFI_FILE_DIRECTORY);
+  Status = Session->Fs->Open(Session->Fs, &Session->Dir, VolSubDir,
+                             EFI_FILE_MODE_CREATE | EFI_FILE_MODE_READ |
+                             EFI_FILE_MODE_WRITE, EFI_FILE_DIRECTORY);
   if (Status != EFI_SUCCESS) {
     Print(L"Could not open '\\%s': %r\n", VolSubDir, Status);
+    Session->Fs->Close(Session->Fs);
+    Session->Fs = NULL;
     return Status;
   }
 
-  if (Dir->Open(Dir, &File, Path, EFI_FILE_MODE_READ |
-                EFI_FILE_MODE_WRITE, 0) == EFI_SUCCESS) {
-    /*
-     * Delete existing file.
-     */
-    Print(L"Overwriting existing'\\%s\\%s': %r\n", VolSubDir, Path);
-    Status = Dir->Delete(File);
-    File = NULL;
-    if (Status != EFI_SUCCESS) {
-      Print(L"Could not delete existing '\\%s\\%s': %r\n", VolSubDir, Path, Status);
-      goto closeDir;
+  if (Async && Session->Dir->Revision >= EFI_FILE_PROTOCOL_REVISION2 &&
+      gBS->CreateEvent(0, 0, NULL, NULL,
+                       &Session->Token.Event) == EFI_SUCCESS) {
+    Session->Async = TRUE;
+  }
+
+  return EFI_SUCCESS;
+}
+
+//
+// Starts saving a file, to be written with FileSaveSessionAppend
+// and finished with FileSaveSessionEnd. Any file still being
+// saved is finished first.
+//
+EFI_STATUS
+FileSaveSessionBegin (
+                      IN OUT FILE_SAVE_SESSION *Session,
+                      IN CHAR16 *Path
+                      )
+{
+  EFI_STATUS Status;
+  EFI_FILE_PROTOCOL *File;
+
+  //
+  // Failures for the previous file have already been reported.
+  //
+  FileSaveSessionEnd(Session);
+
+  Status = Session->Dir->Open(Session->Dir, &File, Path,
+                              EFI_FILE_MODE_CREATE | EFI_FILE_MODE_READ |
+                              EFI_FILE_MODE_WRITE, 0);
+  if (Status != EFI_SUCCESS) {
+    Print(L"Could not open '\\%s\\%s': %r\n", Session->VolSubDir, Path,
+          Status);
+    return Status;
+  }
+
+  Session->File = File;
+  Session->FileStatus = EFI_SUCCESS;
+  Session->Size = 0;
+  StrnCpyS(Session->Path, ARRAY_SIZE(Session->Path), Path,
+           ARRAY_SIZE(Session->Path) - 1);
+  return EFI_SUCCESS;
+}
+
+//
+// Writes Size bytes at the end of the file being saved. In an
+// asynchronous session, the buffer needs to stay valid until
+// the next call.
+//
+EFI_STATUS
+FileSaveSessionAppend (
+                       IN OUT FILE_SAVE_SESSION *Session,
+                       IN VOID *Buffer,
+                       IN UINTN Size
+                       )
+{
+  UINTN Chunk;
+  UINTN Offset;
+  UINTN Written;
+  EFI_STATUS Status;
+  EFI_FILE_PROTOCOL *File;
+
+  File = Session->File;
+  if (File == NULL) {
+    return EFI_NOT_READY;
+  }
+
+  Status = FileSaveWait(Session);
+  if (!EFI_ERROR(Session->FileStatus)) {
+    Session->FileStatus = Status;
+  }
+
+  for (Offset = 0; Offset < Size && !EFI_ERROR(Session->FileStatus);
+       Offset += Chunk) {
+    Chunk = MIN(Size - Offset, Session->ChunkSize);
+
+    if (Session->Async && Offset + Chunk == Size) {
+      Session->Token.Status = EFI_SUCCESS;
+      Session->Token.Buffer = (UINT8 *) Buffer + Offset;
+      Session->Token.BufferSize = Chunk;
+      Session->PendingSize = Chunk;
+      Session->FileStatus = File->WriteEx(File, &Session->Token);
+      Session->Pending = !EFI_ERROR(Session->FileStatus);
+    } else {
+      Written = Chunk;
+      Session->FileStatus = File->Write(File, &Written,
+                                        (UINT8 *) Buffer + Offset);
+      if (Session->FileStatus == EFI_SUCCESS && Written != Chunk) {
+        Session->FileStatus = EFI_DEVICE_ERROR;
+      }
+    }
+
+    if (!EFI_ERROR(Session->FileStatus)) {
+      Session->Size += Chunk;
     }
   }
 
-  Status = Dir->Open(Dir, &File, Path, EFI_FILE_MODE_CREATE | EFI_FILE_MODE_READ |
-                      EFI_FILE_MODE_WRITE, 0);
+  return Session->FileStatus;
+}
+
+EFI_STATUS
+FileSaveSessionSave (
+                     IN OUT FILE_SAVE_SESSION *Session,
+                     IN CHAR16 *Path,
+                     IN VOID *Buffer,
+                     IN UINTN Size
+                     )
+{
+  EFI_STATUS Status;
+
+  Status = FileSaveSessionBegin(Session, Path);
   if (Status != EFI_SUCCESS) {
-    Print(L"Could not open '\\%s\\%s': %r\n", VolSubDir, Path, Status);
-    goto closeDir;
     return Status;
   }
 
-  Size = TableSize;
-  Status = File->Write(File, &Size, (void *) Table);
-  if (Status != EFI_SUCCESS || Size != TableSize) {
-    Print(L"Writing '\\%s\\%s' failed: %r\n", VolSubDir, Path, Status);
-  } else {
-    File->Flush(File);
+  FileSaveSessionAppend(Session, Buffer, Size);
+
+  //
+  // With async writes, finishing is left to the next
+  // save or to FileSaveSessionClose.
+  //
+  if (Session->Pending) {
+    return EFI_SUCCESS;
+  }
+
+  return FileSaveSessionEnd(Session);
+}
+
+//
+// Waits for any outstanding write, and flushes everything
+// to the device once, instead of once per file.
+//
+EFI_STATUS
+FileSaveSessionClose (
+                      IN OUT FILE_SAVE_SESSION *Session
+                      )
+{
+  EFI_STATUS Status;
+
+  Status = FileSaveSessionEnd(Session);
+
+  if (Session->Dir != NULL) {
+    Session->Dir->Flush(Session->Dir);
+    Session->Dir->Close(Session->Dir);
+    Session->Dir = NULL;
+  }
+
+  if (Session->Fs != NULL) {
+    Session->Fs->Close(Session->Fs);
+    Session->Fs = NULL;
+  }
+
+  if (Session->Token.Event != NULL) {
+    gBS->CloseEvent(Session->Token.Event);
+    Session->Token.Event = NULL;
   }
 
-  Dir->Close(File);
- closeDir:
-  Fs->Close(Dir);
   return Status;
 }
 
+EFI_STATUS
+FileSystemSave (
+                IN EFI_HANDLE Handle,
+                IN CHAR16 *VolSubDir,
+                IN CHAR16 *Path,
+                IN VOID *Table,
+                IN UINTN TableSize
+               )
+{
+  EFI_STATUS Status;
+  EFI_STATUS CloseStatus;
+  FILE_SAVE_SESSION Session;
+
+  Status = FileSaveSessionOpen(Handle, VolSubDir, FALSE, &Session);
+  if (Status != EFI_SUCCESS) {
+    return Status;
+  }
+
+  Status = FileSaveSessionSave(&Session, Path, Table, TableSize);
+  CloseStatus = FileSaveSessionClose(&Session);
+  return Status != EFI_SUCCESS ? Status : CloseStatus;
+}
+
 VOID *
 GetTable (
           IN EFI_GUID *Guid